@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "bench.h"
+
+/* core symbols normally provided by bot.c */
+struct _modules_head modules_head;
+struct bot_module *_bot_context = NULL;
+
+FILE *bench_out = NULL;
+unsigned long bench_allocs = 0;
+unsigned long bench_excluded = 0;
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+void *malloc(size_t size)
+{
+    bench_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    bench_allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    bench_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+int bot_require(const char *name, int version)
+{
+    return 1;
+}
+
+int bench_last_fd = -1;
+
+void bot_register_fd(int sock)
+{
+    bench_last_fd = sock;
+}
+
+void bot_unregister_fd(int sock)
+{
+}
+
+void bot_want_write(int sock, int on)
+{
+}
+
+int bot_shedding = 0;
+
+void bot_wakeup()
+{
+}
+
+int bot_shed(CTX ctx)
+{
+    return bot_shedding && ctx && ctx->shed;
+}
+
+METRIC bot_cb_metric(const char *dispatch)
+{
+    return metrics_histogram("bench_callback_duration_seconds", dispatch);
+}
+
+CTX bench_ctx(const char *name)
+{
+    CTX ctx = calloc(sizeof(struct bot_module), 1);
+
+    ctx->name = strdup(name);
+    ctx->log_level = LOG_ERROR;
+
+    return ctx;
+}
+
+/* keep the code under test from logging into the results */
+void bench_quiet()
+{
+    log_level = LOG_ERROR;
+}
+
+void bench_run(const char *name, BENCH_FN fn, unsigned long lines)
+{
+    unsigned long ops = 1, start, ns, allocs;
+
+    for (;;)
+    {
+        allocs = bench_allocs;
+        bench_excluded = 0;
+        start = metrics_now();
+        fn(ops);
+        ns = metrics_now() - start - bench_excluded;
+        allocs = bench_allocs - allocs;
+
+        if (ns >= BENCH_MIN_NS || ops >= (1UL << 30))
+        {
+            break;
+        }
+
+        ops *= 2;
+    }
+
+    if (bench_out == NULL)
+    {
+        bench_out = stdout;
+    }
+
+    fprintf(bench_out, "bench=%s rev=%s ops=%lu ns_op=%.1f", name, GIT_REV, ops, (double)ns / ops);
+
+    if (lines)
+    {
+        fprintf(bench_out, " lines_sec=%.0f", ops * lines / (ns / 1e9));
+    }
+
+    fprintf(bench_out, " allocs_op=%.3f\n", (double)allocs / ops);
+    fflush(bench_out);
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Microbenchmark harness.
+ *
+ * Every benchmark is run with a doubling op count until it takes at least
+ * BENCH_MIN_NS, the final run is reported as one line of key=value pairs:
+ *
+ *   bench=<name> rev=<git rev> ops=<n> ns_op=<ns> lines_sec=<n> allocs_op=<n>
+ *
+ * Allocations are counted by replacing malloc and friends, so allocations
+ * made inside libc (strdup, regexec) are included.
+ */
+
+#include "../bot.h"
+
+#define BENCH_MIN_NS 250000000UL
+
+typedef void (*BENCH_FN)(unsigned long ops);
+
+extern FILE *bench_out;                 /* results, stdout by default */
+extern unsigned long bench_allocs;
+extern unsigned long bench_excluded;    /* setup time (ns) not to be counted */
+extern int bench_last_fd;               /* the last socket given to bot_register_fd */
+
+/* lines is how many input lines one op processes, 0 to omit lines_sec */
+void bench_run(const char *name, BENCH_FN fn, unsigned long lines);
+void bench_quiet();
+CTX bench_ctx(const char *name);
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* bouncer_process fanning a line out to 1, 8 and 32 attached clients */
+
+#include "bench.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define CLIENTS 32
+#define FLUSH   64
+
+void bouncer_process(const char *line);
+void bouncer_read(int sock);
+void bouncer_idle();
+int bouncer_init(CTX ctx);
+int irc_init(CTX ctx);
+int server_init(CTX ctx);
+
+static int listen_fd;
+static int client_fd[CLIENTS];
+static int clients = 0;
+
+static void bench_drain()
+{
+    char buf[65536];
+    unsigned long start = metrics_now();
+    int i;
+
+    bouncer_idle();
+
+    /* reading what the clients got isn't the bouncer's time */
+    for (i = 0; i < clients; i++)
+    {
+        while (recv(client_fd[i], buf, sizeof(buf), MSG_DONTWAIT) > 0);
+    }
+
+    bench_excluded += metrics_now() - start;
+}
+
+static void bench_fanout(unsigned long ops)
+{
+    unsigned long i;
+
+    for (i = 0; i < ops; i++)
+    {
+        bouncer_process(":nick!user@host.example.org PRIVMSG #channel :hello there");
+
+        if (i % FLUSH == FLUSH - 1)
+        {
+            bench_drain();
+        }
+    }
+
+    bench_drain();
+}
+
+static void bench_attach(const char *path)
+{
+    struct sockaddr_un sun;
+    char reg[128];
+    int len;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+
+    client_fd[clients] = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (connect(client_fd[clients], (struct sockaddr *)&sun, sizeof(sun)) < 0)
+    {
+        perror("connect");
+        exit(1);
+    }
+
+    bouncer_read(listen_fd);
+
+    len = snprintf(reg, sizeof(reg), "PASS bench\r\nNICK client%d\r\nUSER u 0 * :bench\r\n", clients);
+    if (send(client_fd[clients], reg, len, 0) != len)
+    {
+        perror("send");
+        exit(1);
+    }
+
+    bouncer_read(bench_last_fd);
+    clients++;
+}
+
+int main(int argc, char **argv)
+{
+    static const int counts[] = { 1, 8, CLIENTS };
+    char file[] = "/tmp/corebot-bench-XXXXXX";
+    char path[64], name[64];
+    CTX ctx;
+    FILE *fh;
+    int fd, i;
+
+    bench_quiet();
+
+    if ((fd = mkstemp(file)) < 0)
+    {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    snprintf(path, sizeof(path), "%s.sock", file);
+
+    fh = fopen(file, "w");
+    fprintf(fh, "[bouncer]\nlisten = %s\npassword = bench\n", path);
+    fclose(fh);
+    config_load(file);
+
+    server_init(NULL);
+    ctx = bench_ctx("irc");
+    bot_ctx(ctx);
+    irc_init(ctx);
+
+    ctx = bench_ctx("bouncer");
+    bot_ctx(ctx);
+
+    if (bouncer_init(ctx) < 1)
+    {
+        fprintf(stderr, "bouncer_init failed\n");
+        return 1;
+    }
+
+    listen_fd = bench_last_fd;
+
+    for (i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); i++)
+    {
+        while (clients < counts[i])
+        {
+            bench_attach(path);
+        }
+
+        bench_drain();
+
+        snprintf(name, sizeof(name), "bouncer_fanout_%d", clients);
+        bench_run(name, bench_fanout, 1);
+    }
+
+    unlink(path);
+    unlink(file);
+
+    return 0;
+}
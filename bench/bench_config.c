@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* config_get lookups of existing keys at various config sizes */
+
+#include "bench.h"
+
+#include <unistd.h>
+
+#define SECTIONS 8
+
+static int keys;
+static CTX ctxs[SECTIONS];
+
+static void config_generate(const char *file, int n)
+{
+    FILE *fh = fopen(file, "w");
+    int i, j;
+
+    for (i = 0; i < n / SECTIONS; i++)
+    {
+        fprintf(fh, "key%d = root%d\n", i, i);
+    }
+
+    for (j = 0; j < SECTIONS; j++)
+    {
+        fprintf(fh, "[section%c]\n", 'a' + j);
+        for (i = 0; i < n / SECTIONS; i++)
+        {
+            fprintf(fh, "key%d = \"value %d\"\n", i, i);
+        }
+    }
+
+    fclose(fh);
+}
+
+static void bench_get(unsigned long ops)
+{
+    char key[32];
+    unsigned long i;
+
+    for (i = 0; i < ops; i++)
+    {
+        snprintf(key, sizeof(key), "key%lu", i % keys);
+        bot_ctx(ctxs[i % SECTIONS]);
+        if (config_get(key) == NULL)
+        {
+            fprintf(stderr, "missing %s\n", key);
+            exit(1);
+        }
+        bot_ctx(NULL);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const int sizes[] = { 16, 128, 1024, 8192 };
+    char file[] = "/tmp/corebot-bench-XXXXXX";
+    char name[64];
+    int fd, i;
+
+    bench_quiet();
+
+    for (i = 0; i < SECTIONS; i++)
+    {
+        snprintf(name, sizeof(name), "section%c", 'a' + i);
+        ctxs[i] = bench_ctx(name);
+    }
+
+    if ((fd = mkstemp(file)) < 0)
+    {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+    {
+        config_generate(file, sizes[i]);
+        config_load(file);
+        keys = sizes[i] / SECTIONS;
+
+        snprintf(name, sizeof(name), "config_get_%d", sizes[i]);
+        bench_run(name, bench_get, 0);
+
+        config_free();
+    }
+
+    unlink(file);
+
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* irc_process with N modules each having one IRC_CB registered */
+
+#include "bench.h"
+#include "../modules/irc.h"
+
+void irc_process(const char *line);
+int irc_init(CTX ctx);
+int server_init(CTX ctx);
+
+static unsigned long hits = 0;
+
+/* irc_register_cb() ignores duplicates, every module needs its own function */
+#define CB(n) static void cb_##n(const char *p, const char *c, const char *a, const char *t) { hits++; }
+#define CB8(n) CB(n##0) CB(n##1) CB(n##2) CB(n##3) CB(n##4) CB(n##5) CB(n##6) CB(n##7)
+#define REF8(n) cb_##n##0, cb_##n##1, cb_##n##2, cb_##n##3, cb_##n##4, cb_##n##5, cb_##n##6, cb_##n##7
+
+CB8(1) CB8(2) CB8(3) CB8(4) CB8(5) CB8(6) CB8(7) CB8(8)
+CB8(9) CB8(a) CB8(b) CB8(c) CB8(d) CB8(e) CB8(f) CB8(g)
+
+static IRC_CB cbs[] = {
+    REF8(1), REF8(2), REF8(3), REF8(4), REF8(5), REF8(6), REF8(7), REF8(8),
+    REF8(9), REF8(a), REF8(b), REF8(c), REF8(d), REF8(e), REF8(f), REF8(g)
+};
+
+#define NCBS (int)(sizeof(cbs) / sizeof(cbs[0]))
+
+static void bench_dispatch(unsigned long ops)
+{
+    unsigned long i;
+
+    for (i = 0; i < ops; i++)
+    {
+        irc_process(":nick!user@host.example.org PRIVMSG #channel :hello there");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const int counts[] = { 0, 1, 8, 32, NCBS };
+    char name[64];
+    CTX irc;
+    int i, n = 0;
+
+    bench_quiet();
+
+    server_init(NULL);
+    irc = bench_ctx("irc");
+    bot_ctx(irc);
+    irc_init(irc);
+    bot_ctx(NULL);
+
+    for (i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); i++)
+    {
+        for (; n < counts[i]; n++)
+        {
+            snprintf(name, sizeof(name), "mod%d", n);
+            bot_ctx(bench_ctx(name));
+            irc_register_cb(cbs[n]);
+            bot_ctx(NULL);
+        }
+
+        snprintf(name, sizeof(name), "irc_dispatch_%d", n);
+        bench_run(name, bench_dispatch, 1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* irc_process parsing cost, no callbacks registered but one for members */
+
+#include "bench.h"
+#include "../modules/irc.h"
+
+void irc_process(const char *line);
+int irc_init(CTX ctx);
+int server_init(CTX ctx);
+
+static const char *lines[] = {
+    ":nick!user@host.example.org PRIVMSG #channel :hello there, how is everyone doing today?",
+    ":nick!user@host.example.org JOIN #channel",
+    ":server.example.org 353 corebot = #channel :@op +voice nick1 nick2 nick3 nick4 nick5",
+    "PING :server.example.org",
+    ":nick!user@host.example.org NOTICE corebot :\001VERSION\001",
+    ":nick!user@host.example.org MODE #channel +o other",
+    ":nick!user@host.example.org PART #channel :Leaving",
+    ":server.example.org 372 corebot :- message of the day line that is fairly long as they usually are"
+};
+
+#define NLINES (sizeof(lines) / sizeof(lines[0]))
+
+/* a full NAMES reply line from a bulk join */
+static const char *names = ":server.example.org 353 corebot = #channel :@op +voice nick01 nick02 nick03 nick04 nick05 nick06 "
+    "nick07 nick08 nick09 nick10 nick11 nick12 nick13 nick14 nick15 nick16 nick17 nick18 nick19 nick20 nick21 nick22 nick23 "
+    "nick24 nick25 nick26 nick27 nick28 nick29 nick30 nick31 nick32 nick33 nick34 nick35 nick36 nick37 nick38 nick39 nick40";
+
+static unsigned long members_seen;
+
+static void bench_members(const char *channel, const struct irc_member *members, int n)
+{
+    members_seen += n;
+}
+
+static void bench_parse(unsigned long ops)
+{
+    unsigned long i;
+
+    for (i = 0; i < ops; i++)
+    {
+        irc_process(lines[i % NLINES]);
+    }
+}
+
+static void bench_privmsg(unsigned long ops)
+{
+    unsigned long i;
+
+    for (i = 0; i < ops; i++)
+    {
+        irc_process(lines[0]);
+    }
+}
+
+static void bench_names(unsigned long ops)
+{
+    unsigned long i;
+
+    for (i = 0; i < ops; i++)
+    {
+        irc_process(names);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bench_quiet();
+
+    server_init(NULL);
+    irc_init(NULL);
+    irc_register_members(bench_members);
+
+    bench_run("irc_process_mixed", bench_parse, 1);
+    bench_run("irc_process_privmsg", bench_privmsg, 1);
+    bench_run("irc_process_names", bench_names, 1);
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* log_printf to /dev/null and the cost of a disabled trace point */
+
+#include "bench.h"
+
+#include <unistd.h>
+
+static CTX mod;
+
+static void bench_printf(unsigned long ops)
+{
+    unsigned long i;
+
+    for (i = 0; i < ops; i++)
+    {
+        log_printf("a typical log line with a number %lu and a %s\n", i, "string");
+    }
+}
+
+static void bench_disabled(unsigned long ops)
+{
+    unsigned long i;
+
+    for (i = 0; i < ops; i++)
+    {
+        /* keep the check from being hoisted out of the loop */
+        __asm__ __volatile__("" ::: "memory");
+
+        if (log_enabled(LOG_TRACE))
+        {
+            log_lprintf(LOG_TRACE, "-> %lu\n", i);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bench_out = fdopen(dup(fileno(stdout)), "w");
+
+    if (bench_out == NULL || freopen("/dev/null", "w", stdout) == NULL)
+    {
+        perror("/dev/null");
+        return 1;
+    }
+
+    mod = bench_ctx("bench");
+    mod->log_level = LOG_INFO;
+    bot_ctx(mod);
+
+    bench_run("log_printf", bench_printf, 0);
+    bench_run("log_trace_disabled", bench_disabled, 0);
+
+    bot_ctx(NULL);
+
+    return 0;
+}
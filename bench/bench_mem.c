@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* per-line scratch copies and small objects: malloc against accounted malloc, arena and pool */
+
+#include "bench.h"
+
+/* what a handler keeping a few pieces of a PRIVMSG would copy */
+static const char *pieces[] = { "nick", "#channel", "some words from the trailing part", "user@host.example.org" };
+#define PIECES (sizeof(pieces) / sizeof(pieces[0]))
+
+static void bench_malloc(unsigned long ops)
+{
+    char *keep[PIECES];
+    unsigned long i;
+    unsigned int j;
+
+    for (i = 0; i < ops; i++)
+    {
+        for (j = 0; j < PIECES; j++)
+        {
+            keep[j] = malloc(strlen(pieces[j]) + 1);
+            strcpy(keep[j], pieces[j]);
+        }
+
+        for (j = 0; j < PIECES; j++)
+        {
+            free(keep[j]);
+        }
+    }
+}
+
+static void bench_bot_malloc(unsigned long ops)
+{
+    char *keep[PIECES];
+    unsigned long i;
+    unsigned int j;
+
+    for (i = 0; i < ops; i++)
+    {
+        for (j = 0; j < PIECES; j++)
+        {
+            keep[j] = bot_strdup(pieces[j]);
+        }
+
+        for (j = 0; j < PIECES; j++)
+        {
+            bot_free(keep[j]);
+        }
+    }
+}
+
+static void bench_arena(unsigned long ops)
+{
+    unsigned long i;
+    unsigned int j;
+
+    for (i = 0; i < ops; i++)
+    {
+        for (j = 0; j < PIECES; j++)
+        {
+            line_strdup(pieces[j]);
+        }
+
+        arena_reset(&line_arena);
+    }
+}
+
+static void bench_pool(unsigned long ops)
+{
+    static struct pool pool;
+    void *keep[PIECES];
+    unsigned long i;
+    unsigned int j;
+
+    pool_init(&pool, 48);
+
+    for (i = 0; i < ops; i++)
+    {
+        for (j = 0; j < PIECES; j++)
+        {
+            keep[j] = pool_get(&pool);
+        }
+
+        for (j = 0; j < PIECES; j++)
+        {
+            pool_put(&pool, keep[j]);
+        }
+    }
+
+    pool_free(&pool);
+}
+
+int main(int argc, char **argv)
+{
+    bench_quiet();
+
+    bench_run("mem_malloc", bench_malloc, 1);
+    bench_run("mem_bot_malloc", bench_bot_malloc, 1);
+    bench_run("mem_arena", bench_arena, 1);
+    bench_run("mem_pool", bench_pool, 1);
+
+    arena_free(&line_arena);
+
+    return 0;
+}
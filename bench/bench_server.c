@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * server_read line splitting and dispatch to one callback, on a synthetic
+ * stream or on a captured one given as the first argument (one line per
+ * text line, CRLF is added when missing).
+ */
+
+#include "bench.h"
+#include "../modules/server.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define CHUNK 65536
+
+int server_init(CTX ctx);
+void server_read(int read);
+
+static char *stream = NULL;
+static size_t stream_len = 0;
+static unsigned long stream_lines = 0;
+static unsigned long seen = 0;
+static int fds[2];
+static METRIC received;
+
+static void bench_line(const char *line)
+{
+    seen++;
+}
+
+static void stream_append(const char *line, size_t len)
+{
+    stream = realloc(stream, stream_len + len + 2);
+    memcpy(stream + stream_len, line, len);
+    stream_len += len;
+    stream[stream_len++] = '\r';
+    stream[stream_len++] = '\n';
+    stream_lines++;
+}
+
+static void stream_synthetic()
+{
+    char line[512];
+    int i, len;
+
+    for (i = 0; i < 20000; i++)
+    {
+        len = snprintf(line, sizeof(line), ":nick%d!user@host%d.example.org PRIVMSG #channel%d :%.*s",
+                i % 97, i % 13, i % 7, 20 + (i * 37) % 380,
+                "lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor incididunt ut labore "
+                "et dolore magna aliqua ut enim ad minim veniam quis nostrud exercitation ullamco laboris nisi ut "
+                "aliquip ex ea commodo consequat duis aute irure dolor in reprehenderit in voluptate velit esse "
+                "cillum dolore eu fugiat nulla pariatur excepteur sint occaecat cupidatat non proident sunt in");
+        stream_append(line, len);
+    }
+}
+
+static int stream_load(const char *file)
+{
+    char line[1024];
+    FILE *fh;
+
+    if ((fh = fopen(file, "r")) == NULL)
+    {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fh))
+    {
+        stream_append(line, strcspn(line, "\r\n"));
+    }
+
+    fclose(fh);
+
+    return 1;
+}
+
+/* one op pushes the whole stream through server_read, only reads are timed */
+static void bench_split(unsigned long ops)
+{
+    unsigned long i, start;
+    size_t off, len;
+    double want;
+
+    for (i = 0; i < ops; i++)
+    {
+        for (off = 0; off < stream_len; off += len)
+        {
+            len = stream_len - off < CHUNK ? stream_len - off : CHUNK;
+
+            start = metrics_now();
+            if (write(fds[0], stream + off, len) != (ssize_t)len)
+            {
+                perror("write");
+                exit(1);
+            }
+            bench_excluded += metrics_now() - start;
+
+            want = received->value + len;
+            while (received->value < want)
+            {
+                server_read(fds[1]);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int size = CHUNK * 4;
+
+    bench_quiet();
+
+    if (argc > 1 ? !stream_load(argv[1]) : (stream_synthetic(), 0))
+    {
+        fprintf(stderr, "error reading %s\n", argv[1]);
+        return 1;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+        perror("socketpair");
+        return 1;
+    }
+
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    server_init(NULL);
+    server_register_cb(bench_line);
+    received = metrics_counter("corebot_server_received_bytes_total", NULL);
+
+    bench_run(argc > 1 ? "server_read_captured" : "server_read_synthetic", bench_split, stream_lines);
+
+    if (seen % stream_lines)
+    {
+        fprintf(stderr, "line count mismatch: %lu lines for a %lu line stream\n", seen, stream_lines);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* inbound encoding stage: validating and transcoding one line */
+
+#include "bench.h"
+
+static const char *ascii = ":nick!user@host.example.org PRIVMSG #channel :just a plain line of chat with nothing special in it";
+static const char *utf8 = ":nick!user@host.example.org PRIVMSG #channel :h\xc3\xa4n sanoi \xe2\x82\xac ja l\xc3\xa4hti kotiin \xf0\x9f\x98\x80 heti";
+static const char *latin1 = ":nick!user@host.example.org PRIVMSG #channel :h\xe4n sanoi \x80 ja l\xe4hti kotiin heti, \xb4kiva\xb4 p\xe4iv\xe4";
+
+static int len_ascii, len_utf8, len_latin1;
+static volatile int sink;
+
+static void bench_ascii(unsigned long ops)
+{
+    unsigned long i;
+
+    for (i = 0; i < ops; i++)
+    {
+        sink = utf8_check(ascii, len_ascii);
+    }
+}
+
+static void bench_utf8(unsigned long ops)
+{
+    unsigned long i;
+
+    for (i = 0; i < ops; i++)
+    {
+        sink = utf8_check(utf8, len_utf8);
+    }
+}
+
+static void bench_latin1(unsigned long ops)
+{
+    char out[3 * 512 + 1];
+    unsigned long i;
+
+    for (i = 0; i < ops; i++)
+    {
+        if (utf8_check(latin1, len_latin1) == ENC_INVALID)
+        {
+            sink = utf8_from(ENC_CP1252, latin1, len_latin1, out);
+        }
+    }
+}
+
+static void bench_encode(unsigned long ops)
+{
+    char out[512];
+    unsigned long i;
+
+    for (i = 0; i < ops; i++)
+    {
+        sink = utf8_to(ENC_CP1252, utf8, len_utf8, out);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bench_quiet();
+
+    len_ascii = strlen(ascii);
+    len_utf8 = strlen(utf8);
+    len_latin1 = strlen(latin1);
+
+    bench_run("utf8_check_ascii", bench_ascii, 1);
+    bench_run("utf8_check_utf8", bench_utf8, 1);
+    bench_run("utf8_transcode_cp1252", bench_latin1, 1);
+    bench_run("utf8_encode_cp1252", bench_encode, 1);
+
+    return 0;
+}
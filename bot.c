@@ -23,34 +23,183 @@
 #include <string.h>
 #include <unistd.h>
 
-#include <sys/select.h>
+#include <poll.h>
 
 #include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
 
+#define BOT_CONFIG "corebot.ini"
+
+struct _modules_head modules_head;
 struct bot_module *_bot_context = NULL;
 int bot_next_die = 0;
+static volatile sig_atomic_t bot_next_reload = 0;
+static volatile sig_atomic_t bot_next_upgrade = 0;
+static char **bot_argv;
+
+struct bot_fd *bot_fds = NULL;
+int bot_nfds = 0;
+static int bot_fds_size = 0;
+
+int bot_shedding = 0;
+static int bot_woken = 0;
+
+static void bot_sighup(int sig)
+{
+    bot_next_reload = 1;
+}
+
+static void bot_sigusr2(int sig)
+{
+    bot_next_upgrade = 1;
+}
+
+static METRIC bot_hook_metric(struct bot_module *mod, const char *hook)
+{
+    char labels[256];
+
+    snprintf(labels, sizeof(labels), "module=\"%s\",hook=\"%s\"", mod->name, hook);
+
+    return metrics_histogram("corebot_hook_duration_seconds", labels);
+}
+
+/* what any module section can set */
+static void bot_module_settings()
+{
+    struct bot_module *mod;
+    const char *s;
+
+    log_level = log_level_parse(config_get("log_level"), LOG_INFO);
+
+    TAILQ_FOREACH(mod, &modules_head, bot_modules)
+    {
+        bot_ctx(mod);
+        mod->log_level = log_level_parse(config_get("log_level"), log_level);
+        mod->shed = (s = config_get("shed")) && atoi(s) > 0;
+        mod->mem.soft = (s = config_get("mem_soft")) ? strtoul(s, NULL, 10) : 0;
+        mod->mem.hard = (s = config_get("mem_hard")) ? strtoul(s, NULL, 10) : 0;
+        bot_ctx(NULL);
+    }
+}
+
+/* replaces the process with a fresh copy of the binary, returns only on failure */
+static void bot_exec()
+{
+    struct bot_module *mod;
+    char buf[32];
+    long max;
+    int fd, i;
+
+    log_printf("Upgrading, executing %s\n", bot_argv[0]);
+
+    if ((fd = handoff_begin()) < 0)
+    {
+        log_lprintf(LOG_ERROR, "Upgrade failed: %s\n", strerror(errno));
+        return;
+    }
+
+    snprintf(buf, sizeof(buf), "%lu", metrics_now());
+    handoff_set("start", buf, -1);
+
+    TAILQ_FOREACH(mod, &modules_head, bot_modules)
+    {
+        if (mod->dl && mod->save)
+        {
+            bot_ctx(mod);
+            mod->save();
+            bot_ctx(NULL);
+        }
+    }
+
+    /* nothing but the descriptors modules asked for survives */
+    max = sysconf(_SC_OPEN_MAX);
+    for (i = 3; i < (max > 0 && max < 65536 ? max : 65536); i++)
+    {
+        fcntl(i, F_SETFD, handoff_kept(i) ? 0 : FD_CLOEXEC);
+    }
+
+    snprintf(buf, sizeof(buf), "%d", fd);
+    setenv(HANDOFF_ENV, buf, 1);
+
+    trace_free();
+    fflush(NULL);
+
+    execvp(bot_argv[0], bot_argv);
+
+    log_lprintf(LOG_ERROR, "Upgrade failed: %s\n", strerror(errno));
+    unsetenv(HANDOFF_ENV);
+    handoff_abort();
+    trace_init();
+}
+
+/* publishes what modules hold and gets rid of any over their hard limit */
+static void bot_mem_check()
+{
+    struct bot_module *mod;
+    static METRIC core_live, core_peak, core_allocs;
+
+    if (core_live == NULL)
+    {
+        core_live = metrics_gauge("corebot_module_memory_bytes", "module=\"core\"");
+        core_peak = metrics_gauge("corebot_module_memory_peak_bytes", "module=\"core\"");
+        core_allocs = metrics_counter("corebot_module_allocations_total", "module=\"core\"");
+    }
+
+    metrics_set(core_live, mem_core.live);
+    metrics_set(core_peak, mem_core.peak);
+    metrics_set(core_allocs, mem_core.allocs);
+
+    TAILQ_FOREACH(mod, &modules_head, bot_modules)
+    {
+        if (mod->metric_mem)
+        {
+            metrics_set(mod->metric_mem, mod->mem.live);
+            metrics_set(mod->metric_mem_peak, mod->mem.peak);
+            metrics_set(mod->metric_allocs, mod->mem.allocs);
+        }
+
+        if (mod->dl == NULL || mod->mem.over < 2 || mod->disabled)
+        {
+            continue;
+        }
+
+        /*
+         * Disabled rather than unloaded: other modules may call into it and
+         * it may have callbacks registered anywhere (irc, cmd, trigger,
+         * flood) without a free hook to take them back.
+         */
+        log_lprintf(LOG_ERROR, "Disabled %s until the next SIGHUP, it holds %lu bytes\n", mod->name, (unsigned long)mod->mem.live);
+        mod->disabled = 1;
+    }
+}
 
 int main(int argc, char **argv)
 {
-    fd_set sockets;
-    int fd_max;
     time_t last_event = 0;
     time_t now;
-    struct timeval tv;
     struct bot_module *mod;
     char *modules, *p, *last = NULL;
+    const char *metrics_path;
+    unsigned long start;
+    int loaded = 0;
+    int timeout;
+    const char *s;
+
+    bot_argv = argv;
 
     log_printf("corebot git~%s\n", GIT_REV);
     log_printf("===================\n");
 
     TAILQ_INIT(&modules_head);
 
-    config_load("corebot.ini");
+    config_load(BOT_CONFIG);
     modules = (char *)config_get("modules");
 
     if (modules == NULL)
     {
-        log_printf("No modules in config, abort.\n");
+        log_lprintf(LOG_ERROR, "No modules in config, abort.\n");
         return 1;
     }
 
@@ -62,67 +211,95 @@ int main(int argc, char **argv)
     }
     free(modules);
 
+    bot_module_settings();
+    signal(SIGHUP, bot_sighup);
+    signal(SIGUSR2, bot_sigusr2);
+
+    if ((metrics_path = config_get("metrics_socket")))
+    {
+        metrics_listen(metrics_path);
+    }
+
+    trace_init();
+    watchdog_init();
+
+    /* modules pick up what a previous process left during init */
+    handoff_load();
+
     /* load modules */
     TAILQ_FOREACH(mod, &modules_head, bot_modules)
     {
-        bot_module_load(mod);
+        loaded += bot_module_load(mod) && mod->dl;
     }
 
+    if ((s = handoff_get("start", NULL)))
+    {
+        log_printf("Upgrade done in %.1f ms\n", (metrics_now() - strtoul(s, NULL, 10)) / 1e6);
+    }
+
+    handoff_free();
+
+    metrics_set(metrics_gauge("corebot_modules_loaded", NULL), loaded);
+
     /* main fd loop */
     while( !bot_next_die )
     {
+        if (bot_next_reload)
+        {
+            bot_next_reload = 0;
+            bot_reload();
+        }
+
+        if (bot_next_upgrade)
+        {
+            bot_next_upgrade = 0;
+            bot_exec();
+        }
+
         /* handle timer */
         now = time(NULL);
         if (now > last_event)
         {
             TAILQ_FOREACH(mod, &modules_head, bot_modules)
             {
-                if (mod->dl && mod->timer)
+                if (mod->dl && mod->timer && !mod->disabled)
                 {
+                    start = watchdog_begin(mod, "timer", *(void **)(&mod->timer));
                     bot_ctx(mod);
                     mod->timer();
                     bot_ctx(NULL);
+                    metrics_observe(mod->metric_timer, watchdog_end(start) - start);
                 }
             }
 
             last_event = now;
         }
 
-        /* XXX: optimize and simplify this by caching fd_set and regenerating it only when the set really changes */
-        fd_max = 0;
-        FD_ZERO(&sockets);
-
+        /* output queued by this pass goes out before we sleep */
         TAILQ_FOREACH(mod, &modules_head, bot_modules)
         {
-            if (mod->dl && mod->sock)
+            if (mod->dl && mod->idle && !mod->disabled)
             {
-                FD_SET(mod->sock, &sockets);
-
-                if (mod->sock > fd_max)
-                {
-                    fd_max = mod->sock;
-                }
+                start = watchdog_begin(mod, "idle", *(void **)(&mod->idle));
+                bot_ctx(mod);
+                mod->idle();
+                bot_ctx(NULL);
+                metrics_observe(mod->metric_idle, watchdog_end(start) - start);
             }
         }
 
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
+        bot_mem_check();
+
+        /* something left work for the next pass, don't wait for input */
+        timeout = bot_woken ? 0 : 1000;
+        bot_woken = 0;
 
-        if (select(fd_max + 1, &sockets, NULL, NULL, &tv) > 0)
+        if (bot_poll(metrics_fd(), metrics_out_fd(), timeout))
         {
-            TAILQ_FOREACH(mod, &modules_head, bot_modules)
-            {
-                if (mod->dl && mod->sock)
-                {
-                    if (FD_ISSET(mod->sock, &sockets))
-                    {
-                        bot_ctx(mod);
-                        mod->read(mod->sock);
-                        bot_ctx(NULL);
-                    }
-                }
-            }
+            metrics_serve();
         }
+
+        metrics_flush();
     }
 
     /* module cleanup */
@@ -130,10 +307,16 @@ int main(int argc, char **argv)
     {
         bot_module_free(mod);
         TAILQ_REMOVE(&modules_head, mod, bot_modules);
+        free(mod->name);
         free(mod);
     }
 
     config_free();
+    metrics_free();
+    trace_free();
+    watchdog_free();
+    arena_free(&line_arena);
+    free(bot_fds);
 
     return 0;
 }
@@ -141,6 +324,7 @@ int main(int argc, char **argv)
 int bot_module_load(struct bot_module *mod)
 {
     char str_buf[512];
+    unsigned long start;
 
     snprintf(str_buf, 512, "modules/%s.so", mod->name);
 
@@ -148,7 +332,7 @@ int bot_module_load(struct bot_module *mod)
 
     if (mod->dl == NULL)
     {
-        log_printf("Error loading %s module: %s\n", mod->name, dlerror());
+        log_lprintf(LOG_ERROR, "Error loading %s module: %s\n", mod->name, dlerror());
     }
     else
     {
@@ -158,27 +342,54 @@ int bot_module_load(struct bot_module *mod)
         snprintf(str_buf, 512, "%s_read", mod->name);
         *(void **)(&mod->read) = dlsym(mod->dl, str_buf);
 
+        snprintf(str_buf, 512, "%s_write", mod->name);
+        *(void **)(&mod->write) = dlsym(mod->dl, str_buf);
+
         snprintf(str_buf, 512, "%s_timer", mod->name);
         *(void **)(&mod->timer) = dlsym(mod->dl, str_buf);
 
+        snprintf(str_buf, 512, "%s_idle", mod->name);
+        *(void **)(&mod->idle) = dlsym(mod->dl, str_buf);
+
+        snprintf(str_buf, 512, "%s_save", mod->name);
+        *(void **)(&mod->save) = dlsym(mod->dl, str_buf);
+
         snprintf(str_buf, 512, "%s_free", mod->name);
         *(void **)(&mod->free) = dlsym(mod->dl, str_buf);
 
-#ifdef BOT_DEBUG
-        log_printf("  loaded as 0x%08X\n", (int)mod->dl);
-        log_printf("    init at 0x%08X\n", (int)mod->init);
-        log_printf("    read at 0x%08X\n", (int)mod->read);
-        log_printf("    timer at 0x%08X\n", (int)mod->timer);
-        log_printf("    free at 0x%08X\n", (int)mod->free);
-#else
+        mod->metric_read = mod->read ? bot_hook_metric(mod, "read") : NULL;
+        mod->metric_write = mod->write ? bot_hook_metric(mod, "write") : NULL;
+        mod->metric_timer = mod->timer ? bot_hook_metric(mod, "timer") : NULL;
+        mod->metric_idle = mod->idle ? bot_hook_metric(mod, "idle") : NULL;
+
+        snprintf(str_buf, 512, "module=\"%s\"", mod->name);
+        mod->metric_shed = metrics_counter("corebot_shed_lines_total", str_buf);
+        mod->metric_mem = metrics_gauge("corebot_module_memory_bytes", str_buf);
+        mod->metric_mem_peak = metrics_gauge("corebot_module_memory_peak_bytes", str_buf);
+        mod->metric_allocs = metrics_counter("corebot_module_allocations_total", str_buf);
+        mod->mem.name = mod->name;
+
         log_printf("Loaded %s module\n", mod->name);
-#endif
+
+        if (log_enabled(LOG_DEBUG))
+        {
+            log_lprintf(LOG_DEBUG, "  loaded as %p\n", mod->dl);
+            log_lprintf(LOG_DEBUG, "    init at %p\n", *(void **)(&mod->init));
+            log_lprintf(LOG_DEBUG, "    read at %p\n", *(void **)(&mod->read));
+            log_lprintf(LOG_DEBUG, "    write at %p\n", *(void **)(&mod->write));
+            log_lprintf(LOG_DEBUG, "    timer at %p\n", *(void **)(&mod->timer));
+            log_lprintf(LOG_DEBUG, "    idle at %p\n", *(void **)(&mod->idle));
+            log_lprintf(LOG_DEBUG, "    save at %p\n", *(void **)(&mod->save));
+            log_lprintf(LOG_DEBUG, "    free at %p\n", *(void **)(&mod->free));
+        }
 
         if (mod->init)
         {
+            start = watchdog_begin(mod, "init", *(void **)(&mod->init));
             bot_ctx(mod);
             mod->version = mod->init(mod);
             bot_ctx(NULL);
+            metrics_observe(bot_hook_metric(mod, "init"), watchdog_end(start) - start);
 
             if (mod->version < 0)
             {
@@ -193,11 +404,25 @@ int bot_module_load(struct bot_module *mod)
 
 void bot_module_free(struct bot_module *mod)
 {
+    unsigned long start;
+    int i;
+
     if (mod->free)
     {
+        start = watchdog_begin(mod, "free", *(void **)(&mod->free));
         bot_ctx(mod);
         mod->free();
         bot_ctx(NULL);
+        metrics_observe(bot_hook_metric(mod, "free"), watchdog_end(start) - start);
+    }
+
+    /* whatever the module forgot to unregister */
+    for (i = 0; i < bot_nfds; i++)
+    {
+        if (bot_fds[i].mod == mod)
+        {
+            bot_fds[i--] = bot_fds[--bot_nfds];
+        }
     }
 
     if (mod->dl)
@@ -207,31 +432,177 @@ void bot_module_free(struct bot_module *mod)
 
     log_printf("Module %s unloaded\n", mod->name);
 
-    free(mod->name);
+    if (mod->mem.blocks)
+    {
+        log_lprintf(LOG_WARN, "%s left %lu bytes in %lu blocks behind\n", mod->name, (unsigned long)mod->mem.live, mod->mem.blocks);
+    }
 
     mod->dl = NULL;
     mod->version = -1;
 
     mod->init = NULL;
     mod->read = NULL;
+    mod->write = NULL;
     mod->timer = NULL;
+    mod->idle = NULL;
+    mod->save = NULL;
     mod->free = NULL;
 }
 
 void bot_register_fd(int sock)
 {
-    if (_bot_context && _bot_context->read)
+    int i;
+
+    if (_bot_context == NULL || _bot_context->read == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < bot_nfds; i++)
+    {
+        if (bot_fds[i].fd == sock)
+        {
+            bot_fds[i].mod = _bot_context;
+            return;
+        }
+    }
+
+    if (bot_nfds == bot_fds_size)
+    {
+        bot_fds_size = bot_fds_size ? bot_fds_size * 2 : 16;
+        bot_fds = realloc(bot_fds, sizeof(struct bot_fd) * bot_fds_size);
+    }
+
+    bot_fds[bot_nfds].fd = sock;
+    bot_fds[bot_nfds].mod = _bot_context;
+    bot_fds[bot_nfds].write = 0;
+    bot_nfds++;
+}
+
+void bot_unregister_fd(int sock)
+{
+    int i;
+
+    for (i = 0; i < bot_nfds; i++)
+    {
+        if (bot_fds[i].fd == sock)
+        {
+            bot_fds[i] = bot_fds[--bot_nfds];
+            return;
+        }
+    }
+}
+
+void bot_want_write(int sock, int on)
+{
+    int i;
+
+    for (i = 0; i < bot_nfds; i++)
     {
-        _bot_context->sock = sock;
+        if (bot_fds[i].fd == sock)
+        {
+            bot_fds[i].write = on && bot_fds[i].mod->write;
+            return;
+        }
     }
 }
 
-void bot_unregister_fd()
+/*
+ * Waits up to timeout ms for any registered socket or extra (if not -1)
+ * and runs the read and write hooks of the ready ones. A hook may
+ * unregister any socket, so each one is looked up again before its owner
+ * is called.
+ * Returns 1 if extra is ready to read.
+ */
+static struct bot_fd *bot_fd_owned(int fd, CTX mod)
 {
-    if (_bot_context)
+    int i;
+
+    for (i = 0; i < bot_nfds; i++)
     {
-        _bot_context->sock = 0;
+        if (bot_fds[i].fd == fd && bot_fds[i].mod == mod)
+        {
+            return &bot_fds[i];
+        }
     }
+
+    return NULL;
+}
+
+int bot_poll(int extra, int extra_out, int timeout)
+{
+    static struct pollfd *fds = NULL;
+    static CTX *owners = NULL;
+    static int size = 0;
+    struct bot_module *mod;
+    struct bot_fd *owned;
+    unsigned long start;
+    int n = 0, i, ret = 0;
+
+    if (size < bot_nfds + 2)
+    {
+        size = bot_nfds + 2;
+        fds = realloc(fds, sizeof(struct pollfd) * size);
+        owners = realloc(owners, sizeof(CTX) * size);
+    }
+
+    for (i = 0; i < bot_nfds; i++)
+    {
+        if (bot_fds[i].mod->dl && !bot_fds[i].mod->disabled)
+        {
+            fds[n].fd = bot_fds[i].fd;
+            fds[n].events = bot_fds[i].write ? POLLIN|POLLOUT : POLLIN;
+            owners[n++] = bot_fds[i].mod;
+        }
+    }
+
+    if (extra >= 0)
+    {
+        fds[n].fd = extra;
+        fds[n].events = POLLIN;
+        owners[n++] = NULL;
+    }
+
+    if (extra_out >= 0)
+    {
+        fds[n].fd = extra_out;
+        fds[n].events = POLLOUT;
+        owners[n++] = NULL;
+    }
+
+    if (poll(fds, n, timeout) <= 0)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if ((mod = owners[i]) == NULL)
+        {
+            ret = fds[i].fd == extra && (fds[i].revents & (POLLIN|POLLHUP|POLLERR)) ? 1 : ret;
+            continue;
+        }
+
+        if ((fds[i].revents & (POLLIN|POLLHUP|POLLERR)) && bot_fd_owned(fds[i].fd, mod) && mod->dl && mod->read)
+        {
+            start = watchdog_begin(mod, "read", *(void **)(&mod->read));
+            bot_ctx(mod);
+            mod->read(fds[i].fd);
+            bot_ctx(NULL);
+            metrics_observe(mod->metric_read, watchdog_end(start) - start);
+        }
+
+        if ((fds[i].revents & POLLOUT) && (owned = bot_fd_owned(fds[i].fd, mod)) && owned->write && mod->dl && mod->write)
+        {
+            start = watchdog_begin(mod, "write", *(void **)(&mod->write));
+            bot_ctx(mod);
+            mod->write(fds[i].fd);
+            bot_ctx(NULL);
+            metrics_observe(mod->metric_write, watchdog_end(start) - start);
+        }
+    }
+
+    return ret;
 }
 
 int bot_require(const char *name, int version)
@@ -253,7 +624,68 @@ int bot_require(const char *name, int version)
     return -1;
 }
 
+/* latency histogram for callbacks the current module registers to a dispatcher */
+METRIC bot_cb_metric(const char *dispatch)
+{
+    char labels[256];
+
+    snprintf(labels, sizeof(labels), "module=\"%s\",dispatch=\"%s\"", _bot_context ? _bot_context->name : "core", dispatch);
+
+    return metrics_histogram("corebot_callback_duration_seconds", labels);
+}
+
+void bot_wakeup()
+{
+    bot_woken = 1;
+}
+
+/* skips a callback of a module that opted in to lose lines while overloaded */
+int bot_shed(CTX ctx)
+{
+    if (bot_shedding && ctx && ctx->shed)
+    {
+        metrics_add(ctx->metric_shed, 1);
+        return 1;
+    }
+
+    return 0;
+}
+
 void bot_die()
 {
     bot_next_die = 1;
 }
+
+/* re-read the config, used for live log level, shedding, memory limit, tracing and stall budget changes (SIGHUP) */
+void bot_reload()
+{
+    struct bot_module *mod;
+
+    log_printf("Reloading %s\n", BOT_CONFIG);
+
+    /* anything modules kept from config_get() is a copy of its own */
+    config_free();
+    config_load(BOT_CONFIG);
+
+    bot_module_settings();
+    trace_init();
+    watchdog_init();
+
+    log_printf("Memory: core %lu bytes in %lu blocks (peak %lu)\n",
+            (unsigned long)mem_core.live, mem_core.blocks, (unsigned long)mem_core.peak);
+
+    TAILQ_FOREACH(mod, &modules_head, bot_modules)
+    {
+        if (mod->mem.allocs)
+        {
+            log_printf("Memory: %s %lu bytes in %lu blocks (peak %lu)\n",
+                    mod->name, (unsigned long)mod->mem.live, mod->mem.blocks, (unsigned long)mod->mem.peak);
+        }
+    }
+}
+
+/* re-execute the binary without dropping connections (SIGUSR2) */
+void bot_upgrade()
+{
+    bot_next_upgrade = 1;
+}
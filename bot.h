@@ -21,25 +21,48 @@
 #include "tailq.h"
 #include "log.h"
 #include "config.h"
+#include "metrics.h"
+#include "trace.h"
+#include "mem.h"
+#include "handoff.h"
+#include "watchdog.h"
+#include "utf8.h"
+#include "listen.h"
 
 struct bot_module;
 typedef struct bot_module * CTX;
 
-TAILQ_HEAD(_modules_head, bot_module) modules_head;
+extern TAILQ_HEAD(_modules_head, bot_module) modules_head;
 
 struct bot_module
 {
     char *name;                 /* name of the module, file and namespace */
     void *dl;                   /* dlopened module */
     int version;                /* version number */
-    int sock;                   /* optionally registered socket */
+    int log_level;              /* runtime log level, see log.h */
+    int disabled;               /* stalled too often (see watchdog.h) or over mem_hard */
+    int stalls;
+    int shed;                   /* may miss low priority lines, see bot_shed */
+    struct mem_stats mem;       /* what it holds from bot_malloc, see mem.h */
 
                                 /* these are called (if exported)... */
     int (*init)(CTX);           /*  on module load (returns version) */
     void (*read)(int sock);     /*  when a registered socket is ready to read data */
+    void (*write)(int sock);    /*  when a socket it wants to write to is ready, see bot_want_write */
     void (*timer)(void);        /*  approximately once a second */
+    void (*idle)(void);         /*  before the core waits for input again */
+    void (*save)(void);         /*  before an upgrade, see handoff.h */
     void (*free)(void);         /*  on module unload */
 
+    METRIC metric_read;         /* hook latency histograms */
+    METRIC metric_write;
+    METRIC metric_timer;
+    METRIC metric_idle;
+    METRIC metric_shed;         /* lines it missed */
+    METRIC metric_mem;          /* from mem */
+    METRIC metric_mem_peak;
+    METRIC metric_allocs;
+
     TAILQ_ENTRY(bot_module) bot_modules;
 };
 
@@ -50,7 +73,35 @@ extern struct bot_module *_bot_context;
 int bot_module_load(struct bot_module *mod);
 void bot_module_free(struct bot_module *mod);
 
+/* sockets registered by modules with a read hook, any number each */
+struct bot_fd
+{
+    int fd;
+    CTX mod;
+    int write;                  /* polled for writing too */
+};
+
+extern struct bot_fd *bot_fds;
+extern int bot_nfds;
+
 void bot_register_fd(int sock);
-void bot_unregister_fd();
+void bot_unregister_fd(int sock);
+/* calls the write hook when the registered socket can take more (on 1) or stops (on 0) */
+void bot_want_write(int sock, int on);
+/* also waits for extra to be readable and extra_out writable, returns 1 if extra was */
+int bot_poll(int extra, int extra_out, int timeout);
+/* the next wait for input returns at once, for work left queued */
+void bot_wakeup();
+
+/*
+ * Set by whoever dispatches a low priority line while overloaded (the
+ * server module), callbacks of modules with shed = 1 in their section
+ * are skipped for it. Dispatchers check bot_shed(ctx) with bot_disabled.
+ */
+extern int bot_shedding;
+int bot_shed(CTX ctx);
 int bot_require(const char *name, int version);
+METRIC bot_cb_metric(const char *dispatch);
 void bot_die();
+void bot_reload();
+void bot_upgrade();
@@ -20,6 +20,9 @@
 
 static TAILQ_HEAD(_config_head, config_entry) config_head;
 
+/* every entry and string lives until the next config_free() */
+static struct arena config_arena;
+
 struct config_entry
 {
     char *section;
@@ -56,9 +59,7 @@ void config_regex_load(char **dst, const char *src, regmatch_t *m)
     int len;
 
     len = m->rm_eo - m->rm_so;
-    *dst = malloc(len + 1);
-    memcpy(*dst, src + m->rm_so, len);
-    *(*dst + len) = '\0';
+    *dst = arena_strndup(&config_arena, src + m->rm_so, len);
 }
 
 void config_load(const char *file)
@@ -76,23 +77,23 @@ void config_load(const char *file)
 
     if (regcomp(&preg_section, "^\\[([a-z]+)\\]", REG_EXTENDED) != 0)
     {
-        log_printf("config: error compiling section regexp\n");
+        log_lprintf(LOG_ERROR, "config: error compiling section regexp\n");
     }
 
     if (regcomp(&preg_pair, "^[[:space:]]*([a-z0-9_]+)[[:space:]]*=[[:space:]]*([^;[:space:]]+)", REG_EXTENDED) != 0)
     {
-        log_printf("config: error compiling pair regexp\n");
+        log_lprintf(LOG_ERROR, "config: error compiling pair regexp\n");
     }
 
     if (regcomp(&preg_pair_q, "^[[:space:]]*([a-z0-9_]+)[[:space:]]*=[[:space:]]*\"([^\"]+)\"", REG_EXTENDED) != 0)
     {
-        log_printf("config: error compiling pair regexp\n");
+        log_lprintf(LOG_ERROR, "config: error compiling pair regexp\n");
     }
 
     fh = fopen(file, "r");
     if (!fh)
     {
-        log_printf("config: error opening file for reading\n");
+        log_lprintf(LOG_ERROR, "config: error opening file for reading\n");
         return;
     }
 
@@ -105,30 +106,20 @@ void config_load(const char *file)
 
         if (regexec(&preg_pair_q, buf, 3, pmatch, 0) != REG_NOMATCH)
         {
-            e = calloc(sizeof(struct config_entry), 1);
-            if (section)
-            {
-                e->section = strdup(section);
-            }
+            e = arena_alloc(&config_arena, sizeof(struct config_entry));
+            e->section = section;
             config_regex_load(&e->key, buf, &pmatch[1]);
             config_regex_load(&e->value, buf, &pmatch[2]);
         }
         else if (regexec(&preg_pair, buf, 3, pmatch, 0) != REG_NOMATCH)
         {
-            e = calloc(sizeof(struct config_entry), 1);
-            if (section)
-            {
-                e->section = strdup(section);
-            }
+            e = arena_alloc(&config_arena, sizeof(struct config_entry));
+            e->section = section;
             config_regex_load(&e->key, buf, &pmatch[1]);
             config_regex_load(&e->value, buf, &pmatch[2]);
         }
         else if (regexec(&preg_section, buf, 3, pmatch, 0) != REG_NOMATCH)
         {
-            if (section)
-            {
-                free(section);
-            }
             config_regex_load(&section, buf, &pmatch[1]);
         }
 
@@ -138,11 +129,6 @@ void config_load(const char *file)
         }
     }
 
-    if (section)
-    {
-        free(section);
-    }
-
     fclose(fh);
 
     regfree(&preg_section);
@@ -152,26 +138,6 @@ void config_load(const char *file)
 
 void config_free()
 {
-    struct config_entry *e;
-
-    while ( (e = TAILQ_LAST(&config_head, _config_head)) )
-    {
-        if (e->section != NULL)
-        {
-            free(e->section);
-        }
-
-        if (e->key != NULL)
-        {
-            free(e->key);
-        }
-
-        if (e->value != NULL)
-        {
-            free(e->value);
-        }
-
-        TAILQ_REMOVE(&config_head, e, config_entries);
-        free(e);
-    }
+    TAILQ_INIT(&config_head);
+    arena_free(&config_arena);
 }
@@ -15,6 +15,7 @@
  */
 
 void config_load(const char *file);
+/* the value is gone after a SIGHUP re-reads the config, copy what's kept */
 const char *config_get(const char *key);
 void config_free();
 
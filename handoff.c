@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "bot.h"
+
+#include <unistd.h>
+
+struct handoff_entry
+{
+    const char *module;
+    const char *key;
+    const char *value;
+    int len;
+    struct handoff_entry *next;
+};
+
+static FILE *handoff_fh = NULL;
+static int kept[HANDOFF_FDS];
+static int nkept = 0;
+
+static struct arena handoff_arena;
+static struct handoff_entry *entries = NULL;
+
+/* record: "<module> <key> <len>\n<value>\n" */
+void handoff_set(const char *key, const char *value, int len)
+{
+    CTX ctx = bot_get_ctx();
+
+    if (handoff_fh == NULL)
+    {
+        return;
+    }
+
+    if (len < 0)
+    {
+        len = strlen(value);
+    }
+
+    fprintf(handoff_fh, "%s %s %d\n", ctx ? ctx->name : "core", key, len);
+    fwrite(value, 1, len, handoff_fh);
+    fputc('\n', handoff_fh);
+}
+
+void handoff_fd(const char *key, int fd)
+{
+    char buf[16];
+
+    if (handoff_fh == NULL || nkept == HANDOFF_FDS)
+    {
+        return;
+    }
+
+    kept[nkept++] = fd;
+
+    snprintf(buf, sizeof(buf), "%d", fd);
+    handoff_set(key, buf, -1);
+}
+
+const char *handoff_get(const char *key, int *len)
+{
+    struct handoff_entry *e;
+    CTX ctx = bot_get_ctx();
+
+    for (e = entries; e; e = e->next)
+    {
+        if (strcmp(e->module, ctx ? ctx->name : "core") == 0 && strcmp(e->key, key) == 0)
+        {
+            if (len)
+            {
+                *len = e->len;
+            }
+            return e->value;
+        }
+    }
+
+    return NULL;
+}
+
+int handoff_get_fd(const char *key)
+{
+    const char *s = handoff_get(key, NULL);
+    return s ? atoi(s) : -1;
+}
+
+int handoff_begin()
+{
+    nkept = 0;
+
+    if ((handoff_fh = tmpfile()) == NULL)
+    {
+        return -1;
+    }
+
+    return fileno(handoff_fh);
+}
+
+int handoff_kept(int fd)
+{
+    int i;
+
+    if (handoff_fh && fd == fileno(handoff_fh))
+    {
+        return 1;
+    }
+
+    for (i = 0; i < nkept; i++)
+    {
+        if (kept[i] == fd)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void handoff_abort()
+{
+    if (handoff_fh)
+    {
+        fclose(handoff_fh);
+        handoff_fh = NULL;
+    }
+
+    nkept = 0;
+}
+
+void handoff_load()
+{
+    struct handoff_entry *e;
+    char module[128], key[128], line[300];
+    const char *s;
+    char *value;
+    FILE *fh;
+    int len;
+
+    if ((s = getenv(HANDOFF_ENV)) == NULL || (fh = fdopen(atoi(s), "r")) == NULL)
+    {
+        return;
+    }
+
+    unsetenv(HANDOFF_ENV);
+    rewind(fh);
+
+    while (fgets(line, sizeof(line), fh) && sscanf(line, "%127s %127s %d", module, key, &len) == 3 && len >= 0)
+    {
+        value = arena_alloc(&handoff_arena, len + 1);
+
+        if (fread(value, 1, len, fh) != (size_t)len)
+        {
+            break;
+        }
+
+        value[len] = '\0';
+        fgetc(fh);
+
+        e = arena_alloc(&handoff_arena, sizeof(struct handoff_entry));
+        e->module = arena_strdup(&handoff_arena, module);
+        e->key = arena_strdup(&handoff_arena, key);
+        e->value = value;
+        e->len = len;
+        e->next = entries;
+        entries = e;
+    }
+
+    fclose(fh);
+}
+
+void handoff_free()
+{
+    entries = NULL;
+    arena_free(&handoff_arena);
+}
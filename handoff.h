@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * State carried from one process to the next over an upgrade.
+ *
+ * Before the core re-executes itself every module's save hook stores
+ * key/value pairs (and file descriptors to keep open) under its name.
+ * The new process finds the pairs through the environment and modules
+ * read them back during init, after that they are gone.
+ */
+
+#define HANDOFF_ENV     "COREBOT_HANDOFF"
+#define HANDOFF_FDS     64
+
+void handoff_set(const char *key, const char *value, int len);
+void handoff_fd(const char *key, int fd);
+/* NULL if the previous process left nothing under key */
+const char *handoff_get(const char *key, int *len);
+int handoff_get_fd(const char *key);
+
+/* core side, returns the descriptor to pass on or -1 */
+int handoff_begin();
+int handoff_kept(int fd);
+void handoff_abort();
+void handoff_load();
+void handoff_free();
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "bot.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+static int listen_bind(const char *where)
+{
+    struct addrinfo hint, *res;
+    struct sockaddr_un sun;
+    char host[256];
+    const char *port = strrchr(where, ':');
+    int sock, yes = 1;
+
+    if (port && *where != '/' && *where != '.')
+    {
+        snprintf(host, sizeof(host), "%.*s", (int)(port - where), where);
+
+        memset(&hint, 0, sizeof(hint));
+        hint.ai_family = AF_UNSPEC;
+        hint.ai_socktype = SOCK_STREAM;
+        hint.ai_flags = AI_PASSIVE;
+
+        if (getaddrinfo(*host ? host : NULL, port + 1, &hint, &res) != 0)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if ((sock = socket(res->ai_family, SOCK_STREAM, 0)) >= 0)
+        {
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+            if (bind(sock, res->ai_addr, res->ai_addrlen) < 0)
+            {
+                close(sock);
+                sock = -1;
+            }
+        }
+
+        freeaddrinfo(res);
+    }
+    else
+    {
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", where);
+        unlink(sun.sun_path);
+
+        if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 && bind(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+        {
+            close(sock);
+            sock = -1;
+        }
+    }
+
+    if (sock >= 0 && listen(sock, 16) < 0)
+    {
+        close(sock);
+        sock = -1;
+    }
+
+    return sock;
+}
+
+int listen_open(const char *key)
+{
+    const char *where;
+    int sock;
+
+    /* still listening from before an upgrade */
+    if ((sock = handoff_get_fd(key)) < 0)
+    {
+        if ((where = config_get(key)) == NULL)
+        {
+            log_lprintf(LOG_ERROR, "Nothing to listen on, set %s\n", key);
+            return -1;
+        }
+
+        if ((sock = listen_bind(where)) < 0)
+        {
+            log_lprintf(LOG_ERROR, "Can't listen on %s: %s\n", where, strerror(errno));
+            return -1;
+        }
+
+        log_printf("Listening on %s\n", where);
+    }
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    bot_register_fd(sock);
+
+    return sock;
+}
+
+void listen_close(int sock)
+{
+    struct sockaddr_un sun;
+    socklen_t len = sizeof(sun);
+
+    bot_unregister_fd(sock);
+
+    /* the path it was bound to, whatever the config says now */
+    if (getsockname(sock, (struct sockaddr *)&sun, &len) == 0 && sun.sun_family == AF_UNIX && sun.sun_path[0])
+    {
+        unlink(sun.sun_path);
+    }
+
+    close(sock);
+}
@@ -20,14 +20,21 @@
 
 extern struct bot_module *_bot_context;
 
-int log_printf(const char *fmt, ...)
+int log_level = LOG_INFO;
+
+static const char *log_level_names[] = { "error", "warn", "info", "debug", "trace" };
+
+static int log_vprintf(int level, const char *fmt, va_list args)
 {
-    va_list args;
-    int ret;
     char buf[64];
     time_t now;
     struct tm *tm;
 
+    if (!log_enabled(level))
+    {
+        return 0;
+    }
+
     now = time(NULL);
     tm = localtime(&now);
 
@@ -42,8 +49,53 @@ int log_printf(const char *fmt, ...)
         fprintf(stdout, "[%s] ", _bot_context->name);
     }
 
+    return vfprintf(stdout, fmt, args);
+}
+
+int log_printf(const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
     va_start(args, fmt);
-    ret = vfprintf(stdout, fmt, args);
+    ret = log_vprintf(LOG_INFO, fmt, args);
     va_end(args);
     return ret;
 }
+
+int log_lprintf(int level, const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = log_vprintf(level, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+int log_level_parse(const char *str, int def)
+{
+    int i;
+
+    if (str == NULL)
+    {
+        return def;
+    }
+
+    if (str[0] >= '0' && str[0] <= '9')
+    {
+        i = atoi(str);
+        return i > LOG_TRACE ? LOG_TRACE : i;
+    }
+
+    for (i = LOG_ERROR; i <= LOG_TRACE; i++)
+    {
+        if (strcmp(str, log_level_names[i]) == 0)
+        {
+            return i;
+        }
+    }
+
+    return def;
+}
@@ -14,4 +14,18 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define LOG_ERROR   0
+#define LOG_WARN    1
+#define LOG_INFO    2
+#define LOG_DEBUG   3
+#define LOG_TRACE   4
+
+extern int log_level;           /* level for core and modules without their own */
+
+/* cheap guard for trace points: one load and a compare when disabled */
+#define log_enabled(level) \
+    ((_bot_context ? _bot_context->log_level : log_level) >= (level))
+
 int log_printf(const char *fmt, ...);
+int log_lprintf(int level, const char *fmt, ...);
+int log_level_parse(const char *str, int def);
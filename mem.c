@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "bot.h"
+
+struct arena line_arena;
+struct mem_stats mem_core = { "core" };
+
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_HEADER ARENA_ROUND(sizeof(struct arena_block))
+
+struct mem_block
+{
+    struct mem_stats *owner;
+    size_t size;
+};
+
+#define MEM_HEADER ARENA_ROUND(sizeof(struct mem_block))
+
+static void mem_take(struct mem_stats *m, size_t size)
+{
+    m->live += size;
+    m->blocks++;
+    m->allocs++;
+
+    if (m->live > m->peak)
+    {
+        m->peak = m->live;
+    }
+
+    if (m->hard && m->live > m->hard && m->over < 2)
+    {
+        m->over = 2;
+        log_lprintf(LOG_ERROR, "%s is over its hard memory limit with %lu bytes in %lu blocks\n",
+                m->name, (unsigned long)m->live, m->blocks);
+    }
+    else if (m->soft && m->live > m->soft && m->over < 1)
+    {
+        m->over = 1;
+        log_lprintf(LOG_WARN, "%s is over its soft memory limit with %lu bytes in %lu blocks\n",
+                m->name, (unsigned long)m->live, m->blocks);
+    }
+}
+
+static void mem_give(struct mem_stats *m, size_t size)
+{
+    m->live -= size;
+    m->blocks--;
+
+    /* well under it again before it's logged again */
+    if (m->over == 2 && m->live < m->hard - m->hard / 8)
+    {
+        m->over = m->soft && m->live > m->soft;
+    }
+
+    if (m->over == 1 && m->live < m->soft - m->soft / 8)
+    {
+        m->over = 0;
+    }
+}
+
+static void *mem_alloc(struct mem_stats *owner, size_t size)
+{
+    struct mem_block *b;
+
+    if ((b = malloc(MEM_HEADER + size)) == NULL)
+    {
+        return NULL;
+    }
+
+    b->owner = owner;
+    b->size = size;
+    mem_take(b->owner, size);
+
+    return (char *)b + MEM_HEADER;
+}
+
+void *bot_malloc(size_t size)
+{
+    return mem_alloc(_bot_context ? &_bot_context->mem : &mem_core, size);
+}
+
+void *bot_calloc(size_t n, size_t size)
+{
+    void *ret;
+
+    if (size && n > ((size_t)-1 - MEM_HEADER) / size)
+    {
+        return NULL;
+    }
+
+    if ((ret = bot_malloc(n * size)))
+    {
+        memset(ret, 0, n * size);
+    }
+
+    return ret;
+}
+
+/* stays with the owner it had */
+void *bot_realloc(void *ptr, size_t size)
+{
+    struct mem_block *b;
+    size_t old;
+
+    if (ptr == NULL)
+    {
+        return bot_malloc(size);
+    }
+
+    b = (struct mem_block *)((char *)ptr - MEM_HEADER);
+    old = b->size;
+
+    if ((b = realloc(b, MEM_HEADER + size)) == NULL)
+    {
+        return NULL;
+    }
+
+    b->size = size;
+    mem_give(b->owner, old);
+    mem_take(b->owner, size);
+
+    return (char *)b + MEM_HEADER;
+}
+
+char *bot_strdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *ret;
+
+    if ((ret = bot_malloc(len)))
+    {
+        memcpy(ret, s, len);
+    }
+
+    return ret;
+}
+
+void bot_free(void *ptr)
+{
+    struct mem_block *b;
+
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    b = (struct mem_block *)((char *)ptr - MEM_HEADER);
+    mem_give(b->owner, b->size);
+    free(b);
+}
+
+/* blocks are the core's, whichever module's line happened to need one */
+static int arena_grow(struct arena *a, size_t size)
+{
+    struct arena_block *b;
+
+    if (size < ARENA_BLOCK)
+    {
+        size = ARENA_BLOCK;
+    }
+
+    if ((b = mem_alloc(&mem_core, ARENA_HEADER + size)) == NULL)
+    {
+        return 0;
+    }
+
+    if (a->blocks)
+    {
+        a->used += a->blocks->size;
+    }
+
+    b->size = size;
+    b->next = a->blocks;
+    a->blocks = b;
+    a->ptr = (char *)b + ARENA_HEADER;
+    a->end = a->ptr + size;
+
+    return 1;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    void *ret;
+
+    size = ARENA_ROUND(size ? size : 1);
+
+    if ((a->ptr == NULL || (size_t)(a->end - a->ptr) < size) && !arena_grow(a, size))
+    {
+        return NULL;
+    }
+
+    ret = a->ptr;
+    a->ptr += size;
+
+    return ret;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t len)
+{
+    char *ret;
+
+    if ((ret = arena_alloc(a, len + 1)) == NULL)
+    {
+        return NULL;
+    }
+
+    memcpy(ret, s, len);
+    ret[len] = '\0';
+
+    return ret;
+}
+
+char *arena_strdup(struct arena *a, const char *s)
+{
+    return arena_strndup(a, s, strlen(s));
+}
+
+void arena_reset(struct arena *a)
+{
+    size_t size;
+
+    if (a->blocks == NULL)
+    {
+        return;
+    }
+
+    /* a line that spilled over gets one block that fits it next time */
+    if (a->blocks->next)
+    {
+        size = a->used + a->blocks->size;
+        arena_free(a);
+        arena_grow(a, size);
+        return;
+    }
+
+    a->ptr = (char *)a->blocks + ARENA_HEADER;
+}
+
+void arena_free(struct arena *a)
+{
+    struct arena_block *b;
+
+    while ((b = a->blocks))
+    {
+        a->blocks = b->next;
+        bot_free(b);
+    }
+
+    a->ptr = a->end = NULL;
+    a->used = 0;
+}
+
+/* slabs are chained through their first word, objects start after it */
+#define POOL_HEADER ARENA_ROUND(sizeof(void *))
+
+void pool_init(struct pool *p, size_t size)
+{
+    p->size = ARENA_ROUND(size < sizeof(void *) ? sizeof(void *) : size);
+    p->free = NULL;
+    p->slabs = NULL;
+    p->owner = _bot_context ? &_bot_context->mem : &mem_core;
+}
+
+void *pool_get(struct pool *p)
+{
+    char *slab;
+    void *ret;
+    int i;
+
+    if (p->free == NULL)
+    {
+        if ((slab = mem_alloc(p->owner, POOL_HEADER + p->size * POOL_SLAB)) == NULL)
+        {
+            return NULL;
+        }
+
+        *(void **)slab = p->slabs;
+        p->slabs = slab;
+
+        for (i = POOL_SLAB - 1; i >= 0; i--)
+        {
+            *(void **)(slab + POOL_HEADER + i * p->size) = p->free;
+            p->free = slab + POOL_HEADER + i * p->size;
+        }
+    }
+
+    ret = p->free;
+    p->free = *(void **)ret;
+
+    return ret;
+}
+
+void pool_put(struct pool *p, void *ptr)
+{
+    *(void **)ptr = p->free;
+    p->free = ptr;
+}
+
+void pool_free(struct pool *p)
+{
+    void *slab;
+
+    while ((slab = p->slabs))
+    {
+        p->slabs = *(void **)slab;
+        bot_free(slab);
+    }
+
+    p->free = NULL;
+}
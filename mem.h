@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Arenas hand out memory by bumping a pointer and release everything at
+ * once. The core owns line_arena and resets it once a line has been
+ * through every callback, so anything a module needs only while handling
+ * the current line can come from it without a free(). Arena blocks are
+ * charged to the core whoever grows them, NULL means out of memory.
+ *
+ * Pools hand out fixed size objects from slabs and keep released ones on
+ * a free list, for small long lived objects. Slabs are charged to the
+ * module that called pool_init, whoever takes the object that needs one.
+ * pool_get returns NULL when out of memory.
+ */
+
+#define ARENA_ALIGN     16
+#define ARENA_BLOCK     4096
+
+struct arena_block
+{
+    struct arena_block *next;
+    size_t size;
+};
+
+struct arena
+{
+    struct arena_block *blocks;         /* newest first */
+    char *ptr;
+    char *end;
+    size_t used;                        /* by blocks other than the newest */
+};
+
+void *arena_alloc(struct arena *a, size_t size);
+char *arena_strdup(struct arena *a, const char *s);
+char *arena_strndup(struct arena *a, const char *s, size_t len);
+/* keeps one block big enough for what was used since the last reset */
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+
+extern struct arena line_arena;
+#define line_alloc(size) arena_alloc(&line_arena, size)
+#define line_strdup(s) arena_strdup(&line_arena, s)
+
+#define POOL_SLAB       64
+
+struct mem_stats;
+
+struct pool
+{
+    size_t size;
+    void *free;                         /* released objects */
+    void *slabs;
+    struct mem_stats *owner;
+};
+
+void pool_init(struct pool *p, size_t size);
+void *pool_get(struct pool *p);
+void pool_put(struct pool *p, void *ptr);
+/* releases every object, taken or not */
+void pool_free(struct pool *p);
+
+/*
+ * Accounted allocations. bot_malloc and friends put a header in front of
+ * each block naming whose it is: the current module, or the core when
+ * there is none. Live bytes, blocks and the peak are charged to the owner
+ * no matter who frees the block, so memory a module asks another to keep
+ * (say cmd_register) counts against the asker. Pool slabs go to the
+ * pool's owner, arena blocks to the core. A bot_malloc block goes back with
+ * bot_free only, never with free().
+ *
+ * Past soft bytes an owner is logged once, past hard bytes it is marked
+ * for the core to disable once the current pass is over (see bot.c).
+ */
+struct mem_stats
+{
+    const char *name;
+    size_t live;
+    size_t peak;
+    unsigned long blocks;               /* still taken */
+    unsigned long allocs;               /* ever taken */
+    size_t soft;                        /* 0 for no limit */
+    size_t hard;
+    int over;                           /* 1 past soft, 2 past hard */
+};
+
+extern struct mem_stats mem_core;
+
+void *bot_malloc(size_t size);
+void *bot_calloc(size_t n, size_t size);
+void *bot_realloc(void *ptr, size_t size);
+char *bot_strdup(const char *s);
+void bot_free(void *ptr);
@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "bot.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+
+#define METRICS_HASH 256
+#define METRICS_SEND_MS 1000
+
+static TAILQ_HEAD(_metrics_head, metric) metrics_head = TAILQ_HEAD_INITIALIZER(metrics_head);
+static struct metric *metrics_hash[METRICS_HASH];
+static struct metric *metrics_family[METRICS_HASH];
+static int metrics_sock = -1;
+static char *metrics_path = NULL;
+
+static char *out_buf = NULL;
+static size_t out_len = 0;
+static size_t out_size = 0;
+
+/* a scraper and the rest of its page */
+struct metrics_client
+{
+    int fd;
+    char *buf;
+    size_t len;
+    size_t off;
+    unsigned long deadline;
+    TAILQ_ENTRY(metrics_client) clients;
+};
+
+static TAILQ_HEAD(_clients_head, metrics_client) clients_head = TAILQ_HEAD_INITIALIZER(clients_head);
+
+static unsigned int metrics_hash_key(const char *name, const char *labels)
+{
+    unsigned int h = 5381;
+
+    while (*name)
+    {
+        h = h * 33 + (unsigned char)*name++;
+    }
+
+    while (*labels)
+    {
+        h = h * 33 + (unsigned char)*labels++;
+    }
+
+    return h % METRICS_HASH;
+}
+
+METRIC metrics_get(int type, const char *name, const char *labels)
+{
+    struct metric *m, *first;
+    unsigned int h;
+
+    if (labels == NULL)
+    {
+        labels = "";
+    }
+
+    h = metrics_hash_key(name, labels);
+
+    for (m = metrics_hash[h]; m; m = m->hash_next)
+    {
+        if (strcmp(m->name, name) == 0 && strcmp(m->labels, labels) == 0)
+        {
+            return m;
+        }
+    }
+
+    m = calloc(sizeof(struct metric), 1);
+    m->name = strdup(name);
+    m->labels = strdup(labels);
+    m->type = type;
+
+    m->hash_next = metrics_hash[h];
+    metrics_hash[h] = m;
+
+    /* families must be contiguous when served, a series goes after its last sibling */
+    h = metrics_hash_key(name, "");
+
+    for (first = metrics_family[h]; first; first = first->family_next)
+    {
+        if (strcmp(first->name, name) == 0)
+        {
+            break;
+        }
+    }
+
+    if (first)
+    {
+        TAILQ_INSERT_AFTER(&metrics_head, first->family_last, m, metrics);
+        first->family_last = m;
+    }
+    else
+    {
+        m->family_next = metrics_family[h];
+        metrics_family[h] = m;
+        m->family_last = m;
+        TAILQ_INSERT_TAIL(&metrics_head, m, metrics);
+    }
+
+    return m;
+}
+
+static int metrics_bucket(unsigned long ns)
+{
+    int shift, idx;
+
+    if (ns < (1UL << METRIC_MIN_SHIFT))
+    {
+        return 0;
+    }
+
+    shift = sizeof(unsigned long) * 8 - 1 - __builtin_clzl(ns);
+    idx = 1 + ((shift - METRIC_MIN_SHIFT) << METRIC_SUB_BITS) +
+        ((ns >> (shift - METRIC_SUB_BITS)) & ((1 << METRIC_SUB_BITS) - 1));
+
+    return idx < METRIC_BUCKETS ? idx : METRIC_BUCKETS - 1;
+}
+
+/* upper bound of a bucket in seconds */
+static double metrics_bucket_le(int idx)
+{
+    int shift, sub;
+
+    if (idx == 0)
+    {
+        return (1UL << METRIC_MIN_SHIFT) / 1e9;
+    }
+
+    shift = ((idx - 1) >> METRIC_SUB_BITS) + METRIC_MIN_SHIFT;
+    sub = (idx - 1) & ((1 << METRIC_SUB_BITS) - 1);
+
+    return ((1UL << shift) + ((unsigned long)(sub + 1) << (shift - METRIC_SUB_BITS))) / 1e9;
+}
+
+void metrics_observe(METRIC m, unsigned long ns)
+{
+    m->buckets[metrics_bucket(ns)]++;
+    m->count++;
+    m->sum += ns / 1e9;
+}
+
+unsigned long metrics_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+int metrics_listen(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        log_lprintf(LOG_ERROR, "metrics: socket path too long\n");
+        return 0;
+    }
+
+    if ((metrics_sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        log_lprintf(LOG_ERROR, "metrics: %s\n", strerror(errno));
+        return 0;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(metrics_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(metrics_sock, 4) != 0)
+    {
+        log_lprintf(LOG_ERROR, "metrics: error listening on %s: %s\n", path, strerror(errno));
+        close(metrics_sock);
+        metrics_sock = -1;
+        return 0;
+    }
+
+    fcntl(metrics_sock, F_SETFL, fcntl(metrics_sock, F_GETFL) | O_NONBLOCK);
+    metrics_path = strdup(path);
+
+    log_printf("Metrics available at %s\n", path);
+
+    return 1;
+}
+
+int metrics_fd()
+{
+    return metrics_sock;
+}
+
+static void metrics_append(const char *fmt, ...)
+{
+    va_list args;
+    int len;
+
+    for (;;)
+    {
+        va_start(args, fmt);
+        len = vsnprintf(out_buf + out_len, out_size - out_len, fmt, args);
+        va_end(args);
+
+        if (len >= 0 && out_len + len < out_size)
+        {
+            out_len += len;
+            return;
+        }
+
+        out_size = out_size ? out_size * 2 : 65536;
+        out_buf = realloc(out_buf, out_size);
+    }
+}
+
+static void metrics_format(struct metric *m)
+{
+    const char *lbrace = m->labels[0] ? "{" : "";
+    const char *rbrace = m->labels[0] ? "}" : "";
+    const char *sep = m->labels[0] ? "," : "";
+    unsigned long cumulative = 0;
+    int i;
+
+    if (m->type != METRIC_HISTOGRAM)
+    {
+        metrics_append("%s%s%s%s %.17g\n", m->name, lbrace, m->labels, rbrace, m->value);
+        return;
+    }
+
+    for (i = 0; i < METRIC_BUCKETS; i++)
+    {
+        cumulative += m->buckets[i];
+        metrics_append("%s_bucket{%s%sle=\"%.9g\"} %lu\n", m->name, m->labels, sep, metrics_bucket_le(i), cumulative);
+    }
+
+    metrics_append("%s_bucket{%s%sle=\"+Inf\"} %lu\n", m->name, m->labels, sep, m->count);
+    metrics_append("%s_sum%s%s%s %.9f\n", m->name, lbrace, m->labels, rbrace, m->sum);
+    metrics_append("%s_count%s%s%s %lu\n", m->name, lbrace, m->labels, rbrace, m->count);
+}
+
+static void metrics_close(struct metrics_client *c)
+{
+    TAILQ_REMOVE(&clients_head, c, clients);
+    close(c->fd);
+    free(c->buf);
+    free(c);
+}
+
+/* renders all metrics in the Prometheus text format for a new client */
+void metrics_serve()
+{
+    static const char *types[] = { "counter", "gauge", "histogram" };
+    struct metrics_client *c;
+    struct metric *m;
+    int fd;
+
+    if ((fd = accept(metrics_sock, NULL, NULL)) < 0)
+    {
+        return;
+    }
+
+    out_len = 0;
+    metrics_append("");
+
+    /* series are kept grouped by name, the first of each starts a family */
+    TAILQ_FOREACH(m, &metrics_head, metrics)
+    {
+        if (m->family_last)
+        {
+            metrics_append("# TYPE %s %s\n", m->name, types[m->type]);
+        }
+
+        metrics_format(m);
+    }
+
+    /* the page is the client's now, the next one gets a new buffer */
+    c = malloc(sizeof(*c));
+    c->fd = fd;
+    c->buf = out_buf;
+    c->len = out_len;
+    c->off = 0;
+    c->deadline = metrics_now() + METRICS_SEND_MS * 1000000UL;
+    TAILQ_INSERT_TAIL(&clients_head, c, clients);
+
+    out_buf = NULL;
+    out_len = out_size = 0;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    metrics_flush();
+}
+
+int metrics_out_fd()
+{
+    struct metrics_client *c = TAILQ_FIRST(&clients_head);
+
+    return c ? c->fd : -1;
+}
+
+/* the client is local, it gets METRICS_SEND_MS to take the page before we give up */
+void metrics_flush()
+{
+    struct metrics_client *c, *next;
+    ssize_t ret = 0;
+
+    for (c = TAILQ_FIRST(&clients_head); c; c = next)
+    {
+        next = TAILQ_NEXT(c, clients);
+
+        while (c->off < c->len && (ret = send(c->fd, c->buf + c->off, c->len - c->off, MSG_NOSIGNAL)) > 0)
+        {
+            c->off += ret;
+        }
+
+        if (c->off < c->len)
+        {
+            if (ret < 0 && (errno == EAGAIN || errno == EINTR) && metrics_now() < c->deadline)
+            {
+                continue;
+            }
+
+            log_lprintf(LOG_WARN, "metrics: client took %lu of %lu bytes\n", (unsigned long)c->off, (unsigned long)c->len);
+        }
+
+        metrics_close(c);
+    }
+}
+
+void metrics_forget()
+{
+    struct metrics_client *c;
+
+    while ( (c = TAILQ_FIRST(&clients_head)) )
+    {
+        metrics_close(c);
+    }
+
+    if (metrics_sock >= 0)
+    {
+        close(metrics_sock);
+        free(metrics_path);
+        metrics_path = NULL;
+        metrics_sock = -1;
+    }
+}
+
+void metrics_free()
+{
+    struct metrics_client *c;
+    struct metric *m;
+
+    while ( (m = TAILQ_FIRST(&metrics_head)) )
+    {
+        TAILQ_REMOVE(&metrics_head, m, metrics);
+        free(m->name);
+        free(m->labels);
+        free(m);
+    }
+
+    memset(metrics_hash, 0, sizeof(metrics_hash));
+    memset(metrics_family, 0, sizeof(metrics_family));
+
+    while ( (c = TAILQ_FIRST(&clients_head)) )
+    {
+        metrics_close(c);
+    }
+
+    if (metrics_sock >= 0)
+    {
+        close(metrics_sock);
+        unlink(metrics_path);
+        free(metrics_path);
+        metrics_sock = -1;
+    }
+
+    free(out_buf);
+    out_buf = NULL;
+    out_len = out_size = 0;
+}
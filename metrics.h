@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define METRIC_COUNTER      0
+#define METRIC_GAUGE        1
+#define METRIC_HISTOGRAM    2
+
+/*
+ * Histograms are log-linear over nanoseconds: four linear sub-buckets for
+ * every power of two from 64ns up to ~70s, plus an underflow bucket.
+ */
+#define METRIC_MIN_SHIFT    6
+#define METRIC_SUB_BITS     2
+#define METRIC_BUCKETS      (1 + (36 - METRIC_MIN_SHIFT) * (1 << METRIC_SUB_BITS))
+
+struct metric
+{
+    char *name;
+    char *labels;                       /* preformatted, may be empty */
+    int type;
+    double value;                       /* counter and gauge */
+    unsigned long count;                /* histogram samples */
+    double sum;                         /* histogram sum in seconds */
+    unsigned long buckets[METRIC_BUCKETS];
+    struct metric *hash_next;
+    struct metric *family_next;         /* first series of each name, by hash */
+    struct metric *family_last;         /* set on the first series only */
+    TAILQ_ENTRY(metric) metrics;
+};
+
+typedef struct metric * METRIC;
+
+/* returns the existing metric with the same name and labels if any */
+METRIC metrics_get(int type, const char *name, const char *labels);
+#define metrics_counter(name, labels) metrics_get(METRIC_COUNTER, name, labels)
+#define metrics_gauge(name, labels) metrics_get(METRIC_GAUGE, name, labels)
+#define metrics_histogram(name, labels) metrics_get(METRIC_HISTOGRAM, name, labels)
+
+#define metrics_add(m, v) ((m)->value += (v))
+#define metrics_set(m, v) ((m)->value = (v))
+void metrics_observe(METRIC m, unsigned long ns);
+unsigned long metrics_now();
+
+int metrics_listen(const char *path);
+int metrics_fd();
+/* accepts a scraper and renders its page, metrics_flush() writes it out as it's taken */
+void metrics_serve();
+/* the first page still being written, for the loop to wait on, or -1 */
+int metrics_out_fd();
+void metrics_flush();
+/* a forked child closes its copies of the sockets, they stay the parent's */
+void metrics_forget();
+void metrics_free();
@@ -0,0 +1,1351 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Channel archive.
+ *
+ * Events are appended as tab separated lines to numbered segment files
+ * (dir/00000001.log, ...). The active segment keeps its inverted index
+ * (token -> ascending list of record offsets) in memory, when it grows past
+ * segment_size it is sealed: the index is written sorted to a .idx file
+ * next to the log and mmapped for queries from then on.
+ *
+ * Indexed tokens are lowercased words of the text, "@nick" and the channel
+ * name itself, so a query is an intersection of posting lists.
+ *
+ * Writes are buffered and flushed at least once a second, fdatasync runs
+ * on a helper thread so a slow disk never blocks the main loop. Every
+ * record flushed before a sync request is covered by that one sync. A full
+ * segment is handed to the same thread to be synced, closed and have its
+ * index written, it's searched from the index image in memory until that
+ * is done and the .idx can be mapped instead.
+ */
+
+#include "../bot.h"
+#include "irc.h"
+#include "archive.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+
+#define ARCHIVE_MAGIC       "CBIX"
+#define ARCHIVE_VERSION     1
+#define ARCHIVE_WBUF        65536
+#define ARCHIVE_REC_MAX     1024
+#define ARCHIVE_TOKEN_MAX   32
+#define ARCHIVE_TERMS_MAX   16
+
+struct archive_idx_hdr
+{
+    char magic[4];
+    unsigned int version;
+    unsigned int terms;
+    unsigned int records;
+    unsigned int min_time;
+    unsigned int max_time;
+    unsigned int postings;
+    unsigned int strings;
+};
+
+struct archive_idx_term
+{
+    unsigned int str;           /* offset into the string table */
+    unsigned int post;          /* index of the first posting */
+    unsigned int count;
+};
+
+struct archive_segment
+{
+    unsigned int id;
+    int fd;                     /* log, read only */
+    void *map;                  /* mmapped .idx */
+    size_t map_len;
+    struct archive_idx_hdr *hdr;
+    struct archive_idx_term *terms;
+    unsigned int *post;
+    char *str;
+    char *image;                /* the index while it's being written, map points into it */
+    TAILQ_ENTRY(archive_segment) segments;
+};
+
+/* a full segment for the sync thread to seal */
+struct archive_job
+{
+    unsigned int id;
+    int fd;                     /* the log, synced and closed */
+    char *image;
+    size_t len;
+    int err;                    /* errno of what failed */
+    int done;
+    TAILQ_ENTRY(archive_job) jobs;
+};
+
+struct archive_term
+{
+    char *token;
+    unsigned int *post;
+    unsigned int count;
+    unsigned int size;
+};
+
+struct archive_list
+{
+    const unsigned int *post;
+    unsigned int count;
+};
+
+static TAILQ_HEAD(_segment_head, archive_segment) segment_h;
+
+static char archive_dir[256];
+static unsigned long segment_size = 16 * 1024 * 1024;
+static int sync_records = 256;
+static int max_results = 3;
+
+/* active segment */
+static unsigned int active_id = 0;
+static int active_fd = -1;
+static unsigned long active_size = 0;  /* including buffered bytes */
+static char wbuf[ARCHIVE_WBUF];
+static int wbuf_len = 0;
+static int pending = 0;                 /* records written since last sync */
+
+/* in-memory index of the active segment */
+static struct archive_term *mem_terms = NULL;
+static struct arena mem_tokens;         /* term strings, dropped with the index */
+static unsigned int mem_size = 0;
+static unsigned int mem_used = 0;
+static unsigned int mem_records = 0;
+static unsigned int mem_min_time = 0;
+static unsigned int mem_max_time = 0;
+
+/* group commit thread */
+static pthread_t sync_thread;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long sync_req = 0;
+static unsigned long sync_done = 0;
+static int sync_fd = -1;
+static int sync_quit = 0;
+static int sync_running = 0;
+static int sync_err = 0;                /* errno of a failed sync, for the main thread to log */
+static TAILQ_HEAD(_job_head, archive_job) job_h;
+static int jobs_pending = 0;
+
+/* reply target for !search */
+static char search_target[128];
+
+static unsigned int archive_hash(const char *s)
+{
+    unsigned int h = 2166136261U;
+
+    while (*s)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+/* next lowercased word from *p, returns its length or 0 at the end */
+static int archive_token(const char **p, char *tok)
+{
+    const unsigned char *s = (const unsigned char *)*p;
+    int len = 0;
+
+    while (*s && !(isalnum(*s) || *s >= 0x80))
+    {
+        s++;
+    }
+
+    while (*s && (isalnum(*s) || *s >= 0x80))
+    {
+        if (len < ARCHIVE_TOKEN_MAX)
+        {
+            tok[len++] = tolower(*s);
+        }
+        s++;
+    }
+
+    tok[len] = '\0';
+    *p = (const char *)s;
+
+    return len;
+}
+
+static void archive_lower(char *dst, const char *prefix, const char *src)
+{
+    int len = 0;
+
+    while (*prefix && len < ARCHIVE_TOKEN_MAX)
+    {
+        dst[len++] = *prefix++;
+    }
+
+    while (*src && len < ARCHIVE_TOKEN_MAX)
+    {
+        dst[len++] = tolower((unsigned char)*src++);
+    }
+
+    dst[len] = '\0';
+}
+
+static struct archive_term *archive_mem_find(const char *token, int create)
+{
+    struct archive_term *old;
+    unsigned int i, h, old_size;
+
+    if (mem_size == 0 || (create && (mem_used + 1) * 10 > mem_size * 7))
+    {
+        if (!create)
+        {
+            return NULL;
+        }
+
+        old = mem_terms;
+        old_size = mem_size;
+        mem_size = mem_size ? mem_size * 2 : 4096;
+        mem_terms = bot_calloc(mem_size, sizeof(struct archive_term));
+
+        for (i = 0; i < old_size; i++)
+        {
+            if (old[i].token)
+            {
+                h = archive_hash(old[i].token) & (mem_size - 1);
+                while (mem_terms[h].token)
+                {
+                    h = (h + 1) & (mem_size - 1);
+                }
+                mem_terms[h] = old[i];
+            }
+        }
+
+        bot_free(old);
+    }
+
+    h = archive_hash(token) & (mem_size - 1);
+    while (mem_terms[h].token)
+    {
+        if (strcmp(mem_terms[h].token, token) == 0)
+        {
+            return &mem_terms[h];
+        }
+        h = (h + 1) & (mem_size - 1);
+    }
+
+    if (!create)
+    {
+        return NULL;
+    }
+
+    mem_terms[h].token = arena_strdup(&mem_tokens, token);
+    mem_used++;
+
+    return &mem_terms[h];
+}
+
+static void archive_mem_add(const char *token, unsigned int off)
+{
+    struct archive_term *t = archive_mem_find(token, 1);
+
+    if (t->count && t->post[t->count - 1] == off)
+    {
+        return;
+    }
+
+    if (t->count == t->size)
+    {
+        t->size = t->size ? t->size * 2 : 4;
+        t->post = bot_realloc(t->post, t->size * sizeof(unsigned int));
+    }
+
+    t->post[t->count++] = off;
+}
+
+static void archive_mem_clear()
+{
+    unsigned int i;
+
+    for (i = 0; i < mem_size; i++)
+    {
+        if (mem_terms[i].token)
+        {
+            bot_free(mem_terms[i].post);
+        }
+    }
+
+    arena_free(&mem_tokens);
+    bot_free(mem_terms);
+    mem_terms = NULL;
+    mem_size = mem_used = mem_records = 0;
+    mem_min_time = mem_max_time = 0;
+}
+
+static void archive_index(unsigned int off, unsigned int when, const char *chan, const char *nick, const char *text)
+{
+    char tok[ARCHIVE_TOKEN_MAX + 1];
+
+    archive_lower(tok, "", chan);
+    archive_mem_add(tok, off);
+
+    archive_lower(tok, "@", nick);
+    archive_mem_add(tok, off);
+
+    while (archive_token(&text, tok))
+    {
+        archive_mem_add(tok, off);
+    }
+
+    if (mem_records == 0 || when < mem_min_time)
+    {
+        mem_min_time = when;
+    }
+
+    if (when > mem_max_time)
+    {
+        mem_max_time = when;
+    }
+
+    mem_records++;
+}
+
+/* splits a record line in place, returns 0 if it's not valid */
+static int archive_parse(char *line, unsigned int *when, char **type, char **chan, char **nick, char **text)
+{
+    char *f[5];
+    int i;
+
+    f[0] = line;
+    for (i = 1; i < 5; i++)
+    {
+        if ((f[i] = strchr(f[i - 1], '\t')) == NULL)
+        {
+            return 0;
+        }
+        *f[i]++ = '\0';
+    }
+
+    *when = strtoul(f[0], NULL, 10);
+    *type = f[1];
+    *chan = f[2];
+    *nick = f[3];
+    *text = f[4];
+
+    return 1;
+}
+
+static void archive_path(char *buf, int len, unsigned int id, const char *ext)
+{
+    snprintf(buf, len, "%s/%08u.%s", archive_dir, id, ext);
+}
+
+/* writes and syncs the .idx of segment id, 0 or the errno of what failed */
+static int archive_write_idx(unsigned int id, const char *image, size_t len)
+{
+    char path[512], tmp[512];
+    size_t off = 0;
+    ssize_t ret;
+    int fd, err = 0;
+
+    archive_path(path, sizeof(path), id, "idx");
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+    {
+        return errno;
+    }
+
+    while (off < len)
+    {
+        if ((ret = write(fd, image + off, len - off)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            err = errno;
+            break;
+        }
+        off += ret;
+    }
+
+    if (err == 0 && fdatasync(fd) != 0)
+    {
+        err = errno;
+    }
+
+    close(fd);
+
+    if (err == 0 && rename(tmp, path) != 0)
+    {
+        err = errno;
+    }
+
+    if (err)
+    {
+        unlink(tmp);
+    }
+
+    return err;
+}
+
+/* doesn't log, log_lprintf belongs to the main thread */
+static void *archive_sync_main(void *arg)
+{
+    struct archive_job *job;
+    unsigned long req;
+    int fd, err;
+
+    pthread_mutex_lock(&sync_lock);
+
+    while (!sync_quit)
+    {
+        TAILQ_FOREACH(job, &job_h, jobs)
+        {
+            if (!job->done)
+            {
+                break;
+            }
+        }
+
+        if (job)
+        {
+            pthread_mutex_unlock(&sync_lock);
+
+            err = fdatasync(job->fd) != 0 ? errno : 0;
+            close(job->fd);
+
+            if (err == 0)
+            {
+                err = archive_write_idx(job->id, job->image, job->len);
+            }
+
+            pthread_mutex_lock(&sync_lock);
+            job->err = err;
+            job->done = 1;
+            jobs_pending--;
+            pthread_cond_broadcast(&sync_cond);
+            continue;
+        }
+
+        if (sync_done == sync_req)
+        {
+            pthread_cond_wait(&sync_cond, &sync_lock);
+            continue;
+        }
+
+        req = sync_req;
+        fd = sync_fd;
+        pthread_mutex_unlock(&sync_lock);
+
+        /* -1 when the segment was sealed, that synced it */
+        err = fd >= 0 && fdatasync(fd) != 0 ? errno : 0;
+
+        pthread_mutex_lock(&sync_lock);
+        sync_done = req;
+        sync_err = err ? err : sync_err;
+        pthread_cond_broadcast(&sync_cond);
+    }
+
+    pthread_mutex_unlock(&sync_lock);
+
+    return NULL;
+}
+
+static void archive_sync_request()
+{
+    pthread_mutex_lock(&sync_lock);
+    sync_fd = active_fd;
+    sync_req++;
+    pthread_cond_broadcast(&sync_cond);
+    pthread_mutex_unlock(&sync_lock);
+}
+
+static void archive_sync_wait()
+{
+    pthread_mutex_lock(&sync_lock);
+    while (sync_running && (sync_done != sync_req || jobs_pending))
+    {
+        pthread_cond_wait(&sync_cond, &sync_lock);
+    }
+    pthread_mutex_unlock(&sync_lock);
+}
+
+static void archive_flush()
+{
+    int off = 0;
+    int ret;
+
+    while (off < wbuf_len)
+    {
+        ret = write(active_fd, wbuf + off, wbuf_len - off);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            log_lprintf(LOG_ERROR, "Error writing segment %u: %s\n", active_id, strerror(errno));
+            break;
+        }
+        off += ret;
+    }
+
+    wbuf_len = 0;
+}
+
+static int archive_term_cmp(const void *a, const void *b)
+{
+    return strcmp((*(struct archive_term **)a)->token, (*(struct archive_term **)b)->token);
+}
+
+static void archive_segment_close(struct archive_segment *seg)
+{
+    if (seg->image)
+    {
+        bot_free(seg->image);
+    }
+    else
+    {
+        munmap(seg->map, seg->map_len);
+    }
+
+    if (seg->fd >= 0)
+    {
+        close(seg->fd);
+    }
+
+    bot_free(seg);
+}
+
+/* segment id searched through an index image, mapped or in memory, the
+ * image stays the caller's if it fails */
+static struct archive_segment *archive_segment_new(unsigned int id, void *map, size_t len, char *image)
+{
+    struct archive_segment *seg;
+    char path[512];
+
+    seg = bot_calloc(1, sizeof(struct archive_segment));
+    seg->id = id;
+    seg->fd = -1;
+    seg->map = map;
+    seg->map_len = len;
+    seg->image = image;
+    seg->hdr = map;
+    seg->terms = (struct archive_idx_term *)(seg->hdr + 1);
+    seg->post = (unsigned int *)(seg->terms + seg->hdr->terms);
+    seg->str = (char *)(seg->post + seg->hdr->postings);
+
+    if (memcmp(seg->hdr->magic, ARCHIVE_MAGIC, 4) != 0 || seg->hdr->version != ARCHIVE_VERSION ||
+            (char *)seg->str + seg->hdr->strings != (char *)map + len)
+    {
+        archive_path(path, sizeof(path), id, "idx");
+        log_lprintf(LOG_WARN, "Ignoring invalid index %s\n", path);
+        bot_free(seg);
+        return NULL;
+    }
+
+    archive_path(path, sizeof(path), id, "log");
+    if ((seg->fd = open(path, O_RDONLY)) < 0)
+    {
+        bot_free(seg);
+        return NULL;
+    }
+
+    return seg;
+}
+
+static struct archive_segment *archive_segment_open(unsigned int id)
+{
+    struct archive_segment *seg;
+    struct stat st;
+    char path[512];
+    int fd;
+    void *map;
+
+    archive_path(path, sizeof(path), id, "idx");
+    if ((fd = open(path, O_RDONLY)) < 0)
+    {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct archive_idx_hdr))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    if ((seg = archive_segment_new(id, map, st.st_size, NULL)) == NULL)
+    {
+        munmap(map, st.st_size);
+    }
+
+    return seg;
+}
+
+/* the in-memory index laid out as a .idx file, clears it */
+static char *archive_image(size_t *len)
+{
+    struct archive_idx_hdr hdr;
+    struct archive_idx_term term;
+    struct archive_term **sorted;
+    unsigned int i, n, post, str;
+    char *image, *p;
+
+    sorted = bot_malloc((mem_used + 1) * sizeof(struct archive_term *));
+    for (i = 0, n = 0; i < mem_size; i++)
+    {
+        if (mem_terms[i].token)
+        {
+            sorted[n++] = &mem_terms[i];
+        }
+    }
+    qsort(sorted, n, sizeof(struct archive_term *), archive_term_cmp);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, ARCHIVE_MAGIC, 4);
+    hdr.version = ARCHIVE_VERSION;
+    hdr.terms = n;
+    hdr.records = mem_records;
+    hdr.min_time = mem_min_time;
+    hdr.max_time = mem_max_time;
+
+    for (i = 0; i < n; i++)
+    {
+        hdr.postings += sorted[i]->count;
+        hdr.strings += strlen(sorted[i]->token) + 1;
+    }
+
+    *len = sizeof(hdr) + n * sizeof(term) + hdr.postings * sizeof(unsigned int) + hdr.strings;
+    p = image = bot_malloc(*len);
+
+    memcpy(p, &hdr, sizeof(hdr));
+    p += sizeof(hdr);
+
+    for (i = 0, post = 0, str = 0; i < n; i++)
+    {
+        term.str = str;
+        term.post = post;
+        term.count = sorted[i]->count;
+        memcpy(p, &term, sizeof(term));
+        p += sizeof(term);
+        post += sorted[i]->count;
+        str += strlen(sorted[i]->token) + 1;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        memcpy(p, sorted[i]->post, sorted[i]->count * sizeof(unsigned int));
+        p += sorted[i]->count * sizeof(unsigned int);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        memcpy(p, sorted[i]->token, strlen(sorted[i]->token) + 1);
+        p += strlen(sorted[i]->token) + 1;
+    }
+
+    bot_free(sorted);
+    archive_mem_clear();
+
+    return image;
+}
+
+/* writes the in-memory index as the .idx of segment id and clears it */
+static int archive_seal(unsigned int id)
+{
+    struct archive_segment *seg;
+    char path[512];
+    char *image;
+    size_t len;
+    int err;
+
+    image = archive_image(&len);
+    err = archive_write_idx(id, image, len);
+    bot_free(image);
+
+    if (err)
+    {
+        archive_path(path, sizeof(path), id, "idx");
+        log_lprintf(LOG_ERROR, "Error writing %s: %s\n", path, strerror(err));
+        return 0;
+    }
+
+    if ((seg = archive_segment_open(id)) == NULL)
+    {
+        return 0;
+    }
+
+    TAILQ_INSERT_TAIL(&segment_h, seg, segments);
+
+    return 1;
+}
+
+/* indexes an existing log, drops a torn last record, returns the valid size */
+static unsigned long archive_rebuild(int fd)
+{
+    char line[ARCHIVE_REC_MAX + 2];
+    char *type, *chan, *nick, *text;
+    unsigned int when;
+    unsigned long off = 0;
+    size_t len;
+    FILE *fh;
+
+    if ((fh = fdopen(dup(fd), "r")) == NULL)
+    {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fh))
+    {
+        len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n')
+        {
+            break;
+        }
+
+        line[len - 1] = '\0';
+        if (archive_parse(line, &when, &type, &chan, &nick, &text))
+        {
+            archive_index(off, when, chan, nick, text);
+        }
+
+        off += len;
+    }
+
+    fclose(fh);
+
+    return off;
+}
+
+static int archive_uint_cmp(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int archive_open_active(unsigned int id)
+{
+    char path[512];
+
+    archive_path(path, sizeof(path), id, "log");
+
+    if ((active_fd = open(path, O_RDWR|O_CREAT|O_APPEND, 0644)) < 0)
+    {
+        log_lprintf(LOG_ERROR, "Error opening %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    active_id = id;
+    active_size = archive_rebuild(active_fd);
+
+    if (ftruncate(active_fd, active_size) != 0)
+    {
+        log_lprintf(LOG_WARN, "Error truncating %s: %s\n", path, strerror(errno));
+    }
+
+    return 1;
+}
+
+/* what the sync thread finished: errors logged, written indexes mapped */
+static void archive_reap()
+{
+    struct archive_job *job, *next;
+    struct archive_segment *seg, *mapped;
+    char path[512];
+    int err;
+
+    pthread_mutex_lock(&sync_lock);
+    err = sync_err;
+    sync_err = 0;
+    pthread_mutex_unlock(&sync_lock);
+
+    if (err)
+    {
+        log_lprintf(LOG_ERROR, "fdatasync: %s\n", strerror(err));
+    }
+
+    for (pthread_mutex_lock(&sync_lock), job = TAILQ_FIRST(&job_h); job && job->done; job = next)
+    {
+        next = TAILQ_NEXT(job, jobs);
+        TAILQ_REMOVE(&job_h, job, jobs);
+        pthread_mutex_unlock(&sync_lock);
+
+        TAILQ_FOREACH(seg, &segment_h, segments)
+        {
+            if (seg->image == job->image)
+            {
+                break;
+            }
+        }
+
+        if (job->err)
+        {
+            /* still searchable from memory until a restart rebuilds it */
+            archive_path(path, sizeof(path), job->id, "idx");
+            log_lprintf(LOG_ERROR, "Error sealing segment %u (%s): %s\n", job->id, path, strerror(job->err));
+        }
+        else if (seg && (mapped = archive_segment_open(job->id)))
+        {
+            TAILQ_INSERT_BEFORE(seg, mapped, segments);
+            TAILQ_REMOVE(&segment_h, seg, segments);
+            archive_segment_close(seg);
+        }
+
+        if (seg == NULL)
+        {
+            bot_free(job->image);
+        }
+
+        bot_free(job);
+        pthread_mutex_lock(&sync_lock);
+    }
+
+    pthread_mutex_unlock(&sync_lock);
+}
+
+/* the full segment goes to the sync thread, appends carry on in the next */
+static void archive_rotate()
+{
+    struct archive_segment *seg;
+    struct archive_job *job;
+    char *image;
+    size_t len;
+
+    archive_flush();
+
+    image = archive_image(&len);
+
+    if ((seg = archive_segment_new(active_id, image, len, image)))
+    {
+        TAILQ_INSERT_TAIL(&segment_h, seg, segments);
+    }
+
+    job = bot_calloc(1, sizeof(struct archive_job));
+    job->id = active_id;
+    job->fd = active_fd;
+    job->image = image;
+    job->len = len;
+
+    pthread_mutex_lock(&sync_lock);
+    if (sync_fd == active_fd)
+    {
+        sync_fd = -1;
+    }
+    TAILQ_INSERT_TAIL(&job_h, job, jobs);
+    jobs_pending++;
+    pthread_cond_broadcast(&sync_cond);
+    pthread_mutex_unlock(&sync_lock);
+
+    pending = 0;
+
+    archive_open_active(active_id + 1);
+}
+
+static void archive_sanitize(char *dst, const char *src, int len)
+{
+    int i;
+
+    for (i = 0; src && src[i] && i < len - 1; i++)
+    {
+        dst[i] = (src[i] == '\t' || src[i] == '\r' || src[i] == '\n') ? ' ' : src[i];
+    }
+
+    dst[i] = '\0';
+}
+
+static void archive_append(const char *type, const char *channel, const char *nick, const char *text)
+{
+    char rec[ARCHIVE_REC_MAX];
+    char c[128], n[128], t[512];
+    unsigned int now = time(NULL);
+    int len;
+
+    if (active_fd < 0)
+    {
+        return;
+    }
+
+    archive_sanitize(c, channel, sizeof(c));
+    archive_sanitize(n, nick, sizeof(n));
+    archive_sanitize(t, text, sizeof(t));
+
+    len = snprintf(rec, sizeof(rec), "%u\t%s\t%s\t%s\t%s\n", now, type, c, n, t);
+    if (len < 0 || len >= (int)sizeof(rec))
+    {
+        return;
+    }
+
+    if (active_size + len > segment_size && mem_records > 0)
+    {
+        archive_rotate();
+    }
+
+    if (wbuf_len + len > ARCHIVE_WBUF)
+    {
+        archive_flush();
+    }
+
+    memcpy(wbuf + wbuf_len, rec, len);
+    wbuf_len += len;
+
+    archive_index(active_size, now, c, n, t);
+    active_size += len;
+
+    if (++pending >= sync_records)
+    {
+        archive_flush();
+        archive_sync_request();
+        pending = 0;
+    }
+}
+
+static int archive_contains(const struct archive_list *l, unsigned int off)
+{
+    return bsearch(&off, l->post, l->count, sizeof(unsigned int), archive_uint_cmp) != NULL;
+}
+
+static int archive_lookup(struct archive_segment *seg, const char *token, struct archive_list *l)
+{
+    struct archive_term *t;
+    int lo, hi, mid, cmp;
+
+    if (seg == NULL)
+    {
+        if ((t = archive_mem_find(token, 0)) == NULL)
+        {
+            return 0;
+        }
+
+        l->post = t->post;
+        l->count = t->count;
+        return 1;
+    }
+
+    lo = 0;
+    hi = (int)seg->hdr->terms - 1;
+    while (lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        cmp = strcmp(token, seg->str + seg->terms[mid].str);
+        if (cmp == 0)
+        {
+            l->post = seg->post + seg->terms[mid].post;
+            l->count = seg->terms[mid].count;
+            return 1;
+        }
+
+        if (cmp < 0)
+        {
+            hi = mid - 1;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+
+    return 0;
+}
+
+/* searches one segment (NULL for the active one), newest first */
+static int archive_search_segment(struct archive_segment *seg, char terms[][ARCHIVE_TOKEN_MAX + 1], int nterms, time_t since, int max, ARCHIVE_CB cb)
+{
+    struct archive_list lists[ARCHIVE_TERMS_MAX];
+    char rec[ARCHIVE_REC_MAX + 1];
+    char *type, *chan, *nick, *text, *p;
+    unsigned int when, off;
+    int i, j, smallest = 0, found = 0, len;
+    int fd = seg ? seg->fd : active_fd;
+
+    for (i = 0; i < nterms; i++)
+    {
+        if (!archive_lookup(seg, terms[i], &lists[i]))
+        {
+            return 0;
+        }
+
+        if (lists[i].count < lists[smallest].count)
+        {
+            smallest = i;
+        }
+    }
+
+    for (i = (int)lists[smallest].count - 1; i >= 0 && found < max; i--)
+    {
+        off = lists[smallest].post[i];
+
+        for (j = 0; j < nterms; j++)
+        {
+            if (j != smallest && !archive_contains(&lists[j], off))
+            {
+                break;
+            }
+        }
+
+        if (j < nterms)
+        {
+            continue;
+        }
+
+        if ((len = pread(fd, rec, ARCHIVE_REC_MAX, off)) <= 0)
+        {
+            continue;
+        }
+
+        rec[len] = '\0';
+        if ((p = strchr(rec, '\n')))
+        {
+            *p = '\0';
+        }
+
+        if (!archive_parse(rec, &when, &type, &chan, &nick, &text))
+        {
+            continue;
+        }
+
+        /* offsets grow with time inside a segment */
+        if ((time_t)when < since)
+        {
+            break;
+        }
+
+        cb(when, type, chan, nick, text);
+        found++;
+    }
+
+    return found;
+}
+
+int archive_search(const char *channel, const char *nick, const char *words, time_t since, int max, ARCHIVE_CB cb)
+{
+    char terms[ARCHIVE_TERMS_MAX][ARCHIVE_TOKEN_MAX + 1];
+    struct archive_segment *seg;
+    int nterms = 0, found = 0;
+
+    if (channel)
+    {
+        archive_lower(terms[nterms++], "", channel);
+    }
+
+    if (nick)
+    {
+        archive_lower(terms[nterms++], "@", nick);
+    }
+
+    while (words && nterms < ARCHIVE_TERMS_MAX && archive_token(&words, terms[nterms]))
+    {
+        nterms++;
+    }
+
+    if (nterms == 0 || active_fd < 0)
+    {
+        return 0;
+    }
+
+    archive_flush();
+
+    if (mem_records && (time_t)mem_max_time >= since)
+    {
+        found += archive_search_segment(NULL, terms, nterms, since, max, cb);
+    }
+
+    TAILQ_FOREACH_REVERSE(seg, &segment_h, _segment_head, segments)
+    {
+        if (found >= max || (time_t)seg->hdr->max_time < since)
+        {
+            break;
+        }
+
+        found += archive_search_segment(seg, terms, nterms, since, max - found, cb);
+    }
+
+    return found;
+}
+
+static void archive_reply(time_t when, const char *type, const char *channel, const char *nick, const char *text)
+{
+    char buf[32];
+    struct tm *tm = localtime(&when);
+
+    buf[0] = '\0';
+    if (tm)
+    {
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", tm);
+    }
+
+    irc_printf("NOTICE %s :[%s] <%s> %s\r\n", search_target, buf, nick, text);
+}
+
+/* !search [nick:<nick>] [days:<n>] [words...] */
+static void archive_command(const char *nick, const char *channel, const char *args)
+{
+    char buf[512];
+    char *p, *last = NULL, *who = NULL;
+    char words[512];
+    time_t since = 0;
+
+    words[0] = '\0';
+    snprintf(buf, sizeof(buf), "%s", args);
+
+    for ((p = strtok_r(buf, " ", &last)); p; (p = strtok_r(NULL, " ", &last)))
+    {
+        if (strncmp(p, "nick:", 5) == 0)
+        {
+            who = p + 5;
+        }
+        else if (strncmp(p, "days:", 5) == 0)
+        {
+            since = time(NULL) - atoi(p + 5) * 86400;
+        }
+        else
+        {
+            strncat(words, p, sizeof(words) - strlen(words) - 2);
+            strcat(words, " ");
+        }
+    }
+
+    snprintf(search_target, sizeof(search_target), "%s", nick);
+
+    if (archive_search(channel, who, words, since, max_results, archive_reply) == 0)
+    {
+        irc_printf("NOTICE %s :No matches.\r\n", nick);
+    }
+}
+
+void archive_irc(const char *prefix, const char *command, const char *params, const char *trail)
+{
+    char nick[128];
+    const char *channel;
+
+    if (prefix == NULL)
+    {
+        return;
+    }
+
+    snprintf(nick, sizeof(nick), "%s", prefix);
+    nick[strcspn(nick, "!")] = '\0';
+
+    if (strcmp(command, "PRIVMSG") == 0 || strcmp(command, "NOTICE") == 0 || strcmp(command, "PART") == 0)
+    {
+        channel = params;
+    }
+    else if (strcmp(command, "JOIN") == 0)
+    {
+        channel = params ? params : trail;
+    }
+    else
+    {
+        return;
+    }
+
+    if (channel == NULL || strchr("#&+!", channel[0]) == NULL || strchr(channel, ' '))
+    {
+        return;
+    }
+
+    /* search first so the query doesn't find itself */
+    if (strcmp(command, "PRIVMSG") == 0 && trail && strncmp(trail, "!search", 7) == 0 && (trail[7] == ' ' || trail[7] == '\0'))
+    {
+        archive_command(nick, channel, trail + 7);
+    }
+
+    archive_append(command, channel, nick, trail ? trail : "");
+}
+
+int archive_init(CTX ctx)
+{
+    const char *s;
+    unsigned int *ids = NULL;
+    int nids = 0, i, fd;
+    struct archive_segment *seg;
+    struct dirent *de;
+    char path[512];
+    DIR *dir;
+
+    TAILQ_INIT(&segment_h);
+    TAILQ_INIT(&job_h);
+    jobs_pending = 0;
+    sync_err = 0;
+
+    if (bot_require("irc", 1) < 1)
+    {
+        log_printf("irc module required\n");
+        return -1;
+    }
+
+    s = config_get("dir");
+    snprintf(archive_dir, sizeof(archive_dir), "%s", s ? s : "archive");
+
+    if ((s = config_get("segment_size")))
+    {
+        segment_size = strtoul(s, NULL, 10);
+    }
+
+    if ((s = config_get("sync_records")))
+    {
+        sync_records = atoi(s);
+    }
+
+    if ((s = config_get("max_results")))
+    {
+        max_results = atoi(s);
+    }
+
+    if (mkdir(archive_dir, 0755) != 0 && errno != EEXIST)
+    {
+        log_lprintf(LOG_ERROR, "Error creating %s: %s\n", archive_dir, strerror(errno));
+        return -1;
+    }
+
+    if ((dir = opendir(archive_dir)) == NULL)
+    {
+        log_lprintf(LOG_ERROR, "Error opening %s: %s\n", archive_dir, strerror(errno));
+        return -1;
+    }
+
+    while ((de = readdir(dir)))
+    {
+        if (strlen(de->d_name) == 12 && strcmp(de->d_name + 8, ".log") == 0)
+        {
+            ids = bot_realloc(ids, (nids + 1) * sizeof(unsigned int));
+            ids[nids++] = strtoul(de->d_name, NULL, 10);
+        }
+    }
+    closedir(dir);
+
+    qsort(ids, nids, sizeof(unsigned int), archive_uint_cmp);
+
+    /* every segment but the last is sealed, rebuild missing indexes */
+    for (i = 0; i < nids - 1; i++)
+    {
+        if ((seg = archive_segment_open(ids[i])))
+        {
+            TAILQ_INSERT_TAIL(&segment_h, seg, segments);
+            continue;
+        }
+
+        archive_path(path, sizeof(path), ids[i], "log");
+        if ((fd = open(path, O_RDONLY)) >= 0)
+        {
+            log_printf("Rebuilding index of segment %u\n", ids[i]);
+            archive_rebuild(fd);
+            close(fd);
+            archive_seal(ids[i]);
+        }
+    }
+
+    i = archive_open_active(nids ? ids[nids - 1] : 1);
+    bot_free(ids);
+
+    if (!i)
+    {
+        return -1;
+    }
+
+    sync_quit = 0;
+    if (pthread_create(&sync_thread, NULL, archive_sync_main, NULL) != 0)
+    {
+        log_lprintf(LOG_ERROR, "Error starting sync thread\n");
+        return -1;
+    }
+    sync_running = 1;
+
+    log_printf("Archiving to %s, segment %u with %u records\n", archive_dir, active_id, mem_records);
+
+    irc_register_cb(archive_irc);
+
+    return 1;
+}
+
+void archive_timer()
+{
+    archive_reap();
+
+    if (active_fd >= 0 && (wbuf_len > 0 || pending > 0))
+    {
+        archive_flush();
+        archive_sync_request();
+        pending = 0;
+    }
+}
+
+/* buffered records have to be on disk before an upgrade */
+void archive_save()
+{
+    if (sync_running)
+    {
+        archive_flush();
+        archive_sync_wait();
+        archive_reap();
+    }
+}
+
+void archive_free()
+{
+    struct archive_segment *seg;
+
+    irc_unregister_cb(archive_irc);
+
+    if (sync_running)
+    {
+        archive_flush();
+        archive_sync_wait();
+
+        pthread_mutex_lock(&sync_lock);
+        sync_quit = 1;
+        pthread_cond_broadcast(&sync_cond);
+        pthread_mutex_unlock(&sync_lock);
+
+        pthread_join(sync_thread, NULL);
+        sync_running = 0;
+
+        archive_reap();
+    }
+
+    if (active_fd >= 0)
+    {
+        fdatasync(active_fd);
+        close(active_fd);
+        active_fd = -1;
+    }
+
+    archive_mem_clear();
+
+    while ((seg = TAILQ_FIRST(&segment_h)))
+    {
+        TAILQ_REMOVE(&segment_h, seg, segments);
+        archive_segment_close(seg);
+    }
+}
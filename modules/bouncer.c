@@ -0,0 +1,1014 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Bouncer.
+ *
+ * Lets IRC clients attach to our session instead of each holding a
+ * connection of its own. A client connects to listen, sends PASS with the
+ * password along with the usual NICK and USER, and gets the registration
+ * the server gave us (001 to 005, addressed to our nick) and a JOIN for
+ * every channel we're on. NAMES for those are asked for at names_rate a
+ * second. Whatever a client sends goes out through the irc module like
+ * any module's output, except QUIT, which only detaches it. Messages it
+ * sends are echoed to the other clients as the server doesn't.
+ *
+ * A line from the server is copied once into a reference counted buffer
+ * and each attached client's queue only points to it. The queues are
+ * written with writev when the core goes idle, so a line costs a copy
+ * and a pointer per client rather than a copy per client. While nobody is
+ * attached messages go to a ring of the last backlog lines instead,
+ * played back to the next client to attach. A client that falls
+ * client_queue lines behind is dropped. Attached clients stay connected
+ * over an upgrade, except one that can't take the rest of a half written
+ * line within BOUNCER_SAVE_MS.
+ */
+
+#include "../bot.h"
+#include "irc.h"
+#include "server.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+
+#define BOUNCER_BUF     1024    /* the longest line a client may send */
+#define BOUNCER_IOV     64      /* lines per writev */
+#define BOUNCER_WELCOME 16      /* 001 to 005 lines kept */
+#define BOUNCER_SAVE_MS 500     /* for all clients to take their last partial line */
+
+#define CLIENT_NEW      0
+#define CLIENT_ATTACHED 1
+
+struct bouncer_line
+{
+    int refs;
+    int len;
+    char data[1];               /* len bytes, ending in \r\n */
+};
+
+struct bouncer_client
+{
+    int sock;
+    int state;
+    int dead;                   /* closed once the idle hook gets to it */
+    int pass;                   /* sent the right password */
+    int user;                   /* sent USER */
+    char nick[64];
+    char buf[BOUNCER_BUF];
+    int off;
+    struct bouncer_line **queue;        /* ring of client_queue lines */
+    int head;
+    int count;
+    int sent;                   /* bytes of the first line already written */
+    int writing;                /* waiting for the socket to take more */
+    TAILQ_ENTRY(bouncer_client) clients;
+};
+
+struct bouncer_names
+{
+    char channel[200];
+    TAILQ_ENTRY(bouncer_names) names;
+};
+
+CTX bouncer_ctx = NULL;
+
+static int listen_sock = -1;
+
+static TAILQ_HEAD(client_head, bouncer_client) client_h;
+static TAILQ_HEAD(names_head, bouncer_names) names_h;
+static struct pool client_pool;
+static struct pool names_pool;
+
+static struct bouncer_line **backlog = NULL;
+static int backlog_size = 1024;
+static int backlog_head = 0;
+static int backlog_count = 0;
+
+static struct bouncer_line *welcome[BOUNCER_WELCOME];
+static int welcomes = 0;
+static char server_name[128] = "corebot";
+static char me_host[256];               /* !user@host as the server shows us */
+static struct bouncer_client *attaching = NULL;
+
+static char password[128];
+static int max_clients = 32;
+static int client_queue = 8192;
+static int names_rate = 4;
+static int clients = 0;
+static int attached = 0;
+
+static METRIC attached_gauge;
+static METRIC backlog_gauge;
+static METRIC fanned_out;
+static METRIC client_lines;
+static METRIC dropped_slow;
+static METRIC refused;
+
+static struct bouncer_line *bouncer_line(const char *s, int len)
+{
+    struct bouncer_line *l = bot_malloc(offsetof(struct bouncer_line, data) + len + 3);
+
+    l->refs = 1;
+    l->len = len + 2;
+    memcpy(l->data, s, len);
+    memcpy(l->data + len, "\r\n", 3);
+
+    return l;
+}
+
+static struct bouncer_line *bouncer_linef(const char *fmt, va_list args)
+{
+    char buf[BOUNCER_BUF];
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+
+    return bouncer_line(buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1);
+}
+
+static void bouncer_unref(struct bouncer_line *l)
+{
+    if (--l->refs == 0)
+    {
+        bot_free(l);
+    }
+}
+
+/* writes as much of the queue as the socket takes */
+static void bouncer_flush(struct bouncer_client *c)
+{
+    struct iovec iov[BOUNCER_IOV];
+    struct msghdr msg;
+    struct bouncer_line *l;
+    ssize_t len;
+    int n;
+
+    while (c->count && !c->dead)
+    {
+        for (n = 0; n < c->count && n < BOUNCER_IOV; n++)
+        {
+            l = c->queue[(c->head + n) % client_queue];
+            iov[n].iov_base = l->data + (n == 0 ? c->sent : 0);
+            iov[n].iov_len = l->len - (n == 0 ? c->sent : 0);
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+
+        if ((len = sendmsg(c->sock, &msg, MSG_NOSIGNAL)) < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                break;
+            }
+
+            c->dead = 1;
+            return;
+        }
+
+        while (len > 0)
+        {
+            l = c->queue[c->head];
+
+            if (len < l->len - c->sent)
+            {
+                c->sent += len;
+                break;
+            }
+
+            len -= l->len - c->sent;
+            c->sent = 0;
+            c->head = (c->head + 1) % client_queue;
+            c->count--;
+            bouncer_unref(l);
+        }
+    }
+
+    if (c->writing != (c->count > 0))
+    {
+        c->writing = c->count > 0;
+        bot_want_write(c->sock, c->writing);
+    }
+}
+
+/* a client that can't keep up is dropped */
+static void bouncer_push(struct bouncer_client *c, struct bouncer_line *l)
+{
+    if (c->dead)
+    {
+        return;
+    }
+
+    if (c->count == client_queue)
+    {
+        /* a long replay may get here before the idle hook */
+        bouncer_flush(c);
+
+        if (c->count == client_queue)
+        {
+            log_lprintf(LOG_WARN, "Dropped %s, %d lines behind\n", *c->nick ? c->nick : "a client", c->count);
+            metrics_add(dropped_slow, 1);
+            c->dead = 1;
+            return;
+        }
+    }
+
+    c->queue[(c->head + c->count++) % client_queue] = l;
+    l->refs++;
+}
+
+static void bouncer_sendf(struct bouncer_client *c, const char *fmt, ...)
+{
+    struct bouncer_line *l;
+    va_list args;
+
+    va_start(args, fmt);
+    l = bouncer_linef(fmt, args);
+    va_end(args);
+
+    bouncer_push(c, l);
+    bouncer_unref(l);
+}
+
+static void bouncer_close(struct bouncer_client *c)
+{
+    while (c->count)
+    {
+        bouncer_unref(c->queue[c->head]);
+        c->head = (c->head + 1) % client_queue;
+        c->count--;
+    }
+
+    if (c->state == CLIENT_ATTACHED)
+    {
+        metrics_set(attached_gauge, --attached);
+        log_printf("%s detached, %d attached\n", c->nick, attached);
+    }
+
+    bot_unregister_fd(c->sock);
+    close(c->sock);
+    bot_free(c->queue);
+    TAILQ_REMOVE(&client_h, c, clients);
+    pool_put(&client_pool, c);
+    clients--;
+}
+
+static struct bouncer_client *bouncer_client(int sock, int state)
+{
+    struct bouncer_client *c = pool_get(&client_pool);
+
+    if (c == NULL)
+    {
+        close(sock);
+        return NULL;
+    }
+
+    memset(c, 0, sizeof(*c));
+    c->sock = sock;
+    c->state = state;
+    c->queue = bot_calloc(client_queue, sizeof(struct bouncer_line *));
+    TAILQ_INSERT_TAIL(&client_h, c, clients);
+    clients++;
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    bot_register_fd(sock);
+
+    return c;
+}
+
+static void bouncer_backlog_clear()
+{
+    while (backlog_count)
+    {
+        bouncer_unref(backlog[backlog_head]);
+        backlog_head = (backlog_head + 1) % backlog_size;
+        backlog_count--;
+    }
+
+    metrics_set(backlog_gauge, 0);
+}
+
+static void bouncer_backlog(struct bouncer_line *l)
+{
+    if (backlog_count == backlog_size)
+    {
+        bouncer_unref(backlog[backlog_head]);
+        backlog_head = (backlog_head + 1) % backlog_size;
+        backlog_count--;
+    }
+
+    backlog[(backlog_head + backlog_count++) % backlog_size] = l;
+    l->refs++;
+    metrics_set(backlog_gauge, backlog_count);
+}
+
+static void bouncer_join(const char *channel)
+{
+    struct bouncer_names *n;
+
+    bouncer_sendf(attaching, ":%s%s JOIN %s", irc_nick(), me_host, channel);
+
+    /* no NAMES for it then */
+    if ((n = pool_get(&names_pool)) == NULL)
+    {
+        return;
+    }
+
+    snprintf(n->channel, sizeof(n->channel), "%s", channel);
+    TAILQ_INSERT_TAIL(&names_h, n, names);
+}
+
+/* the registration as we got it, then the channels we're on */
+static void bouncer_attach(struct bouncer_client *c)
+{
+    const char *nick = *irc_nick() ? irc_nick() : c->nick;
+    const char *s, *target, *rest;
+    struct bouncer_names *n;
+    int i;
+
+    c->state = CLIENT_ATTACHED;
+    metrics_set(attached_gauge, ++attached);
+    log_printf("%s attached, %d attached\n", c->nick, attached);
+
+    if (welcomes == 0)
+    {
+        bouncer_sendf(c, ":%s 001 %s :Welcome to corebot", server_name, nick);
+    }
+
+    /* ":server 005 target rest", addressed to whatever we're called now */
+    for (i = 0; i < welcomes; i++)
+    {
+        s = welcome[i]->data;
+        target = s + strcspn(s, " ");
+        target += 1 + strcspn(target + 1, " ");
+        rest = target + 1 + strcspn(target + 1, " \r");
+
+        bouncer_sendf(c, "%.*s %s%.*s", (int)(target - s), s, nick, (int)(s + welcome[i]->len - 2 - rest), rest);
+    }
+
+    bouncer_sendf(c, ":%s 422 %s :MOTD File is missing", server_name, nick);
+
+    /* answers to NAMES go to everyone, a newcomer gets them all again */
+    while ((n = TAILQ_FIRST(&names_h)))
+    {
+        TAILQ_REMOVE(&names_h, n, names);
+        pool_put(&names_pool, n);
+    }
+
+    attaching = c;
+    irc_each_joined(bouncer_join);
+    attaching = NULL;
+
+    for (i = 0; i < backlog_count; i++)
+    {
+        bouncer_push(c, backlog[(backlog_head + i) % backlog_size]);
+    }
+
+    bouncer_backlog_clear();
+}
+
+/* what's worth keeping for someone who wasn't there */
+static int bouncer_kept(const char *command)
+{
+    return strcmp(command, "PRIVMSG") == 0 || strcmp(command, "NOTICE") == 0 || strcmp(command, "TOPIC") == 0 ||
+        strcmp(command, "KICK") == 0 || strcmp(command, "INVITE") == 0;
+}
+
+/* every line from the server, copied once for all the clients */
+void bouncer_process(const char *line)
+{
+    struct bouncer_client *c;
+    struct bouncer_line *l;
+    const char *p = line, *prefix = NULL;
+    char command[16];
+    int len, i;
+
+    if (*p == '@')
+    {
+        p += strcspn(p, " ");
+        p += strspn(p, " ");
+    }
+
+    if (*p == ':')
+    {
+        prefix = p + 1;
+        p += strcspn(p, " ");
+        p += strspn(p, " ");
+    }
+
+    len = strcspn(p, " ");
+    snprintf(command, sizeof(command), "%.*s", len, p);
+
+    /* ours to answer, or registration a client gets its own copy of */
+    if (strcmp(command, "PING") == 0 || strcmp(command, "PONG") == 0 || strcmp(command, "ERROR") == 0 ||
+            strcmp(command, "372") == 0 || strcmp(command, "375") == 0 || strcmp(command, "376") == 0 ||
+            strcmp(command, "422") == 0)
+    {
+        return;
+    }
+
+    if (strncmp(command, "00", 2) == 0 && command[2] >= '1' && command[2] <= '5' && command[3] == '\0')
+    {
+        if (strcmp(command, "001") == 0)
+        {
+            for (i = 0; i < welcomes; i++)
+            {
+                bouncer_unref(welcome[i]);
+            }
+
+            welcomes = 0;
+
+            if (prefix)
+            {
+                snprintf(server_name, sizeof(server_name), "%.*s", (int)strcspn(prefix, " "), prefix);
+            }
+        }
+
+        /* a target after the numeric */
+        if (prefix && welcomes < BOUNCER_WELCOME && p[len] == ' ' && p[len + 1 + strcspn(p + len + 1, " ")] == ' ')
+        {
+            welcome[welcomes++] = bouncer_line(prefix - 1, strlen(prefix - 1));
+        }
+
+        return;
+    }
+
+    /* how others see us, to echo what clients say */
+    len = strcspn(prefix ? prefix : "", "!");
+    if (prefix && prefix[len] == '!' && (int)strlen(irc_nick()) == len && strncasecmp(prefix, irc_nick(), len) == 0)
+    {
+        snprintf(me_host, sizeof(me_host), "%.*s", (int)strcspn(prefix + len, " "), prefix + len);
+    }
+
+    if (attached == 0)
+    {
+        if (backlog_size > 0 && bouncer_kept(command))
+        {
+            l = bouncer_line(line, strlen(line));
+            bouncer_backlog(l);
+            bouncer_unref(l);
+        }
+
+        return;
+    }
+
+    l = bouncer_line(line, strlen(line));
+
+    TAILQ_FOREACH(c, &client_h, clients)
+    {
+        if (c->state == CLIENT_ATTACHED)
+        {
+            bouncer_push(c, l);
+        }
+    }
+
+    bouncer_unref(l);
+    metrics_add(fanned_out, 1);
+}
+
+static int bouncer_password(const char *s)
+{
+    size_t i, len = strlen(password), slen = strlen(s);
+    int diff = slen != len;
+
+    /* as long whatever was sent */
+    for (i = 0; i < len; i++)
+    {
+        diff |= password[i] ^ (i < slen ? s[i] : 0);
+    }
+
+    return diff == 0;
+}
+
+/* a line from a client */
+static void bouncer_command(struct bouncer_client *c, char *line)
+{
+    struct bouncer_client *o;
+    struct bouncer_line *l;
+    char command[16], echo[BOUNCER_BUF];
+    char *p = line, *arg;
+    const char *nick = *irc_nick() ? irc_nick() : c->nick;
+    int len;
+
+    if (*p == '@')
+    {
+        p += strcspn(p, " ");
+        p += strspn(p, " ");
+    }
+
+    /* clients shouldn't, but some do */
+    if (*p == ':')
+    {
+        p += strcspn(p, " ");
+        p += strspn(p, " ");
+    }
+
+    if (*p == '\0')
+    {
+        return;
+    }
+
+    len = strcspn(p, " ");
+    snprintf(command, sizeof(command), "%.*s", len, p);
+    arg = p + len;
+    arg += strspn(arg, " ");
+
+    if (strcasecmp(command, "CAP") == 0)
+    {
+        /* nothing to offer, REQ gets a NAK */
+        if (strncasecmp(arg, "LS", 2) == 0)
+        {
+            bouncer_sendf(c, ":%s CAP * LS :", server_name);
+        }
+        else if (strncasecmp(arg, "REQ ", 4) == 0)
+        {
+            bouncer_sendf(c, ":%s CAP * NAK %s", server_name, arg + 4);
+        }
+        return;
+    }
+
+    if (strcasecmp(command, "PING") == 0)
+    {
+        bouncer_sendf(c, ":%s PONG %s %s", server_name, server_name, *arg ? arg : ":");
+        return;
+    }
+
+    /* detaches rather than disconnecting all of us */
+    if (strcasecmp(command, "QUIT") == 0)
+    {
+        c->dead = 1;
+        return;
+    }
+
+    if (c->state == CLIENT_NEW)
+    {
+        if (strcasecmp(command, "PASS") == 0)
+        {
+            c->pass = bouncer_password(*arg == ':' ? arg + 1 : arg);
+        }
+        else if (strcasecmp(command, "NICK") == 0)
+        {
+            snprintf(c->nick, sizeof(c->nick), "%.*s", (int)strcspn(*arg == ':' ? arg + 1 : arg, " "), *arg == ':' ? arg + 1 : arg);
+        }
+        else if (strcasecmp(command, "USER") == 0)
+        {
+            c->user = 1;
+        }
+        else
+        {
+            bouncer_sendf(c, ":%s 451 %s :You have not registered", server_name, *c->nick ? c->nick : "*");
+        }
+
+        if (c->user && *c->nick)
+        {
+            if (!c->pass)
+            {
+                log_lprintf(LOG_WARN, "Refused %s, wrong password\n", c->nick);
+                metrics_add(refused, 1);
+                bouncer_sendf(c, ":%s 464 %s :Password incorrect", server_name, c->nick);
+                bouncer_sendf(c, "ERROR :Closing link (password incorrect)");
+                bouncer_flush(c);
+                c->dead = 1;
+                return;
+            }
+
+            bouncer_attach(c);
+        }
+
+        return;
+    }
+
+    if (strcasecmp(command, "PASS") == 0 || strcasecmp(command, "USER") == 0)
+    {
+        bouncer_sendf(c, ":%s 462 %s :You may not reregister", server_name, nick);
+        return;
+    }
+
+    irc_printf("%s\r\n", p);
+    metrics_add(client_lines, 1);
+
+    /* the server doesn't echo what we say, the other clients hear it from us */
+    if (attached > 1 && (strcasecmp(command, "PRIVMSG") == 0 || strcasecmp(command, "NOTICE") == 0))
+    {
+        len = snprintf(echo, sizeof(echo), ":%s%s %s", nick, me_host, p);
+        l = bouncer_line(echo, len < (int)sizeof(echo) ? len : (int)sizeof(echo) - 1);
+
+        TAILQ_FOREACH(o, &client_h, clients)
+        {
+            if (o != c && o->state == CLIENT_ATTACHED)
+            {
+                bouncer_push(o, l);
+            }
+        }
+
+        bouncer_unref(l);
+    }
+}
+
+static void bouncer_accept()
+{
+    int sock;
+
+    if ((sock = accept(listen_sock, NULL, NULL)) < 0)
+    {
+        return;
+    }
+
+    if (clients >= max_clients)
+    {
+        close(sock);
+        return;
+    }
+
+    bouncer_client(sock, CLIENT_NEW);
+}
+
+void bouncer_read(int sock)
+{
+    struct bouncer_client *c;
+    char *line, *end;
+    int n;
+
+    if (sock == listen_sock)
+    {
+        bouncer_accept();
+        return;
+    }
+
+    TAILQ_FOREACH(c, &client_h, clients)
+    {
+        if (c->sock == sock)
+        {
+            break;
+        }
+    }
+
+    if (c == NULL || c->dead)
+    {
+        return;
+    }
+
+    if ((n = recv(sock, c->buf + c->off, BOUNCER_BUF - 1 - c->off, 0)) <= 0)
+    {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        {
+            bouncer_close(c);
+        }
+        return;
+    }
+
+    c->off += n;
+    line = c->buf;
+
+    while (!c->dead && (end = memchr(line, '\n', c->off - (line - c->buf))))
+    {
+        *end = '\0';
+
+        if (end > line && end[-1] == '\r')
+        {
+            end[-1] = '\0';
+        }
+
+        bouncer_command(c, line);
+        line = end + 1;
+    }
+
+    c->off -= line - c->buf;
+    memmove(c->buf, line, c->off);
+
+    if (c->off >= BOUNCER_BUF - 1)
+    {
+        log_lprintf(LOG_WARN, "Dropped a client sending lines longer than %d\n", BOUNCER_BUF);
+        c->dead = 1;
+    }
+}
+
+void bouncer_write(int sock)
+{
+    struct bouncer_client *c;
+
+    TAILQ_FOREACH(c, &client_h, clients)
+    {
+        if (c->sock == sock)
+        {
+            bouncer_flush(c);
+            return;
+        }
+    }
+}
+
+/* whatever this pass queued goes out, and the dead are buried */
+void bouncer_idle()
+{
+    struct bouncer_client *c, *cn;
+
+    for (c = TAILQ_FIRST(&client_h); c; c = cn)
+    {
+        cn = TAILQ_NEXT(c, clients);
+
+        if (c->count && !c->writing)
+        {
+            bouncer_flush(c);
+        }
+
+        if (c->dead)
+        {
+            bouncer_close(c);
+        }
+    }
+}
+
+/* NAMES for newly attached clients, a few a second */
+void bouncer_timer()
+{
+    struct bouncer_names *n;
+    int i;
+
+    for (i = 0; i < names_rate && (n = TAILQ_FIRST(&names_h)); i++)
+    {
+        if (irc_joined(n->channel))
+        {
+            irc_printf("NAMES %s\r\n", n->channel);
+        }
+
+        TAILQ_REMOVE(&names_h, n, names);
+        pool_put(&names_pool, n);
+    }
+}
+
+/* "\n" separated lines from a handoff */
+static void bouncer_restore(const char *saved, int backlogged)
+{
+    const char *end;
+    struct bouncer_line *l;
+
+    for (; *saved; saved = *end ? end + 1 : end)
+    {
+        end = saved + strcspn(saved, "\n");
+
+        if (end == saved)
+        {
+            continue;
+        }
+
+        l = bouncer_line(saved, end - saved);
+
+        if (backlogged)
+        {
+            bouncer_backlog(l);
+        }
+        else if (welcomes < BOUNCER_WELCOME)
+        {
+            welcome[welcomes++] = l;
+            continue;
+        }
+
+        bouncer_unref(l);
+    }
+}
+
+int bouncer_init(CTX ctx)
+{
+    struct bouncer_client *c;
+    char key[32];
+    const char *s;
+    int i, n, sock;
+
+    bouncer_ctx = ctx;
+
+    TAILQ_INIT(&client_h);
+    TAILQ_INIT(&names_h);
+    pool_init(&client_pool, sizeof(struct bouncer_client));
+    pool_init(&names_pool, sizeof(struct bouncer_names));
+
+    if (bot_require("irc", 1) < 1)
+    {
+        log_printf("irc module required\n");
+        return -1;
+    }
+
+    if ((s = config_get("password")) == NULL || *s == '\0')
+    {
+        log_lprintf(LOG_ERROR, "Refusing to run without a password, set password\n");
+        return -1;
+    }
+
+    snprintf(password, sizeof(password), "%s", s);
+
+    if ((s = config_get("max_clients")) && atoi(s) > 0)
+    {
+        max_clients = atoi(s);
+    }
+
+    if ((s = config_get("backlog")))
+    {
+        backlog_size = atoi(s) > 0 ? atoi(s) : 0;
+    }
+
+    if ((s = config_get("client_queue")) && atoi(s) > 0)
+    {
+        client_queue = atoi(s);
+    }
+
+    if ((s = config_get("names_rate")) && atoi(s) > 0)
+    {
+        names_rate = atoi(s);
+    }
+
+    backlog = backlog_size ? bot_calloc(backlog_size, sizeof(struct bouncer_line *)) : NULL;
+
+    attached_gauge = metrics_gauge("corebot_bouncer_clients", NULL);
+    backlog_gauge = metrics_gauge("corebot_bouncer_backlog_lines", NULL);
+    fanned_out = metrics_counter("corebot_bouncer_lines_total", "from=\"server\"");
+    client_lines = metrics_counter("corebot_bouncer_lines_total", "from=\"clients\"");
+    dropped_slow = metrics_counter("corebot_bouncer_dropped_clients_total", "reason=\"slow\"");
+    refused = metrics_counter("corebot_bouncer_dropped_clients_total", "reason=\"password\"");
+
+    if ((listen_sock = listen_open("listen")) < 0)
+    {
+        return -1;
+    }
+
+    if ((s = handoff_get("server", NULL)))
+    {
+        snprintf(server_name, sizeof(server_name), "%s", s);
+    }
+
+    if ((s = handoff_get("me", NULL)))
+    {
+        snprintf(me_host, sizeof(me_host), "%s", s);
+    }
+
+    if ((s = handoff_get("welcome", NULL)))
+    {
+        bouncer_restore(s, 0);
+    }
+
+    if ((s = handoff_get("backlog", NULL)) && backlog_size)
+    {
+        bouncer_restore(s, 1);
+    }
+
+    /* attached clients stay attached, they have seen the registration */
+    n = (s = handoff_get("clients", NULL)) ? atoi(s) : 0;
+
+    for (i = 0; i < n; i++)
+    {
+        snprintf(key, sizeof(key), "client%d", i);
+
+        if ((sock = handoff_get_fd(key)) >= 0 && (c = bouncer_client(sock, CLIENT_ATTACHED)))
+        {
+            snprintf(key, sizeof(key), "nick%d", i);
+            snprintf(c->nick, sizeof(c->nick), "%s", (s = handoff_get(key, NULL)) ? s : "client");
+            metrics_set(attached_gauge, ++attached);
+        }
+    }
+
+    server_register_cb(bouncer_process);
+
+    return 1;
+}
+
+static void bouncer_save_lines(const char *key, struct bouncer_line **lines, int head, int count, int size)
+{
+    struct bouncer_line *l;
+    char *buf, *p;
+    int i, len = 1;
+
+    for (i = 0; i < count; i++)
+    {
+        len += lines[(head + i) % size]->len;
+    }
+
+    p = buf = bot_malloc(len);
+
+    for (i = 0; i < count; i++)
+    {
+        l = lines[(head + i) % size];
+        memcpy(p, l->data, l->len - 2);
+        p += l->len - 2;
+        *p++ = '\n';
+    }
+
+    handoff_set(key, buf, p - buf);
+    bot_free(buf);
+}
+
+/* the new process can't resume in the middle of a line, it gets to the end or the client is closed */
+static int bouncer_finish(struct bouncer_client *c, unsigned long deadline)
+{
+    struct pollfd pfd;
+
+    pfd.fd = c->sock;
+    pfd.events = POLLOUT;
+
+    bouncer_flush(c);
+
+    while (c->sent > 0 && !c->dead && metrics_now() < deadline)
+    {
+        if (poll(&pfd, 1, (deadline - metrics_now()) / 1000000 + 1) < 0 && errno != EINTR)
+        {
+            break;
+        }
+
+        bouncer_flush(c);
+    }
+
+    return c->sent == 0 && !c->dead;
+}
+
+void bouncer_save()
+{
+    struct bouncer_client *c;
+    char key[32], count[16];
+    unsigned long deadline = metrics_now() + BOUNCER_SAVE_MS * 1000000UL;
+    int n = 0;
+
+    handoff_fd("listen", listen_sock);
+    handoff_set("server", server_name, -1);
+    handoff_set("me", me_host, -1);
+    bouncer_save_lines("welcome", welcome, 0, welcomes, BOUNCER_WELCOME);
+
+    if (backlog_count)
+    {
+        bouncer_save_lines("backlog", backlog, backlog_head, backlog_count, backlog_size);
+    }
+
+    /* what they haven't got yet is lost, try once more */
+    TAILQ_FOREACH(c, &client_h, clients)
+    {
+        if (c->state == CLIENT_ATTACHED && !c->dead && bouncer_finish(c, deadline))
+        {
+            snprintf(key, sizeof(key), "client%d", n);
+            handoff_fd(key, c->sock);
+            snprintf(key, sizeof(key), "nick%d", n++);
+            handoff_set(key, c->nick, -1);
+        }
+    }
+
+    snprintf(count, sizeof(count), "%d", n);
+    handoff_set("clients", count, -1);
+}
+
+void bouncer_free()
+{
+    struct bouncer_client *c;
+    struct bouncer_names *n;
+    int i;
+
+    server_unregister_cb(bouncer_process);
+
+    while ( (c = TAILQ_FIRST(&client_h)) )
+    {
+        bouncer_close(c);
+    }
+
+    while ( (n = TAILQ_FIRST(&names_h)) )
+    {
+        TAILQ_REMOVE(&names_h, n, names);
+    }
+
+    if (listen_sock >= 0)
+    {
+        listen_close(listen_sock);
+        listen_sock = -1;
+    }
+
+    if (backlog)
+    {
+        bouncer_backlog_clear();
+        bot_free(backlog);
+        backlog = NULL;
+    }
+
+    for (i = 0; i < welcomes; i++)
+    {
+        bouncer_unref(welcome[i]);
+    }
+
+    welcomes = 0;
+
+    pool_free(&client_pool);
+    pool_free(&names_pool);
+}
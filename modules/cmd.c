@@ -0,0 +1,615 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Command router.
+ *
+ * Command names and aliases live in a byte trie so a PRIVMSG is resolved
+ * with one walk over the command word. Arguments are split according to
+ * the usage string given at registration and a line that doesn't fit gets
+ * the usage back instead of reaching the handler.
+ *
+ * Cooldowns are kept in a small hash table of expiry times keyed by
+ * command and nick, channel or nothing (global); a use that hits any of
+ * them is dropped silently so a flood doesn't turn into a reply flood.
+ * Expired entries are swept by the timer.
+ */
+
+#include "../bot.h"
+#include "irc.h"
+#include "cmd.h"
+
+#include <ctype.h>
+#include <time.h>
+
+#define CMD_ARGS        16
+#define CMD_BUCKETS     256
+
+#define CMD_USER        0
+#define CMD_CHANNEL     1
+#define CMD_GLOBAL      2
+
+struct cmd
+{
+    char *name;
+    char *usage;
+    char spec[CMD_ARGS + 1];    /* w/o required/optional word, R/r required/optional rest */
+    int cooldown[3];
+    CMD_CB cb;
+    CTX ctx;
+    METRIC calls;
+    METRIC time;
+    struct cmd *next;
+};
+
+struct cmd_node
+{
+    unsigned char c;
+    struct cmd *cmd;            /* command or alias ending here */
+    struct cmd_node *child;
+    struct cmd_node *next;
+};
+
+struct cmd_cool
+{
+    char *key;
+    time_t until;
+    struct cmd_cool *next;
+};
+
+CTX cmd_ctx = NULL;
+
+static struct cmd *cmd_list = NULL;
+static struct cmd_node cmd_root;
+static struct cmd_cool *cool[CMD_BUCKETS];
+static char cmd_prefix[16];
+static int cmd_prefix_len;
+
+static METRIC rejected_usage;
+static METRIC rejected_cooldown;
+
+static unsigned int cmd_hash(const char *s)
+{
+    unsigned int h = 2166136261U;
+
+    while (*s)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+/* usage to spec, -1 if it isn't understood */
+static int cmd_spec(const char *usage, char *spec)
+{
+    const char *p = usage, *e;
+    int n = 0;
+    char kind;
+
+    while (*p)
+    {
+        if (*p == ' ')
+        {
+            p++;
+            continue;
+        }
+
+        if (n == CMD_ARGS || (n > 0 && (spec[n - 1] == 'R' || spec[n - 1] == 'r')))
+        {
+            return -1;
+        }
+
+        if (*p == '<')
+        {
+            kind = 'w';
+            e = strchr(p, '>');
+        }
+        else if (*p == '[')
+        {
+            kind = 'o';
+            e = strchr(p, ']');
+        }
+        else
+        {
+            return -1;
+        }
+
+        if (e == NULL)
+        {
+            return -1;
+        }
+
+        /* nothing required can follow something optional */
+        if (kind == 'w' && n > 0 && spec[n - 1] == 'o')
+        {
+            return -1;
+        }
+
+        if (e - p > 3 && strncmp(e - 3, "...", 3) == 0)
+        {
+            kind = kind == 'w' ? 'R' : 'r';
+        }
+
+        spec[n++] = kind;
+        p = e + 1;
+    }
+
+    spec[n] = '\0';
+    return n;
+}
+
+static struct cmd_node *cmd_node(const char *name, int len, int create)
+{
+    struct cmd_node *node = &cmd_root, *n;
+    unsigned char c;
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        c = tolower((unsigned char)name[i]);
+
+        for (n = node->child; n && n->c != c; n = n->next);
+
+        if (n == NULL)
+        {
+            if (!create)
+            {
+                return NULL;
+            }
+
+            n = bot_calloc(sizeof(struct cmd_node), 1);
+            n->c = c;
+            n->next = node->child;
+            node->child = n;
+        }
+
+        node = n;
+    }
+
+    return node;
+}
+
+static void cmd_node_clear(struct cmd_node *node, struct cmd *cmd)
+{
+    struct cmd_node *n;
+
+    if (node->cmd == cmd)
+    {
+        node->cmd = NULL;
+    }
+
+    for (n = node->child; n; n = n->next)
+    {
+        cmd_node_clear(n, cmd);
+    }
+}
+
+static void cmd_node_free(struct cmd_node *node)
+{
+    struct cmd_node *n, *next;
+
+    for (n = node->child; n; n = next)
+    {
+        next = n->next;
+        cmd_node_free(n);
+        bot_free(n);
+    }
+
+    node->child = NULL;
+}
+
+static struct cmd *cmd_find(const char *name)
+{
+    struct cmd_node *node = cmd_node(name, strlen(name), 0);
+    return node ? node->cmd : NULL;
+}
+
+/* [cmd] <name> = <user> <channel> <global> overrides what the module asked for */
+static void cmd_config(struct cmd *cmd)
+{
+    CTX caller_ctx = bot_get_ctx();
+    const char *s;
+
+    bot_ctx(cmd_ctx);
+    s = config_get(cmd->name);
+    bot_ctx(caller_ctx);
+
+    if (s)
+    {
+        cmd->cooldown[CMD_USER] = cmd->cooldown[CMD_CHANNEL] = cmd->cooldown[CMD_GLOBAL] = 0;
+        sscanf(s, "%d %d %d", &cmd->cooldown[CMD_USER], &cmd->cooldown[CMD_CHANNEL], &cmd->cooldown[CMD_GLOBAL]);
+    }
+}
+
+int cmd_register(const char *name, const char *usage, CMD_CB cb)
+{
+    struct cmd_node *node;
+    struct cmd *cmd;
+    char labels[128];
+    char spec[CMD_ARGS + 1];
+
+    if (name == NULL || name[0] == '\0' || strchr(name, ' ') || cmd_find(name) || cmd_spec(usage ? usage : "", spec) < 0)
+    {
+        return -1;
+    }
+
+    cmd = bot_calloc(sizeof(struct cmd), 1);
+    cmd->name = bot_strdup(name);
+    cmd->usage = bot_strdup(usage ? usage : "");
+    strcpy(cmd->spec, spec);
+    cmd->cb = cb;
+    cmd->ctx = bot_get_ctx();
+
+    snprintf(labels, sizeof(labels), "command=\"%s\"", name);
+    cmd->calls = metrics_counter("corebot_cmd_calls_total", labels);
+    cmd->time = bot_cb_metric("cmd");
+
+    cmd_config(cmd);
+
+    node = cmd_node(name, strlen(name), 1);
+    node->cmd = cmd;
+
+    cmd->next = cmd_list;
+    cmd_list = cmd;
+
+    return 0;
+}
+
+int cmd_alias(const char *alias, const char *name)
+{
+    struct cmd *cmd = cmd_find(name);
+
+    if (cmd == NULL || alias == NULL || alias[0] == '\0' || strchr(alias, ' ') || cmd_find(alias))
+    {
+        return -1;
+    }
+
+    cmd_node(alias, strlen(alias), 1)->cmd = cmd;
+    return 0;
+}
+
+void cmd_cooldown(const char *name, int user, int channel, int global)
+{
+    struct cmd *cmd = cmd_find(name);
+
+    if (cmd)
+    {
+        cmd->cooldown[CMD_USER] = user;
+        cmd->cooldown[CMD_CHANNEL] = channel;
+        cmd->cooldown[CMD_GLOBAL] = global;
+        cmd_config(cmd);
+    }
+}
+
+static void cmd_remove(struct cmd *cmd)
+{
+    struct cmd **p;
+
+    for (p = &cmd_list; *p; p = &(*p)->next)
+    {
+        if (*p == cmd)
+        {
+            *p = cmd->next;
+            break;
+        }
+    }
+
+    cmd_node_clear(&cmd_root, cmd);
+    bot_free(cmd->name);
+    bot_free(cmd->usage);
+    bot_free(cmd);
+}
+
+void cmd_unregister(const char *name)
+{
+    struct cmd *cmd = cmd_find(name);
+
+    if (cmd)
+    {
+        cmd_remove(cmd);
+    }
+}
+
+void cmd_unregister_cb(CMD_CB cb)
+{
+    struct cmd *cmd, *next;
+
+    for (cmd = cmd_list; cmd; cmd = next)
+    {
+        next = cmd->next;
+
+        if (cmd->cb == cb)
+        {
+            cmd_remove(cmd);
+        }
+    }
+}
+
+static struct cmd_cool *cmd_cool_find(const char *key)
+{
+    struct cmd_cool *c;
+
+    for (c = cool[cmd_hash(key) % CMD_BUCKETS]; c; c = c->next)
+    {
+        if (strcmp(c->key, key) == 0)
+        {
+            return c;
+        }
+    }
+
+    return NULL;
+}
+
+/* checks every cooldown of the command and starts them if none is running */
+static int cmd_cooling(struct cmd *cmd, const char *nick, const char *channel, time_t now)
+{
+    char keys[3][256];
+    const char *who[3];
+    struct cmd_cool *c;
+    char *p;
+    int i, h;
+
+    who[CMD_USER] = nick;
+    who[CMD_CHANNEL] = channel;
+    who[CMD_GLOBAL] = "";
+
+    for (i = 0; i < 3; i++)
+    {
+        keys[i][0] = '\0';
+
+        if (cmd->cooldown[i] <= 0 || who[i] == NULL)
+        {
+            continue;
+        }
+
+        snprintf(keys[i], sizeof(keys[i]), "%d %s %s", i, cmd->name, who[i]);
+        for (p = keys[i]; *p; p++)
+        {
+            *p = tolower((unsigned char)*p);
+        }
+
+        if ((c = cmd_cool_find(keys[i])) && c->until > now)
+        {
+            return 1;
+        }
+    }
+
+    for (i = 0; i < 3; i++)
+    {
+        if (keys[i][0] == '\0')
+        {
+            continue;
+        }
+
+        if ((c = cmd_cool_find(keys[i])) == NULL)
+        {
+            c = bot_malloc(sizeof(struct cmd_cool));
+            c->key = bot_strdup(keys[i]);
+            h = cmd_hash(c->key) % CMD_BUCKETS;
+            c->next = cool[h];
+            cool[h] = c;
+        }
+
+        c->until = now + cmd->cooldown[i];
+    }
+
+    return 0;
+}
+
+void cmd_irc(const char *prefix, const char *command, const char *params, const char *trail)
+{
+    struct cmd_node *node;
+    struct cmd *cmd;
+    char nick[128];
+    char buf[512];
+    char *argv[CMD_ARGS + 1];
+    const char *channel = NULL;
+    char *s;
+    int argc = 0, len, i;
+    unsigned long start, end;
+
+    if (prefix == NULL || trail == NULL || params == NULL || strcmp(command, "PRIVMSG") != 0)
+    {
+        return;
+    }
+
+    if (strncmp(trail, cmd_prefix, cmd_prefix_len) != 0)
+    {
+        return;
+    }
+
+    trail += cmd_prefix_len;
+    len = strcspn(trail, " ");
+
+    if (len == 0 || (node = cmd_node(trail, len, 0)) == NULL || (cmd = node->cmd) == NULL || bot_disabled(cmd->ctx) || bot_shed(cmd->ctx))
+    {
+        return;
+    }
+
+    snprintf(nick, sizeof(nick), "%s", prefix);
+    nick[strcspn(nick, "!")] = '\0';
+
+    if (strchr("#&+!", params[0]))
+    {
+        channel = params;
+    }
+
+    if (cmd_cooling(cmd, nick, channel, time(NULL)))
+    {
+        metrics_add(rejected_cooldown, 1);
+        return;
+    }
+
+    snprintf(buf, sizeof(buf), "%s", trail + len);
+    s = buf;
+
+    for (i = 0; cmd->spec[i]; i++)
+    {
+        while (*s == ' ')
+        {
+            s++;
+        }
+
+        if (*s == '\0')
+        {
+            if (cmd->spec[i] == 'w' || cmd->spec[i] == 'R')
+            {
+                metrics_add(rejected_usage, 1);
+                irc_printf("NOTICE %s :Usage: %s%s %s\r\n", nick, cmd_prefix, cmd->name, cmd->usage);
+                return;
+            }
+            break;
+        }
+
+        argv[argc++] = s;
+
+        if (cmd->spec[i] == 'R' || cmd->spec[i] == 'r')
+        {
+            break;
+        }
+
+        s += strcspn(s, " ");
+        if (*s)
+        {
+            *s++ = '\0';
+        }
+    }
+
+    argv[argc] = NULL;
+
+    metrics_add(cmd->calls, 1);
+
+    start = watchdog_begin(cmd->ctx, "command", *(void **)(&cmd->cb));
+    bot_ctx(cmd->ctx);
+    cmd->cb(nick, channel ? channel : nick, argc, argv);
+    bot_ctx(cmd_ctx);
+    end = watchdog_end(start);
+
+    metrics_observe(cmd->time, end - start);
+    trace_span("cmd", cmd->ctx ? cmd->ctx->name : "core", start, end);
+}
+
+static void cmd_help(const char *nick, const char *target, int argc, char **argv)
+{
+    struct cmd *cmd;
+    char buf[400];
+    int len = 0;
+
+    if (argc > 0)
+    {
+        if ((cmd = cmd_find(argv[0])) == NULL)
+        {
+            irc_printf("NOTICE %s :No such command.\r\n", nick);
+            return;
+        }
+
+        irc_printf("NOTICE %s :Usage: %s%s %s\r\n", nick, cmd_prefix, cmd->name, cmd->usage);
+        return;
+    }
+
+    buf[0] = '\0';
+    for (cmd = cmd_list; cmd; cmd = cmd->next)
+    {
+        if (len + strlen(cmd->name) + cmd_prefix_len + 2 >= sizeof(buf))
+        {
+            irc_printf("NOTICE %s :Commands:%s\r\n", nick, buf);
+            len = 0;
+        }
+
+        len += sprintf(buf + len, " %s%s", cmd_prefix, cmd->name);
+    }
+
+    irc_printf("NOTICE %s :Commands:%s\r\n", nick, buf);
+}
+
+int cmd_init(CTX ctx)
+{
+    const char *s;
+
+    cmd_ctx = ctx;
+
+    if (bot_require("irc", 1) < 1)
+    {
+        log_printf("irc module required\n");
+        return -1;
+    }
+
+    s = config_get("prefix");
+    snprintf(cmd_prefix, sizeof(cmd_prefix), "%s", s ? s : "!");
+    cmd_prefix_len = strlen(cmd_prefix);
+
+    rejected_usage = metrics_counter("corebot_cmd_rejected_total", "reason=\"usage\"");
+    rejected_cooldown = metrics_counter("corebot_cmd_rejected_total", "reason=\"cooldown\"");
+
+    cmd_register("help", "[command]", cmd_help);
+    cmd_cooldown("help", 10, 0, 0);
+
+    irc_register_cb(cmd_irc);
+
+    return 1;
+}
+
+/* drop expired cooldowns */
+void cmd_timer()
+{
+    struct cmd_cool **p, *c;
+    time_t now = time(NULL);
+    int i;
+
+    for (i = 0; i < CMD_BUCKETS; i++)
+    {
+        for (p = &cool[i]; (c = *p); )
+        {
+            if (c->until <= now)
+            {
+                *p = c->next;
+                bot_free(c->key);
+                bot_free(c);
+            }
+            else
+            {
+                p = &c->next;
+            }
+        }
+    }
+}
+
+void cmd_free()
+{
+    struct cmd_cool *c;
+    int i;
+
+    irc_unregister_cb(cmd_irc);
+
+    while (cmd_list)
+    {
+        cmd_remove(cmd_list);
+    }
+
+    cmd_node_free(&cmd_root);
+
+    for (i = 0; i < CMD_BUCKETS; i++)
+    {
+        while ((c = cool[i]))
+        {
+            cool[i] = c->next;
+            bot_free(c->key);
+            bot_free(c);
+        }
+    }
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * nick, reply target (the channel or the nick for a private message),
+ * argc and argv as described by the usage of the command
+ */
+typedef void (*CMD_CB)(const char *, const char *, int, char **);
+
+/*
+ * usage lists the arguments, "<x>" is a required word, "[x]" an optional
+ * one and a trailing "..." makes the last argument take the rest of the
+ * line, e.g. "<nick> [days] [words...]"; returns -1 if the name is taken
+ * or the usage is invalid
+ */
+int cmd_register(const char *name, const char *usage, CMD_CB cb);
+int cmd_alias(const char *alias, const char *name);
+/* seconds between uses per nick, per channel and overall, 0 for none */
+void cmd_cooldown(const char *name, int user, int channel, int global);
+void cmd_unregister(const char *name);
+void cmd_unregister_cb(CMD_CB cb);
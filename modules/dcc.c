@@ -0,0 +1,973 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * DCC file transfers.
+ *
+ * Files under dir are offered with DCC SEND and go out with sendfile()
+ * straight from the page cache to the socket, and offers from others are
+ * received into incoming if it's set, written out DCC_BUF at a time. Only
+ * offers from a nick!user@host matching one of the senders masks are
+ * taken, and never from a loopback, private or otherwise internal
+ * address. A transfer can be resumed from either side with RESUME and
+ * ACCEPT.
+ *
+ * Every socket is non-blocking and only touched when the core says it's
+ * ready, a sender waits for write readiness through the write hook. Rate
+ * caps per transfer and overall are token buckets refilled from the idle
+ * hook, a transfer that runs out stops being polled until the next refill.
+ */
+
+#include "../bot.h"
+#include "irc.h"
+#include "cmd.h"
+#include "dcc.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <strings.h>
+#include <time.h>
+
+#define DCC_OFFER       1       /* listening for the nick to connect */
+#define DCC_SEND        2
+#define DCC_RESUME      3       /* asked the sender to resume, waiting for ACCEPT */
+#define DCC_CONNECT     4       /* connecting to the sender */
+#define DCC_RECV        5
+
+#define DCC_CHUNK       (1024 * 1024)   /* the most one sendfile() call moves */
+#define DCC_BUF         (256 * 1024)    /* received data is written out in these */
+#define DCC_NAME        256
+
+struct dcc
+{
+    int state;
+    int sock;                   /* listening or connected */
+    int file;
+    int throttled;              /* out of budget, not polled until refilled */
+    char nick[64];
+    char name[DCC_NAME];        /* as offered */
+    unsigned short port;        /* as offered, identifies RESUME and ACCEPT */
+    unsigned long addr;         /* sender to connect to */
+    off_t size;
+    off_t pos;                  /* sent or received */
+    off_t start;                /* resumed from */
+    time_t started;
+    time_t last;                /* last progress */
+    double budget;              /* bytes until the next refill */
+    char *buf;                  /* received, not yet written */
+    int off;
+    unsigned char ack[4];       /* partial acknowledgement */
+    int ackoff;
+    TAILQ_ENTRY(dcc) transfers;
+};
+
+CTX dcc_ctx = NULL;
+
+static TAILQ_HEAD(dcc_head, dcc) dcc_h;
+static struct pool dcc_pool;
+static int dcc_count = 0;
+static int have_cmd = 0;
+
+static char dir[256] = "files";
+static char incoming[256] = "";         /* empty when we don't receive */
+static char senders[512] = "";          /* lowercased masks, comma separated */
+static unsigned long address = 0;
+static int port_min = 0;
+static int port_max = 0;
+static double rate = 0;
+static double total_rate = 0;
+static double total_budget = 0;
+static unsigned long last_refill = 0;
+static int max_transfers = 8;
+static long max_size = 0;
+static int timeout = 120;
+
+static METRIC sent_bytes;
+static METRIC received_bytes;
+static METRIC active;
+static METRIC sent_files;
+static METRIC received_files;
+static METRIC failed;
+
+static struct dcc *dcc_new(const char *nick, const char *name, int state)
+{
+    struct dcc *d = pool_get(&dcc_pool);
+
+    if (d == NULL)
+    {
+        return NULL;
+    }
+
+    memset(d, 0, sizeof(struct dcc));
+    d->state = state;
+    d->sock = -1;
+    d->file = -1;
+    d->budget = rate;
+    d->started = d->last = time(NULL);
+    snprintf(d->nick, sizeof(d->nick), "%s", nick);
+    snprintf(d->name, sizeof(d->name), "%s", name);
+
+    TAILQ_INSERT_TAIL(&dcc_h, d, transfers);
+    metrics_set(active, ++dcc_count);
+
+    return d;
+}
+
+static struct dcc *dcc_find(int sock)
+{
+    struct dcc *d;
+
+    TAILQ_FOREACH(d, &dcc_h, transfers)
+    {
+        if (d->sock == sock)
+        {
+            return d;
+        }
+    }
+
+    return NULL;
+}
+
+static void dcc_flush(struct dcc *d)
+{
+    int n, done = 0;
+
+    while (done < d->off && (n = write(d->file, d->buf + done, d->off - done)) > 0)
+    {
+        done += n;
+    }
+
+    if (done < d->off)
+    {
+        log_lprintf(LOG_ERROR, "Writing %s failed: %s\n", d->name, strerror(errno));
+    }
+
+    d->off = 0;
+}
+
+/* why is NULL when it's done */
+static void dcc_close(struct dcc *d, const char *why)
+{
+    int secs = time(NULL) - d->started;
+
+    if (d->buf)
+    {
+        dcc_flush(d);
+        bot_free(d->buf);
+    }
+
+    if (d->sock >= 0)
+    {
+        bot_unregister_fd(d->sock);
+        close(d->sock);
+    }
+
+    if (d->file >= 0)
+    {
+        close(d->file);
+    }
+
+    if (why)
+    {
+        log_lprintf(LOG_WARN, "Transfer of %s with %s failed: %s\n", d->name, d->nick, why);
+        metrics_add(failed, 1);
+    }
+    else
+    {
+        log_printf("%s %s %s %s (%lu bytes in %d s)\n", d->state == DCC_SEND ? "Sent" : "Received",
+            d->name, d->state == DCC_SEND ? "to" : "from", d->nick, (unsigned long)(d->pos - d->start), secs);
+        metrics_add(d->state == DCC_SEND ? sent_files : received_files, 1);
+    }
+
+    TAILQ_REMOVE(&dcc_h, d, transfers);
+    pool_put(&dcc_pool, d);
+    metrics_set(active, --dcc_count);
+}
+
+/* how much d may move right now */
+static long dcc_allowance(struct dcc *d, long want)
+{
+    if (rate > 0 && d->budget < want)
+    {
+        want = d->budget;
+    }
+
+    if (total_rate > 0 && total_budget < want)
+    {
+        want = total_budget;
+    }
+
+    return want;
+}
+
+static void dcc_spend(struct dcc *d, long n)
+{
+    d->budget -= n;
+    total_budget -= n;
+    d->last = time(NULL);
+}
+
+static int dcc_nonblock(int sock)
+{
+    return fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+}
+
+static int dcc_listen(unsigned short *port)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    int sock, p, yes = 1;
+
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        return -1;
+    }
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    dcc_nonblock(sock);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    /* the first free port in the range, any port without one */
+    for (p = port_min; p <= port_max; p++)
+    {
+        sin.sin_port = htons(p);
+
+        if (bind(sock, (struct sockaddr *)&sin, sizeof(sin)) == 0)
+        {
+            break;
+        }
+    }
+
+    if (p > port_max || listen(sock, 1) < 0 || getsockname(sock, (struct sockaddr *)&sin, &len) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+
+    *port = ntohs(sin.sin_port);
+
+    return sock;
+}
+
+/* a name we can use as a file name, NULL if there's no such thing */
+static const char *dcc_name(const char *name)
+{
+    const char *p;
+
+    if ((p = strrchr(name, '/')))
+    {
+        name = p + 1;
+    }
+
+    if (*name == '\0' || *name == '.' || strlen(name) >= DCC_NAME)
+    {
+        return NULL;
+    }
+
+    return name;
+}
+
+int dcc_send(const char *nick, const char *file)
+{
+    char path[512];
+    const char *name;
+    struct stat st;
+    struct dcc *d;
+    int fd, sock;
+    unsigned short port;
+
+    if (address == 0)
+    {
+        log_lprintf(LOG_ERROR, "No address configured, can't offer files\n");
+        return -1;
+    }
+
+    if (dcc_count >= max_transfers || (name = dcc_name(file)) == NULL || name != file)
+    {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+    {
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || (sock = dcc_listen(&port)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if ((d = dcc_new(nick, name, DCC_OFFER)) == NULL)
+    {
+        close(sock);
+        close(fd);
+        return -1;
+    }
+
+    d->file = fd;
+    d->sock = sock;
+    d->port = port;
+    d->size = st.st_size;
+    bot_register_fd(sock);
+
+    irc_printf(strchr(name, ' ') ? "PRIVMSG %s :\001DCC SEND \"%s\" %lu %u %lu\001\r\n" : "PRIVMSG %s :\001DCC SEND %s %lu %u %lu\001\r\n",
+        nick, name, address, port, (unsigned long)d->size);
+
+    log_printf("Offered %s to %s on port %u\n", name, nick, port);
+
+    return 0;
+}
+
+static void dcc_push(struct dcc *d)
+{
+    long n;
+    ssize_t ret;
+
+    if ((n = dcc_allowance(d, d->size - d->pos < DCC_CHUNK ? d->size - d->pos : DCC_CHUNK)) <= 0)
+    {
+        if (d->pos < d->size)
+        {
+            d->throttled = 1;
+        }
+
+        bot_want_write(d->sock, 0);
+        return;
+    }
+
+    if ((ret = sendfile(d->sock, d->file, &d->pos, n)) > 0)
+    {
+        dcc_spend(d, ret);
+        metrics_add(sent_bytes, ret);
+    }
+    else if (ret < 0 && errno != EAGAIN && errno != EINTR)
+    {
+        dcc_close(d, strerror(errno));
+        return;
+    }
+
+    /* everything is out, the acknowledgements or the close finish it */
+    if (d->pos >= d->size)
+    {
+        bot_want_write(d->sock, 0);
+    }
+}
+
+static void dcc_accept(struct dcc *d)
+{
+    int sock;
+
+    if ((sock = accept(d->sock, NULL, NULL)) < 0)
+    {
+        if (errno != EAGAIN && errno != EINTR)
+        {
+            dcc_close(d, strerror(errno));
+        }
+        return;
+    }
+
+    bot_unregister_fd(d->sock);
+    close(d->sock);
+
+    dcc_nonblock(sock);
+    d->sock = sock;
+    d->state = DCC_SEND;
+    d->start = d->pos;
+    d->last = time(NULL);
+
+    bot_register_fd(sock);
+    bot_want_write(sock, 1);
+}
+
+/* the receiver acknowledges the total it has, modulo 2^32 */
+static void dcc_acks(struct dcc *d)
+{
+    unsigned char buf[64];
+    unsigned long ack;
+    int n, i;
+
+    if ((n = recv(d->sock, buf, sizeof(buf), 0)) <= 0)
+    {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        {
+            dcc_close(d, d->pos >= d->size ? NULL : "closed by peer");
+        }
+        return;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        d->ack[d->ackoff++] = buf[i];
+
+        if (d->ackoff == 4)
+        {
+            d->ackoff = 0;
+            ack = (unsigned long)d->ack[0] << 24 | d->ack[1] << 16 | d->ack[2] << 8 | d->ack[3];
+
+            if (d->pos >= d->size && ack == ((unsigned long)d->size & 0xFFFFFFFFUL))
+            {
+                dcc_close(d, NULL);
+                return;
+            }
+        }
+    }
+}
+
+static void dcc_receive(struct dcc *d)
+{
+    unsigned char ack[4];
+    unsigned long pos;
+    long n;
+    ssize_t ret;
+
+    if ((n = dcc_allowance(d, DCC_BUF - d->off)) <= 0)
+    {
+        d->throttled = 1;
+        bot_unregister_fd(d->sock);
+        return;
+    }
+
+    if ((ret = recv(d->sock, d->buf + d->off, n, 0)) <= 0)
+    {
+        if (ret == 0 || (errno != EAGAIN && errno != EINTR))
+        {
+            dcc_close(d, ret == 0 ? "closed by peer" : strerror(errno));
+        }
+        return;
+    }
+
+    dcc_spend(d, ret);
+    metrics_add(received_bytes, ret);
+    d->off += ret;
+    d->pos += ret;
+
+    if (d->off == DCC_BUF)
+    {
+        dcc_flush(d);
+    }
+
+    pos = (unsigned long)d->pos;
+    ack[0] = pos >> 24;
+    ack[1] = pos >> 16;
+    ack[2] = pos >> 8;
+    ack[3] = pos;
+
+    /* a lost one doesn't matter, the next one covers it */
+    send(d->sock, ack, 4, 0);
+
+    if (d->pos >= d->size)
+    {
+        dcc_close(d, NULL);
+    }
+}
+
+static void dcc_connect(struct dcc *d)
+{
+    char path[512];
+    struct sockaddr_in sin;
+
+    snprintf(path, sizeof(path), "%s/%s", incoming, d->name);
+
+    if ((d->file = open(path, O_WRONLY|O_CREAT|(d->pos ? 0 : O_TRUNC), 0644)) < 0 || lseek(d->file, d->pos, SEEK_SET) < 0)
+    {
+        dcc_close(d, strerror(errno));
+        return;
+    }
+
+    if ((d->sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        dcc_close(d, strerror(errno));
+        return;
+    }
+
+    dcc_nonblock(d->sock);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(d->addr);
+    sin.sin_port = htons(d->port);
+
+    d->buf = bot_malloc(DCC_BUF);
+    d->start = d->pos;
+    d->state = DCC_CONNECT;
+    bot_register_fd(d->sock);
+
+    if (connect(d->sock, (struct sockaddr *)&sin, sizeof(sin)) == 0)
+    {
+        d->state = DCC_RECV;
+    }
+    else if (errno == EINPROGRESS)
+    {
+        bot_want_write(d->sock, 1);
+    }
+    else
+    {
+        dcc_close(d, strerror(errno));
+    }
+}
+
+/* the connect finished one way or the other, a good one starts receiving */
+static int dcc_connected(struct dcc *d)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(d->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+    {
+        dcc_close(d, strerror(err ? err : errno));
+        return 0;
+    }
+
+    d->state = DCC_RECV;
+    bot_want_write(d->sock, 0);
+
+    return 1;
+}
+
+void dcc_read(int sock)
+{
+    struct dcc *d = dcc_find(sock);
+
+    if (d == NULL)
+    {
+        return;
+    }
+
+    switch (d->state)
+    {
+        case DCC_OFFER:
+            dcc_accept(d);
+            break;
+        case DCC_SEND:
+            dcc_acks(d);
+            break;
+        case DCC_RECV:
+            dcc_receive(d);
+            break;
+        case DCC_CONNECT:
+            /* the sender may have written already by the time we see it connected */
+            if (dcc_connected(d))
+            {
+                dcc_receive(d);
+            }
+            break;
+    }
+}
+
+void dcc_write(int sock)
+{
+    struct dcc *d = dcc_find(sock);
+
+    if (d == NULL)
+    {
+        return;
+    }
+
+    if (d->state == DCC_CONNECT)
+    {
+        dcc_connected(d);
+    }
+    else if (d->state == DCC_SEND)
+    {
+        dcc_push(d);
+    }
+}
+
+/* refills the buckets and lets the throttled transfers go on */
+void dcc_idle()
+{
+    unsigned long now = metrics_now();
+    double secs = (now - last_refill) / 1e9;
+    struct dcc *d;
+
+    last_refill = now;
+
+    if (total_rate > 0)
+    {
+        total_budget += total_rate * secs;
+        total_budget = total_budget > total_rate ? total_rate : total_budget;
+    }
+
+    TAILQ_FOREACH(d, &dcc_h, transfers)
+    {
+        if (rate > 0)
+        {
+            d->budget += rate * secs;
+            d->budget = d->budget > rate ? rate : d->budget;
+        }
+
+        if (d->throttled && dcc_allowance(d, 1) > 0)
+        {
+            d->throttled = 0;
+
+            if (d->state == DCC_SEND)
+            {
+                bot_want_write(d->sock, 1);
+            }
+            else
+            {
+                bot_register_fd(d->sock);
+            }
+        }
+    }
+}
+
+static struct dcc *dcc_offered(const char *nick, int state, unsigned short port)
+{
+    struct dcc *d;
+
+    TAILQ_FOREACH(d, &dcc_h, transfers)
+    {
+        if (d->state == state && d->port == port && strcasecmp(d->nick, nick) == 0)
+        {
+            return d;
+        }
+    }
+
+    return NULL;
+}
+
+/* prefix matches one of the senders masks */
+static int dcc_sender(const char *prefix)
+{
+    char who[256], mask[256];
+    const char *p;
+    int i, len;
+
+    for (i = 0; prefix[i] && i < (int)sizeof(who) - 1; i++)
+    {
+        who[i] = tolower((unsigned char)prefix[i]);
+    }
+    who[i] = '\0';
+
+    for (p = senders; *p; p += len + (p[len] == ','))
+    {
+        len = strcspn(p, ",");
+        snprintf(mask, sizeof(mask), "%.*s", len, p);
+
+        if (*mask && fnmatch(mask, who, 0) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* anything we shouldn't be made to connect to: this host, private, link local, shared, multicast and reserved */
+static int dcc_internal(unsigned long addr)
+{
+    return (addr >> 24) == 0 || (addr >> 24) == 10 || (addr >> 24) == 127 ||
+        (addr & 0xFFC00000UL) == 0x64400000UL ||    /* 100.64/10 */
+        (addr & 0xFFFF0000UL) == 0xA9FE0000UL ||    /* 169.254/16 */
+        (addr & 0xFFF00000UL) == 0xAC100000UL ||    /* 172.16/12 */
+        (addr & 0xFFFF0000UL) == 0xC0A80000UL ||    /* 192.168/16 */
+        (addr >> 28) >= 14;                         /* 224/4 and up */
+}
+
+/* someone offers us a file */
+static void dcc_offer(const char *prefix, const char *nick, const char *file, unsigned long addr, unsigned short port, unsigned long size)
+{
+    char path[512];
+    const char *name;
+    struct stat st;
+    struct dcc *d;
+
+    if (*incoming == '\0')
+    {
+        log_lprintf(LOG_INFO, "Ignored %s from %s, no incoming directory\n", file, nick);
+        return;
+    }
+
+    if (!dcc_sender(prefix))
+    {
+        log_lprintf(LOG_INFO, "Ignored %s from %s, not in senders\n", file, prefix);
+        return;
+    }
+
+    if (port == 0 || addr == 0)
+    {
+        log_lprintf(LOG_INFO, "Ignored %s from %s, passive DCC isn't supported\n", file, nick);
+        return;
+    }
+
+    if (dcc_internal(addr))
+    {
+        log_lprintf(LOG_WARN, "Ignored %s from %s, it points at an internal address\n", file, prefix);
+        return;
+    }
+
+    if ((name = dcc_name(file)) == NULL || dcc_count >= max_transfers || (max_size > 0 && size > (unsigned long)max_size))
+    {
+        log_lprintf(LOG_INFO, "Refused %s from %s\n", file, nick);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", incoming, name);
+
+    if ((d = dcc_new(nick, name, DCC_RESUME)) == NULL)
+    {
+        return;
+    }
+
+    d->addr = addr;
+    d->port = port;
+    d->size = size;
+
+    /* the rest of what we already have part of */
+    if (stat(path, &st) == 0 && st.st_size > 0)
+    {
+        if (st.st_size >= d->size)
+        {
+            dcc_close(d, "already received");
+            return;
+        }
+
+        d->pos = st.st_size;
+        irc_printf(strchr(name, ' ') ? "PRIVMSG %s :\001DCC RESUME \"%s\" %u %lu\001\r\n" : "PRIVMSG %s :\001DCC RESUME %s %u %lu\001\r\n",
+            nick, name, port, (unsigned long)d->pos);
+        return;
+    }
+
+    dcc_connect(d);
+}
+
+/* splits on spaces, a "quoted file name" stays one */
+static int dcc_args(char *s, char **argv, int max)
+{
+    int argc = 0;
+
+    while (*s && argc < max)
+    {
+        s += strspn(s, " ");
+
+        if (*s == '"' && strchr(s + 1, '"'))
+        {
+            argv[argc++] = ++s;
+            s = strchr(s, '"');
+        }
+        else if (*s)
+        {
+            argv[argc++] = s;
+            s += strcspn(s, " ");
+        }
+
+        if (*s)
+        {
+            *s++ = '\0';
+        }
+    }
+
+    return argc;
+}
+
+void dcc_irc(const char *prefix, const char *command, const char *params, const char *trail)
+{
+    char nick[64], line[512];
+    char *argv[6];
+    struct dcc *d;
+    unsigned long pos;
+    int argc;
+
+    if (strcmp(command, "PRIVMSG") || prefix == NULL || trail == NULL || strncmp(trail, "\001DCC ", 5) || params == NULL || *params == '#')
+    {
+        return;
+    }
+
+    snprintf(nick, sizeof(nick), "%.*s", (int)strcspn(prefix, "!"), prefix);
+    snprintf(line, sizeof(line), "%s", trail + 5);
+    line[strcspn(line, "\001")] = '\0';
+
+    if ((argc = dcc_args(line, argv, 6)) < 4)
+    {
+        return;
+    }
+
+    if (strcmp(argv[0], "SEND") == 0 && argc >= 5)
+    {
+        dcc_offer(prefix, nick, argv[1], strtoul(argv[2], NULL, 10), atoi(argv[3]), strtoul(argv[4], NULL, 10));
+    }
+    else if (strcmp(argv[0], "RESUME") == 0 && (d = dcc_offered(nick, DCC_OFFER, atoi(argv[2]))))
+    {
+        if ((pos = strtoul(argv[3], NULL, 10)) < (unsigned long)d->size)
+        {
+            d->pos = pos;
+            irc_printf("PRIVMSG %s :\001DCC ACCEPT %s %s %lu\001\r\n", nick, argv[1], argv[2], pos);
+        }
+    }
+    else if (strcmp(argv[0], "ACCEPT") == 0 && (d = dcc_offered(nick, DCC_RESUME, atoi(argv[2]))))
+    {
+        if (strtoul(argv[3], NULL, 10) == (unsigned long)d->pos)
+        {
+            dcc_connect(d);
+        }
+        else
+        {
+            dcc_close(d, "resumed at the wrong position");
+        }
+    }
+}
+
+static void dcc_get(const char *nick, const char *target, int argc, char **argv)
+{
+    if (dcc_send(nick, argv[0]) < 0)
+    {
+        irc_printf("NOTICE %s :Can't send %s right now\r\n", nick, argv[0]);
+    }
+}
+
+int dcc_init(CTX ctx)
+{
+    const char *s;
+    int i;
+
+    dcc_ctx = ctx;
+
+    TAILQ_INIT(&dcc_h);
+    pool_init(&dcc_pool, sizeof(struct dcc));
+
+    if (bot_require("irc", 1) < 1)
+    {
+        log_printf("irc module required\n");
+        return -1;
+    }
+
+    if ((s = config_get("dir")))
+    {
+        snprintf(dir, sizeof(dir), "%s", s);
+    }
+
+    if ((s = config_get("incoming")))
+    {
+        snprintf(incoming, sizeof(incoming), "%s", s);
+    }
+
+    if ((s = config_get("senders")))
+    {
+        for (i = 0; s[i] && i < (int)sizeof(senders) - 1; i++)
+        {
+            senders[i] = tolower((unsigned char)s[i]);
+        }
+        senders[i] = '\0';
+    }
+
+    if ((s = config_get("address")))
+    {
+        address = ntohl(inet_addr(s));
+    }
+
+    if ((s = config_get("port_min")) && atoi(s) > 0)
+    {
+        port_min = atoi(s);
+        port_max = (s = config_get("port_max")) && atoi(s) > port_min ? atoi(s) : port_min;
+    }
+
+    if ((s = config_get("rate")))
+    {
+        rate = atof(s);
+    }
+
+    if ((s = config_get("total_rate")))
+    {
+        total_rate = total_budget = atof(s);
+    }
+
+    if ((s = config_get("max_transfers")) && atoi(s) > 0)
+    {
+        max_transfers = atoi(s);
+    }
+
+    if ((s = config_get("max_size")))
+    {
+        max_size = atol(s);
+    }
+
+    if ((s = config_get("timeout")) && atoi(s) > 0)
+    {
+        timeout = atoi(s);
+    }
+
+    sent_bytes = metrics_counter("corebot_dcc_sent_bytes_total", NULL);
+    received_bytes = metrics_counter("corebot_dcc_received_bytes_total", NULL);
+    sent_files = metrics_counter("corebot_dcc_transfers_total", "direction=\"send\"");
+    received_files = metrics_counter("corebot_dcc_transfers_total", "direction=\"receive\"");
+    failed = metrics_counter("corebot_dcc_failed_total", NULL);
+    active = metrics_gauge("corebot_dcc_active_transfers", NULL);
+
+    last_refill = metrics_now();
+
+    irc_register_cb(dcc_irc);
+
+    /* !get is there when commands are */
+    if (bot_require("cmd", 1) >= 1)
+    {
+        cmd_register("get", "<file>", dcc_get);
+        have_cmd = 1;
+    }
+
+    return 1;
+}
+
+void dcc_timer()
+{
+    time_t now = time(NULL);
+    struct dcc *d, *next;
+
+    for (d = TAILQ_FIRST(&dcc_h); d; d = next)
+    {
+        next = TAILQ_NEXT(d, transfers);
+
+        if (d->last + timeout < now)
+        {
+            dcc_close(d, "timed out");
+        }
+    }
+}
+
+void dcc_free()
+{
+    struct dcc *d;
+
+    irc_unregister_cb(dcc_irc);
+
+    if (have_cmd)
+    {
+        cmd_unregister_cb(dcc_get);
+    }
+
+    while ( (d = TAILQ_FIRST(&dcc_h)) )
+    {
+        dcc_close(d, "unloaded");
+    }
+
+    pool_free(&dcc_pool);
+}
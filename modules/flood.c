@@ -0,0 +1,470 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Flood detection.
+ *
+ * Every kind of event (messages per nick, messages per host, identical
+ * lines per channel, joins per channel) is counted in a count-min sketch
+ * over a sliding window. The window is split into FLOOD_SLOTS slots, each
+ * with its own sketch, and a running sum of all slots answers estimates
+ * with one counter per row. When the oldest slot expires its counters are
+ * subtracted from the sum and it is reused, so memory is fixed and every
+ * message costs FLOOD_DEPTH increments per kind no matter how many users
+ * there are.
+ *
+ * Keys whose estimate crosses the limit go into a small heavy hitter
+ * table that keeps the worst offenders and makes sure an offence fires
+ * its actions only once per window.
+ */
+
+#include "../bot.h"
+#include "irc.h"
+#include "flood.h"
+
+#include <ctype.h>
+#include <time.h>
+
+#define FLOOD_SLOTS     6
+#define FLOOD_DEPTH     4
+#define FLOOD_HITTERS   64
+#define FLOOD_KEY       64
+
+#define FLOOD_NICK      0
+#define FLOOD_HOST      1
+#define FLOOD_TEXT      2
+#define FLOOD_JOIN      3
+#define FLOOD_KINDS     4
+
+#define ACTION_LOG      1
+#define ACTION_WARN     2
+#define ACTION_KICK     4
+#define ACTION_BAN      8
+#define ACTION_LOCK     16      /* +i on the channel */
+
+struct flood_sketch
+{
+    const char *kind;
+    unsigned int limit;
+    int actions;
+    unsigned int *slots;        /* FLOOD_SLOTS * FLOOD_DEPTH * width */
+    unsigned int *sum;          /* FLOOD_DEPTH * width */
+    METRIC offences;
+};
+
+struct flood_hitter
+{
+    int kind;
+    char key[FLOOD_KEY];
+    unsigned int count;
+    time_t fired;
+};
+
+struct cb_entry
+{
+    FLOOD_CB cb;
+    CTX ctx;
+    TAILQ_ENTRY(cb_entry) cb_entries;
+};
+
+CTX flood_ctx = NULL;
+
+static TAILQ_HEAD(cb_head, cb_entry) cb_h;
+
+static struct flood_sketch sketches[FLOOD_KINDS] = {
+    { "nick", 20, ACTION_LOG },
+    { "host", 30, ACTION_LOG },
+    { "text", 5, ACTION_LOG },
+    { "join", 20, ACTION_LOG },
+};
+
+static struct flood_hitter hitters[FLOOD_HITTERS];
+static unsigned int width = 4096;       /* power of two */
+static int window = 60;
+static int slot = 0;
+static time_t slot_start = 0;
+
+void flood_register_cb(FLOOD_CB cb)
+{
+    struct cb_entry *e;
+
+    TAILQ_FOREACH(e, &cb_h, cb_entries)
+    {
+        if (e->cb == cb)
+        {
+            return;
+        }
+    }
+
+    e = bot_malloc(sizeof(struct cb_entry));
+    e->ctx = bot_get_ctx();
+    e->cb = cb;
+    TAILQ_INSERT_TAIL(&cb_h, e, cb_entries);
+}
+
+void flood_unregister_cb(FLOOD_CB cb)
+{
+    struct cb_entry *e;
+
+    TAILQ_FOREACH(e, &cb_h, cb_entries)
+    {
+        if (e->cb == cb)
+        {
+            TAILQ_REMOVE(&cb_h, e, cb_entries);
+            bot_free(e);
+            break;
+        }
+    }
+}
+
+/* case folded FNV-1a */
+static unsigned int flood_hash(const char *s, unsigned int h)
+{
+    while (*s)
+    {
+        h ^= (unsigned char)tolower((unsigned char)*s++);
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+/* adds one to key and returns the estimate for the whole window */
+static unsigned int flood_count(struct flood_sketch *sk, unsigned int h)
+{
+    unsigned int h2, i, idx, min = ~0U;
+    unsigned int *cur = sk->slots + slot * FLOOD_DEPTH * width;
+
+    /* rows are indexed by double hashing, h2 is odd so it cycles the width */
+    h2 = ((h >> 16) ^ (h * 0x45d9f3bU)) | 1;
+
+    for (i = 0; i < FLOOD_DEPTH; i++)
+    {
+        idx = i * width + ((h + i * h2) & (width - 1));
+        cur[idx]++;
+
+        if (++sk->sum[idx] < min)
+        {
+            min = sk->sum[idx];
+        }
+    }
+
+    return min;
+}
+
+/* expire slots the clock has moved past */
+static void flood_rotate(time_t now)
+{
+    int period = window / FLOOD_SLOTS > 0 ? window / FLOOD_SLOTS : 1;
+    unsigned int i, k, n = FLOOD_DEPTH * width;
+    unsigned int *old;
+    int steps = 0;
+
+    while (now >= slot_start + period && steps < FLOOD_SLOTS)
+    {
+        slot = (slot + 1) % FLOOD_SLOTS;
+        slot_start += period;
+        steps++;
+
+        for (k = 0; k < FLOOD_KINDS; k++)
+        {
+            old = sketches[k].slots + slot * n;
+            for (i = 0; i < n; i++)
+            {
+                sketches[k].sum[i] -= old[i];
+            }
+            memset(old, 0, n * sizeof(unsigned int));
+        }
+    }
+
+    /* idle for a whole window, everything above is zero already */
+    if (now >= slot_start + period)
+    {
+        slot_start = now;
+    }
+}
+
+/* finds or makes room for an offender, returns NULL if it already fired */
+static struct flood_hitter *flood_hitter(int kind, const char *key, unsigned int count, time_t now)
+{
+    struct flood_hitter *h, *low = NULL;
+    int i;
+
+    for (i = 0; i < FLOOD_HITTERS; i++)
+    {
+        h = &hitters[i];
+
+        if (h->count && h->kind == kind && strcmp(h->key, key) == 0)
+        {
+            h->count = count;
+            return h->fired + window > now ? NULL : h;
+        }
+
+        /* stale entries go first, then the smallest offender */
+        if (low == NULL || (h->fired + window <= now) > (low->fired + window <= now) ||
+                ((h->fired + window <= now) == (low->fired + window <= now) && h->count < low->count))
+        {
+            low = h;
+        }
+    }
+
+    if (low->count && low->fired + window > now && low->count >= count)
+    {
+        return NULL;
+    }
+
+    low->kind = kind;
+    low->count = count;
+    snprintf(low->key, sizeof(low->key), "%s", key);
+    return low;
+}
+
+static void flood_offence(int kind, const char *nick, const char *host, const char *channel, unsigned int count)
+{
+    struct flood_sketch *sk = &sketches[kind];
+    struct flood_hitter *h;
+    struct cb_entry *e;
+    const char *key;
+    time_t now = time(NULL);
+    unsigned long start;
+
+    /* a join flood is the channel's problem, everything else the sender's */
+    key = kind == FLOOD_HOST ? host : kind == FLOOD_JOIN ? channel : nick;
+
+    if ((h = flood_hitter(kind, key, count, now)) == NULL)
+    {
+        return;
+    }
+
+    h->fired = now;
+    metrics_add(sk->offences, 1);
+
+    if (sk->actions & ACTION_LOG)
+    {
+        log_lprintf(LOG_WARN, "%s flood by %s (%s) in %s, %u in %ds\n", sk->kind, nick, host, channel ? channel : "private", count, window);
+    }
+
+    if (sk->actions & ACTION_WARN)
+    {
+        irc_printf("NOTICE %s :Please slow down.\r\n", nick);
+    }
+
+    if (channel)
+    {
+        if (sk->actions & ACTION_BAN)
+        {
+            irc_printf("MODE %s +b *!*@%s\r\n", channel, host);
+        }
+
+        if (sk->actions & ACTION_KICK)
+        {
+            irc_printf("KICK %s %s :Flooding\r\n", channel, nick);
+        }
+
+        if (sk->actions & ACTION_LOCK)
+        {
+            irc_printf("MODE %s +i\r\n", channel);
+        }
+    }
+
+    TAILQ_FOREACH(e, &cb_h, cb_entries)
+    {
+        if (!bot_disabled(e->ctx) && !bot_shed(e->ctx))
+        {
+            start = watchdog_begin(e->ctx, "flood callback", *(void **)(&e->cb));
+            bot_ctx(e->ctx);
+            e->cb(sk->kind, nick, host, channel, count);
+            bot_ctx(flood_ctx);
+            watchdog_end(start);
+        }
+    }
+}
+
+void flood_irc(const char *prefix, const char *command, const char *params, const char *trail)
+{
+    char nick[128];
+    const char *host, *channel = NULL;
+    unsigned int count, h;
+
+    if (prefix == NULL || strchr(prefix, '@') == NULL)
+    {
+        return;
+    }
+
+    snprintf(nick, sizeof(nick), "%s", prefix);
+    nick[strcspn(nick, "!")] = '\0';
+    host = strchr(prefix, '@') + 1;
+
+    if (strcmp(command, "JOIN") == 0)
+    {
+        channel = params ? params : trail;
+        if (channel && (count = flood_count(&sketches[FLOOD_JOIN], flood_hash(channel, 2166136261U))) > sketches[FLOOD_JOIN].limit)
+        {
+            flood_offence(FLOOD_JOIN, nick, host, channel, count);
+        }
+        return;
+    }
+
+    if ((strcmp(command, "PRIVMSG") != 0 && strcmp(command, "NOTICE") != 0) || params == NULL)
+    {
+        return;
+    }
+
+    if (strchr("#&+!", params[0]))
+    {
+        channel = params;
+    }
+
+    if ((count = flood_count(&sketches[FLOOD_NICK], flood_hash(nick, 2166136261U))) > sketches[FLOOD_NICK].limit)
+    {
+        flood_offence(FLOOD_NICK, nick, host, channel, count);
+    }
+
+    if ((count = flood_count(&sketches[FLOOD_HOST], flood_hash(host, 2166136261U))) > sketches[FLOOD_HOST].limit)
+    {
+        flood_offence(FLOOD_HOST, nick, host, channel, count);
+    }
+
+    if (trail && channel)
+    {
+        h = flood_hash(trail, flood_hash(channel, 2166136261U));
+        if ((count = flood_count(&sketches[FLOOD_TEXT], h)) > sketches[FLOOD_TEXT].limit)
+        {
+            flood_offence(FLOOD_TEXT, nick, host, channel, count);
+        }
+    }
+}
+
+static int flood_actions(const char *s)
+{
+    char buf[128];
+    char *p, *last = NULL;
+    int ret = 0;
+
+    snprintf(buf, sizeof(buf), "%s", s);
+
+    for ((p = strtok_r(buf, ",", &last)); p; (p = strtok_r(NULL, ",", &last)))
+    {
+        if (strcmp(p, "log") == 0)
+        {
+            ret |= ACTION_LOG;
+        }
+        else if (strcmp(p, "warn") == 0)
+        {
+            ret |= ACTION_WARN;
+        }
+        else if (strcmp(p, "kick") == 0)
+        {
+            ret |= ACTION_KICK;
+        }
+        else if (strcmp(p, "ban") == 0)
+        {
+            ret |= ACTION_BAN;
+        }
+        else if (strcmp(p, "lock") == 0)
+        {
+            ret |= ACTION_LOCK;
+        }
+        else if (strcmp(p, "none") != 0)
+        {
+            log_lprintf(LOG_WARN, "Unknown action %s\n", p);
+        }
+    }
+
+    return ret;
+}
+
+int flood_init(CTX ctx)
+{
+    char key[32], labels[64];
+    const char *s;
+    int k;
+
+    flood_ctx = ctx;
+
+    TAILQ_INIT(&cb_h);
+
+    if (bot_require("irc", 1) < 1)
+    {
+        log_printf("irc module required\n");
+        return -1;
+    }
+
+    if ((s = config_get("window")) && atoi(s) > 0)
+    {
+        window = atoi(s);
+    }
+
+    if ((s = config_get("width")) && atoi(s) > 0)
+    {
+        for (width = 64; width < (unsigned int)atoi(s); width <<= 1);
+    }
+
+    for (k = 0; k < FLOOD_KINDS; k++)
+    {
+        snprintf(key, sizeof(key), "%s_limit", sketches[k].kind);
+        if ((s = config_get(key)) && atoi(s) > 0)
+        {
+            sketches[k].limit = atoi(s);
+        }
+
+        snprintf(key, sizeof(key), "%s_action", sketches[k].kind);
+        if ((s = config_get(key)))
+        {
+            sketches[k].actions = flood_actions(s);
+        }
+
+        sketches[k].slots = bot_calloc(FLOOD_SLOTS * FLOOD_DEPTH * width, sizeof(unsigned int));
+        sketches[k].sum = bot_calloc(FLOOD_DEPTH * width, sizeof(unsigned int));
+
+        snprintf(labels, sizeof(labels), "kind=\"%s\"", sketches[k].kind);
+        sketches[k].offences = metrics_counter("corebot_flood_offences_total", labels);
+    }
+
+    metrics_set(metrics_gauge("corebot_flood_sketch_bytes", NULL), (double)FLOOD_KINDS * (FLOOD_SLOTS + 1) * FLOOD_DEPTH * width * sizeof(unsigned int));
+
+    slot_start = time(NULL);
+
+    irc_register_cb(flood_irc);
+
+    return 1;
+}
+
+void flood_timer()
+{
+    flood_rotate(time(NULL));
+}
+
+void flood_free()
+{
+    struct cb_entry *e;
+    int k;
+
+    irc_unregister_cb(flood_irc);
+
+    while ( (e = TAILQ_FIRST(&cb_h)) )
+    {
+        TAILQ_REMOVE(&cb_h, e, cb_entries);
+        bot_free(e);
+    }
+
+    for (k = 0; k < FLOOD_KINDS; k++)
+    {
+        bot_free(sketches[k].slots);
+        bot_free(sketches[k].sum);
+        sketches[k].slots = sketches[k].sum = NULL;
+    }
+}
@@ -0,0 +1,591 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Out-of-process module host.
+ *
+ * The modules listed in [host] modules are loaded in a forked worker
+ * instead of the core process. Parsed irc events go to the worker and the
+ * lines its modules send come back through two single producer, single
+ * consumer rings in shared memory. Records are written in place and read
+ * in place, an eventfd wakes the consumer only when a ring goes from empty
+ * to non-empty. Neither side waits for the other, what doesn't fit in a
+ * full ring is dropped and counted.
+ *
+ * A crashed worker is restarted from the timer, the server connection is
+ * never touched. The event a worker died on is skipped so a poison line
+ * can't crash it in a loop.
+ */
+
+#include "../bot.h"
+#include "irc.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+
+#define HOST_WRAP       0xFFFFFFFFU
+#define HOST_ALIGN(n)   (((n) + 3) & ~3UL)
+#define HOST_MODULES    16
+
+struct host_ring
+{
+    volatile unsigned long head;        /* written by the producer only */
+    char pad0[64];
+    volatile unsigned long tail;        /* written by the consumer only */
+    char pad1[64];
+    volatile int busy;                  /* consumer is dispatching the record at tail */
+    volatile unsigned long dropped;     /* records that didn't fit, by the producer */
+    unsigned long size;                 /* power of two */
+};
+
+#define RING_DATA(r) ((char *)((r) + 1))
+
+static struct host_ring *ring_in = NULL;    /* events, core -> worker */
+static struct host_ring *ring_out = NULL;   /* lines, worker -> core */
+static size_t shm_len = 0;
+static int efd_in = -1;
+static int efd_out = -1;
+
+static pid_t worker = 0;
+static pid_t parent = 0;
+static time_t worker_died = 0;
+static int restart_delay = 1;
+
+static char *hosted = NULL;
+
+static METRIC events;
+static METRIC dropped;
+static METRIC lines_dropped;
+static unsigned long out_dropped = 0;  /* ring_out->dropped already counted */
+static METRIC restarts;
+
+/* producer side, returns the payload area or NULL when the ring is full */
+static char *host_ring_reserve(struct host_ring *r, unsigned int len, unsigned long *next)
+{
+    unsigned long head = r->head;
+    unsigned long pos = head & (r->size - 1);
+    unsigned long need = HOST_ALIGN(4 + len);
+    unsigned long skip = 0;
+
+    if (pos + need > r->size)
+    {
+        skip = r->size - pos;
+    }
+
+    if (r->size - (head - r->tail) < skip + need)
+    {
+        return NULL;
+    }
+
+    if (skip)
+    {
+        *(unsigned int *)(RING_DATA(r) + pos) = HOST_WRAP;
+        pos = 0;
+    }
+
+    *(unsigned int *)(RING_DATA(r) + pos) = len;
+    *next = head + skip + need;
+
+    return RING_DATA(r) + pos + 4;
+}
+
+/* publishes a reserved record, returns true if the consumer needs a wakeup */
+static int host_ring_commit(struct host_ring *r, unsigned long next)
+{
+    unsigned long head = r->head;
+
+    __sync_synchronize();
+    r->head = next;
+    __sync_synchronize();
+
+    return r->tail == head;
+}
+
+/* consumer side, returns the oldest record in place or NULL */
+static char *host_ring_peek(struct host_ring *r, unsigned int *len)
+{
+    unsigned long pos;
+    unsigned int n;
+
+    for (;;)
+    {
+        if (r->tail == r->head)
+        {
+            return NULL;
+        }
+
+        __sync_synchronize();
+
+        pos = r->tail & (r->size - 1);
+        n = *(unsigned int *)(RING_DATA(r) + pos);
+
+        if (n != HOST_WRAP)
+        {
+            *len = n;
+            return RING_DATA(r) + pos + 4;
+        }
+
+        r->tail += r->size - pos;
+    }
+}
+
+static void host_ring_release(struct host_ring *r, unsigned int len)
+{
+    __sync_synchronize();
+    r->tail += HOST_ALIGN(4 + len);
+}
+
+static void host_notify(int fd)
+{
+    if (eventfd_write(fd, 1) < 0 && errno != EAGAIN)
+    {
+        log_lprintf(LOG_ERROR, "eventfd: %s\n", strerror(errno));
+    }
+}
+
+static void host_drain(int fd)
+{
+    eventfd_t count;
+
+    eventfd_read(fd, &count);
+}
+
+/*
+ * Worker side
+ */
+
+/* irc_printf() output in the worker */
+static void host_worker_send(const char *line)
+{
+    unsigned int len = strlen(line) + 1;
+    unsigned long next;
+    char *p;
+
+    /* a stalled core mustn't stall the modules too, the core counts these */
+    if ((p = host_ring_reserve(ring_out, len, &next)) == NULL)
+    {
+        ring_out->dropped++;
+        return;
+    }
+
+    memcpy(p, line, len);
+
+    if (host_ring_commit(ring_out, next))
+    {
+        host_notify(efd_out);
+    }
+}
+
+static const char *host_field(const char **p, int present)
+{
+    const char *s = *p;
+
+    if (!present)
+    {
+        return NULL;
+    }
+
+    *p += strlen(s) + 1;
+
+    return s;
+}
+
+static void host_worker_events()
+{
+    const char *p, *prefix, *command, *params, *trail;
+    unsigned int len;
+    int mask;
+    char *rec;
+
+    host_drain(efd_in);
+
+    while ((rec = host_ring_peek(ring_in, &len)))
+    {
+        ring_in->busy = 1;
+
+        mask = rec[0];
+        p = rec + 1;
+        prefix = host_field(&p, mask & 1);
+        command = host_field(&p, 1);
+        params = host_field(&p, mask & 2);
+        trail = host_field(&p, mask & 4);
+
+        irc_dispatch(prefix, command, params, trail);
+        arena_reset(&line_arena);
+
+        host_ring_release(ring_in, len);
+        ring_in->busy = 0;
+    }
+}
+
+static void host_worker()
+{
+    struct bot_module *mods[HOST_MODULES];
+    struct bot_module *mod;
+    char *list, *p, *last = NULL;
+    time_t now, last_timer = 0;
+    unsigned long start;
+    int n = 0, i;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGHUP, SIG_IGN);
+
+    /* the parent's watchdog thread didn't come along */
+    watchdog_init();
+
+    /* the core keeps its sockets and callbacks, we only keep the rings */
+    for (i = 0; i < bot_nfds; i++)
+    {
+        if (bot_fds[i].fd != efd_out)
+        {
+            close(bot_fds[i].fd);
+        }
+    }
+    bot_nfds = 0;
+
+    TAILQ_FOREACH(mod, &modules_head, bot_modules)
+    {
+        irc_unregister_ctx(mod);
+    }
+
+    metrics_forget();
+
+    irc_set_output(host_worker_send);
+
+    list = strdup(hosted);
+    for ((p = strtok_r(list, ",", &last)); p && n < HOST_MODULES; (p = strtok_r(NULL, ",", &last)))
+    {
+        mod = calloc(sizeof(struct bot_module), 1);
+        mod->name = strdup(p);
+        TAILQ_INSERT_TAIL(&modules_head, mod, bot_modules);
+
+        bot_ctx(mod);
+        mod->log_level = log_level_parse(config_get("log_level"), log_level);
+        bot_ctx(NULL);
+
+        if (bot_module_load(mod) && mod->dl)
+        {
+            mods[n++] = mod;
+        }
+    }
+    free(list);
+
+    bot_ctx(NULL);
+
+    for (;;)
+    {
+        if (bot_poll(efd_in, -1, 1000))
+        {
+            host_worker_events();
+        }
+
+        if (getppid() != parent)
+        {
+            break;
+        }
+
+        now = time(NULL);
+        if (now > last_timer)
+        {
+            for (i = 0; i < n; i++)
+            {
+                if (mods[i]->dl && mods[i]->timer && !mods[i]->disabled)
+                {
+                    start = watchdog_begin(mods[i], "timer", *(void **)(&mods[i]->timer));
+                    bot_ctx(mods[i]);
+                    mods[i]->timer();
+                    bot_ctx(NULL);
+                    watchdog_end(start);
+                }
+            }
+
+            last_timer = now;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            if (mods[i]->dl && mods[i]->idle && !mods[i]->disabled)
+            {
+                start = watchdog_begin(mods[i], "idle", *(void **)(&mods[i]->idle));
+                bot_ctx(mods[i]);
+                mods[i]->idle();
+                bot_ctx(NULL);
+                watchdog_end(start);
+            }
+        }
+    }
+
+    for (i = n - 1; i >= 0; i--)
+    {
+        bot_module_free(mods[i]);
+    }
+
+    _exit(0);
+}
+
+/*
+ * Core side
+ */
+
+static void host_spawn()
+{
+    pid_t pid;
+
+    /* anything buffered would be written twice */
+    fflush(stdout);
+
+    if ((pid = fork()) < 0)
+    {
+        log_lprintf(LOG_ERROR, "fork: %s\n", strerror(errno));
+        worker_died = time(NULL);
+        return;
+    }
+
+    if (pid == 0)
+    {
+        host_worker();
+    }
+
+    worker = pid;
+    log_printf("Started worker %d for %s\n", (int)pid, hosted);
+}
+
+void host_irc(const char *prefix, const char *command, const char *params, const char *trail)
+{
+    unsigned int lp, lc, la, lt, len;
+    unsigned long next;
+    char *p;
+
+    lp = prefix ? strlen(prefix) + 1 : 0;
+    lc = strlen(command) + 1;
+    la = params ? strlen(params) + 1 : 0;
+    lt = trail ? strlen(trail) + 1 : 0;
+    len = 1 + lp + lc + la + lt;
+
+    if ((p = host_ring_reserve(ring_in, len, &next)) == NULL)
+    {
+        metrics_add(dropped, 1);
+        return;
+    }
+
+    *p++ = (prefix ? 1 : 0) | (params ? 2 : 0) | (trail ? 4 : 0);
+    if (prefix)
+    {
+        memcpy(p, prefix, lp);
+        p += lp;
+    }
+    memcpy(p, command, lc);
+    p += lc;
+    if (params)
+    {
+        memcpy(p, params, la);
+        p += la;
+    }
+    if (trail)
+    {
+        memcpy(p, trail, lt);
+    }
+
+    metrics_add(events, 1);
+
+    if (host_ring_commit(ring_in, next) && worker)
+    {
+        host_notify(efd_in);
+    }
+}
+
+void host_read(int sock)
+{
+    unsigned int len;
+    char *line;
+
+    host_drain(efd_out);
+
+    while ((line = host_ring_peek(ring_out, &len)))
+    {
+        irc_printf("%s", line);
+        host_ring_release(ring_out, len);
+    }
+
+    if (ring_out->dropped != out_dropped)
+    {
+        log_lprintf(LOG_WARN, "Worker dropped %lu lines, the ring was full\n", ring_out->dropped - out_dropped);
+        metrics_add(lines_dropped, ring_out->dropped - out_dropped);
+        out_dropped = ring_out->dropped;
+    }
+}
+
+int host_init(CTX ctx)
+{
+    const char *s;
+    unsigned long size = 1024 * 1024;
+
+    if (bot_require("irc", 1) < 1)
+    {
+        log_printf("irc module required\n");
+        return -1;
+    }
+
+    if ((s = config_get("modules")) == NULL)
+    {
+        log_lprintf(LOG_ERROR, "No modules to host\n");
+        return -1;
+    }
+    hosted = strdup(s);
+
+    if ((s = config_get("ring_size")))
+    {
+        size = strtoul(s, NULL, 10);
+    }
+
+    if ((s = config_get("restart_delay")))
+    {
+        restart_delay = atoi(s);
+    }
+
+    /* round up to a power of two */
+    while (size & (size - 1))
+    {
+        size += size & -size;
+    }
+
+    shm_len = 2 * (sizeof(struct host_ring) + size);
+    ring_in = mmap(NULL, shm_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (ring_in == MAP_FAILED)
+    {
+        log_lprintf(LOG_ERROR, "mmap: %s\n", strerror(errno));
+        ring_in = NULL;
+        return -1;
+    }
+
+    ring_out = (struct host_ring *)(RING_DATA(ring_in) + size);
+    ring_in->size = ring_out->size = size;
+
+    if ((efd_in = eventfd(0, EFD_NONBLOCK)) < 0 || (efd_out = eventfd(0, EFD_NONBLOCK)) < 0)
+    {
+        log_lprintf(LOG_ERROR, "eventfd: %s\n", strerror(errno));
+        return -1;
+    }
+
+    events = metrics_counter("corebot_host_events_total", NULL);
+    dropped = metrics_counter("corebot_host_dropped_total", NULL);
+    lines_dropped = metrics_counter("corebot_host_lines_dropped_total", NULL);
+    out_dropped = 0;
+    restarts = metrics_counter("corebot_host_restarts_total", NULL);
+
+    bot_register_fd(efd_out);
+    irc_register_cb(host_irc);
+
+    parent = getpid();
+    host_spawn();
+
+    return 1;
+}
+
+void host_timer()
+{
+    unsigned int len;
+    int status;
+
+    if (worker && waitpid(worker, &status, WNOHANG) == worker)
+    {
+        if (WIFSIGNALED(status))
+        {
+            log_lprintf(LOG_ERROR, "Worker %d killed by signal %d\n", (int)worker, WTERMSIG(status));
+        }
+        else
+        {
+            log_lprintf(LOG_ERROR, "Worker %d exited with %d\n", (int)worker, WEXITSTATUS(status));
+        }
+
+        worker = 0;
+        worker_died = time(NULL);
+
+        /* no consumer now, skip the event it was handling */
+        if (ring_in->busy && host_ring_peek(ring_in, &len))
+        {
+            log_lprintf(LOG_WARN, "Dropping the event the worker died on\n");
+            host_ring_release(ring_in, len);
+        }
+        ring_in->busy = 0;
+
+        /* deliver what it managed to send */
+        host_read(efd_out);
+    }
+
+    if (!worker && time(NULL) >= worker_died + restart_delay)
+    {
+        metrics_add(restarts, 1);
+        host_drain(efd_in);
+        host_spawn();
+
+        if (worker && ring_in->head != ring_in->tail)
+        {
+            host_notify(efd_in);
+        }
+    }
+}
+
+/* the worker wouldn't notice an upgrade, the new process starts its own */
+void host_save()
+{
+    if (worker)
+    {
+        kill(worker, SIGTERM);
+        waitpid(worker, NULL, 0);
+        worker = 0;
+    }
+}
+
+void host_free()
+{
+    irc_unregister_cb(host_irc);
+
+    if (worker)
+    {
+        kill(worker, SIGTERM);
+        waitpid(worker, NULL, 0);
+        worker = 0;
+    }
+
+    if (efd_out >= 0)
+    {
+        bot_unregister_fd(efd_out);
+        close(efd_out);
+    }
+
+    if (efd_in >= 0)
+    {
+        close(efd_in);
+    }
+
+    if (ring_in)
+    {
+        munmap(ring_in, shm_len);
+        ring_in = NULL;
+    }
+
+    free(hosted);
+    hosted = NULL;
+}
@@ -0,0 +1,795 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Event ingest.
+ *
+ * Listens on a local TCP or unix socket for messages to relay to IRC,
+ * either as HTTP POSTs or as newline delimited JSON on a connection that
+ * stays open. A message is a JSON object with "text" and optionally
+ * "target", or for HTTP any plain text body with one message per line,
+ * the target being the path ("/ops" is #ops) or the configured channel.
+ *
+ * Messages wait in a bounded queue that the timer drains at rate lines a
+ * second. A message identical to one still queued only bumps its count,
+ * and one already sent in the last dedup seconds is dropped, so a burst of
+ * the same alert turns into one line. Short messages to the same target
+ * share a line. A POST with more lines than the queue has room for gets a
+ * 429 with none of them taken, and JSON streams are not read until
+ * there's room again, which pushes back on the sender
+ * through TCP.
+ */
+
+#include "../bot.h"
+#include "irc.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+#include <time.h>
+
+#define INGEST_BUF      8192    /* the largest request or JSON line */
+#define INGEST_TEXT     400     /* what fits in a PRIVMSG */
+#define INGEST_RECENT   1024    /* sent messages remembered for dedup */
+
+#define MODE_UNKNOWN    0
+#define MODE_HTTP       1
+#define MODE_JSON       2
+
+struct ingest_msg
+{
+    char target[64];
+    char text[INGEST_TEXT];
+    unsigned int hash;
+    int count;                  /* identical ones merged into this */
+    unsigned long received;
+    TAILQ_ENTRY(ingest_msg) msgs;
+};
+
+struct ingest_client
+{
+    int sock;
+    int mode;
+    int paused;                 /* queue was full, not read until it isn't */
+    char buf[INGEST_BUF];
+    int off;
+    TAILQ_ENTRY(ingest_client) clients;
+};
+
+struct ingest_recent
+{
+    unsigned int hash;
+    time_t sent;
+};
+
+CTX ingest_ctx = NULL;
+
+static int listen_sock = -1;
+
+static TAILQ_HEAD(msg_head, ingest_msg) msg_h;
+static TAILQ_HEAD(client_head, ingest_client) client_h;
+static struct pool msg_pool;
+static struct pool client_pool;
+static struct ingest_recent recent[INGEST_RECENT];
+
+static char channel[64] = "";
+static int queue_max = 256;
+static int queued = 0;
+static int rate = 2;
+static int dedup = 60;
+static int max_clients = 16;
+static int clients = 0;
+
+static METRIC received_http;
+static METRIC received_json;
+static METRIC rejected_full;
+static METRIC rejected_bad;
+static METRIC deduplicated;
+static METRIC depth;
+static METRIC latency;
+
+static unsigned int ingest_hash(const char *target, const char *text)
+{
+    unsigned int h = 2166136261U;
+
+    for (; *target; target++)
+    {
+        h ^= (unsigned char)(*target >= 'A' && *target <= 'Z' ? *target + 32 : *target);
+        h *= 16777619U;
+    }
+
+    h ^= ' ';
+    h *= 16777619U;
+
+    for (; *text; text++)
+    {
+        h ^= (unsigned char)*text;
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+static struct ingest_recent *ingest_recent(unsigned int hash)
+{
+    return &recent[hash % INGEST_RECENT];
+}
+
+/* 1 if queued or merged, 0 if the queue is full, -1 if it's unwanted */
+static int ingest_queue(const char *target, const char *text)
+{
+    struct ingest_msg *m;
+    struct ingest_recent *r;
+    unsigned int hash;
+
+    if (*text == '\0' || (strcasecmp(target, channel) && !irc_joined(target)))
+    {
+        metrics_add(rejected_bad, 1);
+        return -1;
+    }
+
+    hash = ingest_hash(target, text);
+    r = ingest_recent(hash);
+
+    if (r->hash == hash && r->sent + dedup > time(NULL))
+    {
+        metrics_add(deduplicated, 1);
+        return 1;
+    }
+
+    TAILQ_FOREACH(m, &msg_h, msgs)
+    {
+        if (m->hash == hash && strcmp(m->text, text) == 0)
+        {
+            m->count++;
+            metrics_add(deduplicated, 1);
+            return 1;
+        }
+    }
+
+    if (queued >= queue_max)
+    {
+        metrics_add(rejected_full, 1);
+        return 0;
+    }
+
+    if ((m = pool_get(&msg_pool)) == NULL)
+    {
+        metrics_add(rejected_full, 1);
+        return 0;
+    }
+
+    snprintf(m->target, sizeof(m->target), "%s", target);
+    snprintf(m->text, sizeof(m->text), "%s", text);
+    m->hash = hash;
+    m->count = 1;
+    m->received = metrics_now();
+    TAILQ_INSERT_TAIL(&msg_h, m, msgs);
+    metrics_set(depth, ++queued);
+
+    return 1;
+}
+
+/* copies a JSON string at s to out, returns what follows it or NULL */
+static const char *ingest_json_string(const char *s, char *out, int size)
+{
+    int len = 0;
+    unsigned int c;
+
+    for (s++; *s && *s != '"'; s++)
+    {
+        c = (unsigned char)*s;
+
+        if (c == '\\')
+        {
+            switch (*++s)
+            {
+                case 'n': case 'r': case 't': c = ' '; break;
+                case 'b': case 'f': c = ' '; break;
+                case 'u':
+                    if (sscanf(s + 1, "%4x", &c) != 1)
+                    {
+                        return NULL;
+                    }
+                    s += 4;
+
+                    /* as UTF-8, surrogates become a replacement character */
+                    if (c >= 0xD800 && c < 0xE000)
+                    {
+                        c = 0xFFFD;
+                    }
+
+                    if (c >= 0x80 && (out == NULL || len + 3 >= size))
+                    {
+                        c = '?';
+                    }
+                    else if (c >= 0x80)
+                    {
+                        if (c < 0x800)
+                        {
+                            out[len++] = 0xC0 | c >> 6;
+                        }
+                        else
+                        {
+                            out[len++] = 0xE0 | c >> 12;
+                            out[len++] = 0x80 | (c >> 6 & 0x3F);
+                        }
+                        c = 0x80 | (c & 0x3F);
+                    }
+                    break;
+                case '\0': return NULL;
+                default: c = (unsigned char)*s; break;
+            }
+        }
+
+        /* nothing that would end or break the IRC line */
+        if (c == '\r' || c == '\n' || c == '\0')
+        {
+            c = ' ';
+        }
+
+        if (out && len < size - 1)
+        {
+            out[len++] = c;
+        }
+    }
+
+    if (out)
+    {
+        out[len] = '\0';
+    }
+
+    return *s == '"' ? s + 1 : NULL;
+}
+
+/* finds the string value of key in a flat JSON object, 1 if it's there */
+static int ingest_json(const char *s, const char *key, char *out, int size)
+{
+    char name[32];
+    int depth = 0;
+
+    s += strspn(s, " \t");
+
+    if (*s != '{')
+    {
+        return 0;
+    }
+
+    for (s++; *s; s++)
+    {
+        if (*s == '"')
+        {
+            /* a key is a string directly in the object followed by a colon */
+            if (depth == 0 && (s = ingest_json_string(s, name, sizeof(name))))
+            {
+                s += strspn(s, " \t");
+
+                if (*s != ':')
+                {
+                    return 0;
+                }
+
+                s++;
+                s += strspn(s, " \t");
+
+                if (*s == '"')
+                {
+                    if (!(s = ingest_json_string(s, strcmp(name, key) == 0 ? out : NULL, size)))
+                    {
+                        return 0;
+                    }
+
+                    if (strcmp(name, key) == 0)
+                    {
+                        return 1;
+                    }
+                }
+
+                s--;
+            }
+            else if (depth > 0 && (s = ingest_json_string(s, NULL, 0)))
+            {
+                s--;
+            }
+
+            if (s == NULL)
+            {
+                return 0;
+            }
+        }
+        else if (*s == '{' || *s == '[')
+        {
+            depth++;
+        }
+        else if (*s == '}' || *s == ']')
+        {
+            if (--depth < 0)
+            {
+                return 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int ingest_object(const char *line)
+{
+    char target[64], text[INGEST_TEXT];
+
+    if (!ingest_json(line, "text", text, sizeof(text)))
+    {
+        metrics_add(rejected_bad, 1);
+        return -1;
+    }
+
+    if (!ingest_json(line, "target", target, sizeof(target)))
+    {
+        snprintf(target, sizeof(target), "%s", channel);
+    }
+
+    return ingest_queue(target, text);
+}
+
+static void ingest_close(struct ingest_client *c)
+{
+    if (!c->paused)
+    {
+        bot_unregister_fd(c->sock);
+    }
+
+    close(c->sock);
+    TAILQ_REMOVE(&client_h, c, clients);
+    pool_put(&client_pool, c);
+    clients--;
+}
+
+static void ingest_respond(struct ingest_client *c, const char *status, const char *body)
+{
+    char buf[256];
+
+    snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\nContent-Type: text/plain\r\nContent-Length: %d\r\nConnection: close\r\n%s\r\n%s",
+        status, (int)strlen(body), strncmp(status, "429", 3) == 0 ? "Retry-After: 1\r\n" : "", body);
+
+    /* small enough for any socket buffer, a client that can't take it loses it */
+    send(c->sock, buf, strlen(buf), 0);
+    ingest_close(c);
+}
+
+/* the whole request is in, or 0 if it isn't yet */
+static int ingest_http(struct ingest_client *c)
+{
+    char target[64], path[64];
+    char *end, *p, *line, *last = NULL;
+    long length = -1;
+    int n = 0, lines = 0;
+
+    c->buf[c->off] = '\0';
+
+    if ((end = strstr(c->buf, "\r\n\r\n")) == NULL)
+    {
+        return 0;
+    }
+
+    *end = '\0';
+    end += 4;
+
+    if (strncmp(c->buf, "POST ", 5) || sscanf(c->buf + 5, "%63s", path) != 1)
+    {
+        ingest_respond(c, "405 Method Not Allowed", "POST only\n");
+        return 1;
+    }
+
+    for (p = strstr(c->buf, "\r\n"); p; p = strstr(p + 2, "\r\n"))
+    {
+        if (strncasecmp(p + 2, "Content-Length:", 15) == 0)
+        {
+            length = atol(p + 17);
+        }
+    }
+
+    if (length < 0)
+    {
+        ingest_respond(c, "411 Length Required", "Content-Length required\n");
+        return 1;
+    }
+
+    if (end + length > c->buf + INGEST_BUF - 1)
+    {
+        ingest_respond(c, "413 Payload Too Large", "too large\n");
+        return 1;
+    }
+
+    if (end + length > c->buf + c->off)
+    {
+        /* there's more coming, restore the header end for the next look */
+        memcpy(end - 4, "\r\n\r\n", 4);
+        return 0;
+    }
+
+    end[length] = '\0';
+    metrics_add(received_http, 1);
+
+    if (path[1])
+    {
+        snprintf(target, sizeof(target), "#%s", path + 1);
+    }
+    else
+    {
+        snprintf(target, sizeof(target), "%s", channel);
+    }
+
+    /* all or nothing, a retry of the whole request mustn't repeat lines */
+    for (p = end; *p; p += strspn(p, "\r\n"))
+    {
+        lines += !strchr("\r\n", *p);
+        p += strcspn(p, "\r\n");
+    }
+
+    if (queued + lines > queue_max)
+    {
+        metrics_add(rejected_full, lines);
+        ingest_respond(c, "429 Too Many Requests", "queue full\n");
+        return 1;
+    }
+
+    for ((line = strtok_r(end, "\r\n", &last)); line; (line = strtok_r(NULL, "\r\n", &last)))
+    {
+        n += (*line == '{' ? ingest_object(line) : ingest_queue(target, line)) > 0;
+    }
+
+    if (n == 0)
+    {
+        ingest_respond(c, "400 Bad Request", "nothing to send\n");
+    }
+    else
+    {
+        ingest_respond(c, "202 Accepted", "queued\n");
+    }
+
+    return 1;
+}
+
+/* takes complete lines, stops at the first the queue has no room for, 0 if it closed the client */
+static int ingest_lines(struct ingest_client *c)
+{
+    char *line = c->buf, *end;
+
+    while ((end = memchr(line, '\n', c->off - (line - c->buf))))
+    {
+        *end = '\0';
+
+        if (ingest_object(line) == 0)
+        {
+            *end = '\n';
+            c->paused = 1;
+            bot_unregister_fd(c->sock);
+            break;
+        }
+
+        metrics_add(received_json, 1);
+
+        line = end + 1;
+    }
+
+    c->off -= line - c->buf;
+    memmove(c->buf, line, c->off);
+
+    /* a held back client's full buffer is complete lines, the timer goes on with them */
+    if (!c->paused && c->off >= INGEST_BUF - 1)
+    {
+        log_lprintf(LOG_WARN, "Dropped a client sending lines longer than %d\n", INGEST_BUF);
+        ingest_close(c);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void ingest_accept()
+{
+    struct ingest_client *c;
+    int sock;
+
+    if ((sock = accept(listen_sock, NULL, NULL)) < 0)
+    {
+        return;
+    }
+
+    if (clients >= max_clients)
+    {
+        close(sock);
+        return;
+    }
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+    if ((c = pool_get(&client_pool)) == NULL)
+    {
+        close(sock);
+        return;
+    }
+
+    c->sock = sock;
+    c->mode = MODE_UNKNOWN;
+    c->paused = 0;
+    c->off = 0;
+    TAILQ_INSERT_TAIL(&client_h, c, clients);
+    clients++;
+
+    bot_register_fd(sock);
+}
+
+void ingest_read(int sock)
+{
+    struct ingest_client *c;
+    int n;
+
+    if (sock == listen_sock)
+    {
+        ingest_accept();
+        return;
+    }
+
+    TAILQ_FOREACH(c, &client_h, clients)
+    {
+        if (c->sock == sock)
+        {
+            break;
+        }
+    }
+
+    if (c == NULL)
+    {
+        return;
+    }
+
+    if ((n = recv(sock, c->buf + c->off, INGEST_BUF - 1 - c->off, 0)) <= 0)
+    {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        {
+            ingest_close(c);
+        }
+        return;
+    }
+
+    c->off += n;
+
+    /* JSON streams start with an object, anything else is HTTP */
+    if (c->mode == MODE_UNKNOWN)
+    {
+        c->mode = c->buf[strspn(c->buf, " \r\n")] == '{' ? MODE_JSON : MODE_HTTP;
+    }
+
+    if (c->mode == MODE_JSON)
+    {
+        ingest_lines(c);
+    }
+    else if (!ingest_http(c) && c->off >= INGEST_BUF - 1)
+    {
+        ingest_respond(c, "413 Payload Too Large", "too large\n");
+    }
+}
+
+static void ingest_restore(const char *saved)
+{
+    char target[64];
+    const char *end;
+    int count, n, len;
+    struct ingest_msg *m;
+
+    for (; *saved; saved = *end ? end + 1 : end)
+    {
+        end = saved + strcspn(saved, "\n");
+
+        if (sscanf(saved, "%63s %d %n", target, &count, &n) == 2 && n < end - saved && queued < queue_max &&
+                (m = pool_get(&msg_pool)))
+        {
+            snprintf(m->target, sizeof(m->target), "%s", target);
+            len = end - saved - n < INGEST_TEXT ? end - saved - n : INGEST_TEXT - 1;
+            memcpy(m->text, saved + n, len);
+            m->text[len] = '\0';
+            m->hash = ingest_hash(m->target, m->text);
+            m->count = count;
+            m->received = metrics_now();
+            TAILQ_INSERT_TAIL(&msg_h, m, msgs);
+            metrics_set(depth, ++queued);
+        }
+    }
+}
+
+int ingest_init(CTX ctx)
+{
+    const char *s;
+
+    ingest_ctx = ctx;
+
+    TAILQ_INIT(&msg_h);
+    TAILQ_INIT(&client_h);
+    pool_init(&msg_pool, sizeof(struct ingest_msg));
+    pool_init(&client_pool, sizeof(struct ingest_client));
+
+    if (bot_require("irc", 1) < 1)
+    {
+        log_printf("irc module required\n");
+        return -1;
+    }
+
+    if ((s = config_get("channel")))
+    {
+        snprintf(channel, sizeof(channel), "%s", s);
+    }
+
+    if ((s = config_get("queue")) && atoi(s) > 0)
+    {
+        queue_max = atoi(s);
+    }
+
+    if ((s = config_get("rate")) && atoi(s) > 0)
+    {
+        rate = atoi(s);
+    }
+
+    if ((s = config_get("dedup")))
+    {
+        dedup = atoi(s);
+    }
+
+    if ((s = config_get("max_clients")) && atoi(s) > 0)
+    {
+        max_clients = atoi(s);
+    }
+
+    received_http = metrics_counter("corebot_ingest_received_total", "format=\"http\"");
+    received_json = metrics_counter("corebot_ingest_received_total", "format=\"json\"");
+    rejected_full = metrics_counter("corebot_ingest_rejected_total", "reason=\"full\"");
+    rejected_bad = metrics_counter("corebot_ingest_rejected_total", "reason=\"invalid\"");
+    deduplicated = metrics_counter("corebot_ingest_deduplicated_total", NULL);
+    depth = metrics_gauge("corebot_ingest_queue_depth", NULL);
+    latency = metrics_histogram("corebot_ingest_latency_seconds", NULL);
+
+    if ((listen_sock = listen_open("listen")) < 0)
+    {
+        return -1;
+    }
+
+    /* what was still queued, a "target count text" line each */
+    if ((s = handoff_get("queue", NULL)))
+    {
+        ingest_restore(s);
+    }
+
+    return 1;
+}
+
+/* sends up to rate lines, short messages to one target sharing a line */
+void ingest_timer()
+{
+    char line[INGEST_TEXT + 16];
+    struct ingest_msg *m, *next, *first;
+    struct ingest_client *c, *cn;
+    unsigned long now;
+    int lines, len;
+
+    for (lines = 0; lines < rate && (first = TAILQ_FIRST(&msg_h)); lines++)
+    {
+        len = 0;
+        now = metrics_now();
+
+        for (m = first; m; m = next)
+        {
+            next = TAILQ_NEXT(m, msgs);
+
+            if (strcasecmp(m->target, first->target))
+            {
+                continue;
+            }
+
+            if (len > 0 && len + strlen(m->text) + 16 >= INGEST_TEXT)
+            {
+                break;
+            }
+
+            len += snprintf(line + len, sizeof(line) - len, m->count > 1 ? "%s%s (x%d)" : "%s%s", len ? " | " : "", m->text, m->count);
+
+            ingest_recent(m->hash)->hash = m->hash;
+            ingest_recent(m->hash)->sent = time(NULL);
+            metrics_observe(latency, now - m->received);
+
+            if (m != first)
+            {
+                TAILQ_REMOVE(&msg_h, m, msgs);
+                pool_put(&msg_pool, m);
+                queued--;
+            }
+        }
+
+        irc_spool("PRIVMSG %s :%s\r\n", first->target, line);
+
+        TAILQ_REMOVE(&msg_h, first, msgs);
+        pool_put(&msg_pool, first);
+        queued--;
+    }
+
+    metrics_set(depth, queued);
+
+    /* room again for the streams that were held back */
+    for (c = TAILQ_FIRST(&client_h); c && queued < queue_max; c = cn)
+    {
+        cn = TAILQ_NEXT(c, clients);
+
+        /* what it has buffered first, it's only read again if all of that fits */
+        if (c->paused)
+        {
+            c->paused = 0;
+
+            if (ingest_lines(c) && !c->paused)
+            {
+                bot_register_fd(c->sock);
+            }
+        }
+    }
+}
+
+void ingest_save()
+{
+    struct ingest_msg *m;
+    char *buf;
+    int len = 0;
+
+    handoff_fd("listen", listen_sock);
+
+    buf = bot_malloc(queued * (sizeof(struct ingest_msg) + 16) + 1);
+    buf[0] = '\0';
+
+    TAILQ_FOREACH(m, &msg_h, msgs)
+    {
+        len += sprintf(buf + len, "%s %d %s\n", m->target, m->count, m->text);
+    }
+
+    handoff_set("queue", buf, len);
+    bot_free(buf);
+}
+
+void ingest_free()
+{
+    struct ingest_client *c;
+
+    while ( (c = TAILQ_FIRST(&client_h)) )
+    {
+        ingest_close(c);
+    }
+
+    if (listen_sock >= 0)
+    {
+        listen_close(listen_sock);
+        listen_sock = -1;
+    }
+
+    if (queued)
+    {
+        log_lprintf(LOG_WARN, "Dropped %d queued messages\n", queued);
+    }
+
+    TAILQ_INIT(&msg_h);
+    pool_free(&msg_pool);
+    pool_free(&client_pool);
+}
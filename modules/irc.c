@@ -18,13 +18,186 @@
 #include "irc.h"
 #include "server.h"
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <string.h>
-#include <regex.h>
+#include <strings.h>
+#include <unistd.h>
+
+/*
+ * PRIVMSG, NOTICE and MODE lines from irc_printf() are queued until the
+ * core goes idle, anything else flushes the queue and goes out as is.
+ * A flush sends identical PRIVMSG/NOTICE payloads as one line with up to
+ * TARGMAX comma separated targets and merges MODE lines that follow each
+ * other on the same target up to MODES parameters. A line never moves
+ * ahead of an earlier one to any of its targets.
+ */
+#define IRC_QUEUE       128
+#define IRC_LINE        512
+/* a line transcoded to UTF-8 can grow to three times its length */
+#define IRC_PARSED      (3 * IRC_LINE)
+
+#define IRC_PRIVMSG     1
+#define IRC_NOTICE      2
+#define IRC_MODE        3
+
+struct irc_queued
+{
+    int type;                   /* 0 once sent */
+    char target[128];
+    char payload[IRC_LINE];     /* message text or MODE modes and args */
+};
 
 CTX irc_ctx = NULL;
 
-static regex_t preg;
+static IRC_OUT irc_out = NULL;
+static METRIC sent_lines;
+static METRIC sent_bytes;
+static METRIC coalesced;
+
+static struct irc_queued queue[IRC_QUEUE];
+static int queued = 0;
+
+/* from ISUPPORT, 0 is no limit */
+static int targmax_privmsg = 1;
+static int targmax_notice = 1;
+static int targmax_join = 0;
+static int modes_max = 3;
+static char prefixes[16] = "@+";        /* channel status from PREFIX */
+
+/*
+ * Inbound lines that are not valid UTF-8 are taken to be in fallback and
+ * transcoded before anything sees them, ENC_INVALID passes them on as is.
+ * Output goes out in encoding.
+ */
+static int fallback = ENC_CP1252;
+static int encoding = ENC_UTF8;
+static int line_encoding = ENC_ASCII;
+static METRIC transcoded;
+static METRIC invalid;
+
+/*
+ * Lines from irc_spool() are appended to the spool, a file mapped into
+ * memory, and only taken off it once written whole to the server. They go
+ * out in order, at most spool_rate a second after a burst of spool_burst,
+ * once we're registered on the current connection and not still joining
+ * the channel a line is for, so what couldn't be sent before a disconnect
+ * or a restart goes out after it. Appends are synced to disk at most
+ * every spool_sync ms, an emptied spool starts over at the front. Only
+ * the header and the pages written since the last sync are synced, by a
+ * thread of their own so the loop doesn't wait on the disk.
+ */
+#define IRC_SPOOL_MAGIC     "CBSP"
+#define IRC_SPOOL_VERSION   1
+
+struct irc_spool_hdr
+{
+    char magic[4];
+    unsigned int version;
+    unsigned int head;          /* first line not yet written */
+    unsigned int tail;          /* where the next one goes */
+};
+
+static char *spool = NULL;              /* header, then length and line for each */
+static struct irc_spool_hdr *spool_hdr;
+static int spool_fd = -1;
+static size_t spool_size = 1048576;
+static int spool_lines = 0;
+static int spool_dirty = 0;             /* the header changed */
+static size_t spool_lo = 0;             /* lines written since the last sync */
+static size_t spool_hi = 0;
+static unsigned long spool_sync = 100;  /* ms */
+static unsigned long spool_synced = 0;
+static double spool_rate = 2;
+static double spool_burst = 10;
+static double spool_tokens = 10;
+static unsigned long spool_refill = 0;
+static METRIC spool_gauge;
+static METRIC spooled;
+static METRIC spool_dropped;
+
+/* spool sync thread, it gets the dirty range to sync under spool_lock */
+static pthread_t spool_thread;
+static pthread_mutex_t spool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spool_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long spool_req = 0;
+static unsigned long spool_done = 0;
+static size_t spool_want_lo = 0;
+static size_t spool_want_hi = 0;
+static int spool_quit = 0;
+static int spool_running = 0;
+static int spool_err = 0;               /* errno of a failed sync, for the main thread to log */
+
+/*
+ * Who we are and where, kept over an upgrade.
+ *
+ * Wanted channels are joined once registered, packed into as few JOIN
+ * lines as the line length and TARGMAX allow. At most join_window of them
+ * wait for an answer (our JOIN or an error numeric) and a JOIN line goes
+ * out at most every join_interval ms. After a reconnect every channel we
+ * were on is wanted again, PART and KICK forget it.
+ */
+#define IRC_WANTED      0
+#define IRC_JOINING     1
+#define IRC_JOINED      2
+#define IRC_FAILED      3
+
+#define IRC_CHANNELS    1024            /* hash buckets */
+
+struct irc_channel
+{
+    char name[200];
+    char key[64];
+    int state;
+    int error;                          /* numeric of a failed join, 0 if unanswered */
+    unsigned long since;                /* in this state (ns) */
+    struct irc_channel *next;           /* in the bucket */
+    TAILQ_ENTRY(irc_channel) channels;
+    TAILQ_ENTRY(irc_channel) joins;     /* on the queue of its state unless joined */
+};
+
+static char irc_me[128];
+static TAILQ_HEAD(channel_head, irc_channel) channel_h;
+static TAILQ_HEAD(join_head, irc_channel) wanted_h, joining_h, failed_h;
+static struct irc_channel *channel_hash[IRC_CHANNELS];
+static struct pool channel_pool;
+
+static int registered = 0;
+static int registered_on = 0;           /* server_connection() we registered on */
+static int joining = 0;
+static unsigned long last_join = 0;
+static int join_window = 50;
+static unsigned long join_interval = 1000;
+static unsigned long join_timeout = 60;
+static unsigned long join_retry = 0;
+static METRIC joins_ok;
+static METRIC joins_failed;
+
+/* numerics that answer a JOIN with no */
+static const char *join_errors = "403 405 437 471 473 474 475 476 477 489";
+
+/*
+ * NAMES and WHO replies come in bursts of thousands of lines after a bulk
+ * join, they skip the generic parse and callbacks and go to the member
+ * callbacks a line at a time.
+ */
+struct member_entry
+{
+    IRC_MEMBERS_CB cb;
+    CTX ctx;
+    METRIC time;
+    TAILQ_ENTRY(member_entry) member_entries;
+};
+
+static TAILQ_HEAD(member_head, member_entry) member_h;
+static struct pool member_pool;
+static METRIC burst_lines;
 
 static TAILQ_HEAD(cb_head, cb_entry) cb_h;
 
@@ -32,9 +205,12 @@ struct cb_entry
 {
     IRC_CB cb;
     CTX ctx;
+    METRIC time;
     TAILQ_ENTRY(cb_entry) cb_entries;
 };
 
+static struct pool cb_pool;
+
 void irc_register_cb(IRC_CB cb)
 {
     struct cb_entry *e;
@@ -48,9 +224,15 @@ void irc_register_cb(IRC_CB cb)
         }
     }
 
-    e = malloc(sizeof(struct cb_entry));
+    if ((e = pool_get(&cb_pool)) == NULL)
+    {
+        log_lprintf(LOG_ERROR, "Out of memory registering a callback\n");
+        return;
+    }
+
     e->ctx = bot_get_ctx();
     e->cb = cb;
+    e->time = bot_cb_metric("irc");
 
     TAILQ_INSERT_TAIL(&cb_h, e, cb_entries);
 }
@@ -63,140 +245,1726 @@ void irc_unregister_cb(IRC_CB cb)
         if (e->cb == cb)
         {
             TAILQ_REMOVE(&cb_h, e, cb_entries);
-            free(e);
+            pool_put(&cb_pool, e);
             break;
         }
     }
 }
 
-void irc_memcpy(char *dst, const char *src, int len)
+void irc_register_members(IRC_MEMBERS_CB cb)
 {
-    memcpy(dst, src, len);
-    *(dst + len) = '\0';
+    struct member_entry *e;
+
+    TAILQ_FOREACH(e, &member_h, member_entries)
+    {
+        if (e->cb == cb)
+        {
+            return;
+        }
+    }
+
+    if ((e = pool_get(&member_pool)) == NULL)
+    {
+        log_lprintf(LOG_ERROR, "Out of memory registering a callback\n");
+        return;
+    }
+
+    e->ctx = bot_get_ctx();
+    e->cb = cb;
+    e->time = bot_cb_metric("irc_members");
+
+    TAILQ_INSERT_TAIL(&member_h, e, member_entries);
 }
 
-void irc_process(const char *line)
+void irc_unregister_members(IRC_MEMBERS_CB cb)
 {
-    struct cb_entry *e;
-    regmatch_t pmatch[9];
+    struct member_entry *e;
+    TAILQ_FOREACH(e, &member_h, member_entries)
+    {
+        if (e->cb == cb)
+        {
+            TAILQ_REMOVE(&member_h, e, member_entries);
+            pool_put(&member_pool, e);
+            break;
+        }
+    }
+}
 
-    char prefix[512];
-    char command[512];
-    char params[512];
-    char trail[512];
+/* drops every callback registered by a module */
+void irc_unregister_ctx(CTX ctx)
+{
+    struct cb_entry *e, *next;
+    struct member_entry *m, *mnext;
 
-    char *pprefix = NULL;
-    char *pparams = NULL;
-    char *ptrail = NULL;
+    for (e = TAILQ_FIRST(&cb_h); e; e = next)
+    {
+        next = TAILQ_NEXT(e, cb_entries);
+
+        if (e->ctx == ctx)
+        {
+            TAILQ_REMOVE(&cb_h, e, cb_entries);
+            pool_put(&cb_pool, e);
+        }
+    }
 
-    if (regexec(&preg, line, 9, pmatch, 0) != REG_NOMATCH)
+    for (m = TAILQ_FIRST(&member_h); m; m = mnext)
     {
-        irc_memcpy(prefix, line + pmatch[2].rm_so, pmatch[2].rm_eo - pmatch[2].rm_so);
-        irc_memcpy(command, line + pmatch[3].rm_so, pmatch[3].rm_eo - pmatch[3].rm_so);
-        irc_memcpy(params, line + pmatch[5].rm_so, pmatch[5].rm_eo - pmatch[5].rm_so);
-        irc_memcpy(trail, line + pmatch[8].rm_so, pmatch[8].rm_eo - pmatch[8].rm_so);
+        mnext = TAILQ_NEXT(m, member_entries);
 
-        if (strlen(prefix) > 0)
+        if (m->ctx == ctx)
         {
-            pprefix = prefix;
+            TAILQ_REMOVE(&member_h, m, member_entries);
+            pool_put(&member_pool, m);
         }
+    }
+}
 
-        if (strlen(params) > 0)
+/* lines from irc_printf go to out instead of the server, NULL restores */
+void irc_set_output(IRC_OUT out)
+{
+    irc_out = out;
+
+    /* the spool is the core's, irc_spool() sends straight away here */
+    if (out && spool)
+    {
+        /* its sync thread didn't come along with the fork */
+        spool_running = 0;
+        munmap(spool, spool_size);
+        close(spool_fd);
+        spool = NULL;
+        spool_fd = -1;
+    }
+}
+
+void irc_dispatch(const char *prefix, const char *command, const char *params, const char *trail)
+{
+    struct cb_entry *e;
+    unsigned long start, end;
+
+    TAILQ_FOREACH(e, &cb_h, cb_entries)
+    {
+        if (bot_disabled(e->ctx) || bot_shed(e->ctx))
         {
-            pparams = params;
+            continue;
         }
 
-        if (strlen(trail) > 0)
+        start = watchdog_begin(e->ctx, "irc callback", *(void **)(&e->cb));
+        bot_ctx(e->ctx);
+        e->cb(prefix, command, params, trail);
+        bot_ctx(irc_ctx);
+        end = watchdog_end(start);
+        metrics_observe(e->time, end - start);
+        trace_span("irc", e->ctx ? e->ctx->name : "core", start, end);
+    }
+}
+
+void irc_memcpy(char *dst, const char *src, int len)
+{
+    memcpy(dst, src, len);
+    *(dst + len) = '\0';
+}
+
+const char *irc_nick()
+{
+    return irc_me;
+}
+
+int irc_encoding()
+{
+    return line_encoding;
+}
+
+/* 1 if written whole (or handed on to the core) */
+static int irc_send(const char *buf)
+{
+    char out[IRC_LINE];
+    int ret = 1;
+
+    if (log_enabled(LOG_TRACE))
+    {
+        log_lprintf(LOG_TRACE, "<- %s", buf);
+    }
+    if (irc_out)
+    {
+        /* the core encodes it */
+        irc_out(buf);
+    }
+    else if (encoding != ENC_UTF8 && utf8_check(buf, strlen(buf)) == ENC_UTF8)
+    {
+        utf8_to(encoding, buf, strlen(buf), out);
+        ret = server_send(out);
+    }
+    else
+    {
+        ret = server_send(buf);
+    }
+    metrics_add(sent_lines, 1);
+    metrics_add(sent_bytes, strlen(buf));
+
+    return ret;
+}
+
+static unsigned int irc_channel_hash(const char *name)
+{
+    unsigned int h = 2166136261U;
+
+    for (; *name; name++)
+    {
+        h = (h ^ (unsigned char)tolower((unsigned char)*name)) * 16777619U;
+    }
+
+    return h & (IRC_CHANNELS - 1);
+}
+
+static struct irc_channel *irc_channel(const char *name)
+{
+    struct irc_channel *c;
+
+    for (c = channel_hash[irc_channel_hash(name)]; c; c = c->next)
+    {
+        if (strcasecmp(c->name, name) == 0)
         {
-            ptrail = trail;
+            return c;
         }
+    }
 
-        /* log some meaningful messages */
-        if (strcmp(command, "001") == 0 || strcmp(command, "002") == 0 || strcmp(command, "003") == 0 || strcmp(command, "020") == 0 ||
-                (strcmp(command, "NOTICE") == 0 && pparams && (strcmp(pparams, "*") == 0 || strcmp(pparams, "AUTH") == 0)))
+    return NULL;
+}
+
+int irc_joined(const char *channel)
+{
+    struct irc_channel *c = irc_channel(channel);
+
+    return c && c->state == IRC_JOINED;
+}
+
+void irc_each_joined(IRC_CHANNEL_CB cb)
+{
+    struct irc_channel *c;
+
+    TAILQ_FOREACH(c, &channel_h, channels)
+    {
+        if (c->state == IRC_JOINED)
         {
-            log_printf("%s\n", trail);
+            cb(c->name);
         }
+    }
+}
 
-        if (strcmp(command, "MODE") == 0 && pprefix && pparams && strcmp(pprefix, pparams) == 0)
+/* moves a channel to the queue of its new state */
+static void irc_channel_state(struct irc_channel *c, int state)
+{
+    if (c->state == IRC_WANTED)
+    {
+        TAILQ_REMOVE(&wanted_h, c, joins);
+    }
+    else if (c->state == IRC_JOINING)
+    {
+        TAILQ_REMOVE(&joining_h, c, joins);
+        joining--;
+    }
+    else if (c->state == IRC_FAILED)
+    {
+        TAILQ_REMOVE(&failed_h, c, joins);
+    }
+
+    if (state == IRC_WANTED)
+    {
+        TAILQ_INSERT_TAIL(&wanted_h, c, joins);
+    }
+    else if (state == IRC_JOINING)
+    {
+        TAILQ_INSERT_TAIL(&joining_h, c, joins);
+        joining++;
+    }
+    else if (state == IRC_FAILED)
+    {
+        TAILQ_INSERT_TAIL(&failed_h, c, joins);
+    }
+
+    c->state = state;
+    c->since = metrics_now();
+}
+
+static struct irc_channel *irc_channel_add(const char *name, const char *key, int state)
+{
+    struct irc_channel *c = irc_channel(name);
+    unsigned int h;
+
+    if (c == NULL)
+    {
+        if ((c = pool_get(&channel_pool)) == NULL)
         {
-            log_printf("User mode set to %s\n", trail);
+            return NULL;
         }
 
-        if (strcmp(command, "ERROR") == 0)
+        snprintf(c->name, sizeof(c->name), "%s", name);
+        c->key[0] = '\0';
+        c->error = 0;
+        /* on no queue yet */
+        c->state = IRC_JOINED;
+
+        h = irc_channel_hash(c->name);
+        c->next = channel_hash[h];
+        channel_hash[h] = c;
+        TAILQ_INSERT_TAIL(&channel_h, c, channels);
+    }
+
+    if (key && *key)
+    {
+        snprintf(c->key, sizeof(c->key), "%s", key);
+    }
+
+    irc_channel_state(c, state);
+
+    return c;
+}
+
+static void irc_channel_remove(const char *name)
+{
+    struct irc_channel *c = irc_channel(name), **p;
+
+    if (c)
+    {
+        irc_channel_state(c, IRC_JOINED);
+
+        for (p = &channel_hash[irc_channel_hash(c->name)]; *p != c; p = &(*p)->next);
+        *p = c->next;
+
+        TAILQ_REMOVE(&channel_h, c, channels);
+        pool_put(&channel_pool, c);
+    }
+}
+
+/* the JOIN line for as many wanted channels as fit, keyed ones first to line up with their keys */
+static void irc_join_line()
+{
+    struct irc_channel *c;
+    struct irc_channel *keyed[IRC_LINE / 2], *plain[IRC_LINE / 2];
+    char buf[IRC_LINE];
+    char *p = buf;
+    int nkeyed = 0, nplain = 0, max, len, i;
+
+    max = join_window - joining;
+    if (targmax_join > 0 && targmax_join < max)
+    {
+        max = targmax_join;
+    }
+
+    /* "JOIN " and "\r\n", a comma before every channel but the first and a
+     * space or comma before every key */
+    len = 7;
+    TAILQ_FOREACH(c, &wanted_h, joins)
+    {
+        i = strlen(c->name) + (nkeyed + nplain > 0) + (c->key[0] ? strlen(c->key) + 1 : 0);
+
+        if (nkeyed + nplain == max || len + i >= IRC_LINE)
         {
-            log_printf("Error: %s\n", ptrail);
+            break;
         }
 
-        #ifdef IRC_DEBUG
-        log_printf("-> %s %s %s :%s\n", pprefix, command, pparams, ptrail);
-        #endif
+        len += i;
 
-        TAILQ_FOREACH(e, &cb_h, cb_entries)
+        if (c->key[0])
         {
-            bot_ctx(e->ctx);
-            e->cb(pprefix, command, pparams, ptrail);
-            bot_ctx(irc_ctx);
+            keyed[nkeyed++] = c;
         }
+        else
+        {
+            plain[nplain++] = c;
+        }
+    }
+
+    p += sprintf(p, "JOIN ");
+    for (i = 0; i < nkeyed; i++)
+    {
+        p += sprintf(p, "%s%s", i ? "," : "", keyed[i]->name);
+    }
+    for (i = 0; i < nplain; i++)
+    {
+        p += sprintf(p, "%s%s", nkeyed + i ? "," : "", plain[i]->name);
+    }
+    for (i = 0; i < nkeyed; i++)
+    {
+        p += sprintf(p, "%s%s", i ? "," : " ", keyed[i]->key);
+        irc_channel_state(keyed[i], IRC_JOINING);
+    }
+    for (i = 0; i < nplain; i++)
+    {
+        irc_channel_state(plain[i], IRC_JOINING);
     }
+    strcpy(p, "\r\n");
+
+    irc_flush();
+    irc_send(buf);
 }
 
-int irc_printf(const char *fmt, ...)
+/* sends the next JOIN line if pacing allows, fails joins left unanswered and retries failed ones */
+static void irc_join_next()
 {
-    va_list args;
-    int ret;
-    char buf[512];
-    CTX caller_ctx = bot_get_ctx();
+    struct irc_channel *c;
+    unsigned long now = metrics_now();
 
-    va_start(args, fmt);
-    ret = vsnprintf(buf, 512, fmt, args);
-    va_end(args);
-
-    bot_ctx(irc_ctx);
+    /* a hosted module's joins are made by the core */
+    if (irc_out || !registered)
+    {
+        return;
+    }
 
-    #ifdef IRC_DEBUG
-    log_printf("<- %s", buf);
-    #endif
-    server_send(buf);
+    while ((c = TAILQ_FIRST(&joining_h)) && now - c->since > join_timeout * 1000000000UL)
+    {
+        log_lprintf(LOG_WARN, "No answer to joining %s\n", c->name);
+        c->error = 0;
+        irc_channel_state(c, IRC_FAILED);
+        metrics_add(joins_failed, 1);
+    }
 
-    bot_ctx(caller_ctx);
+    while (join_retry && (c = TAILQ_FIRST(&failed_h)) && now - c->since > join_retry * 1000000000UL)
+    {
+        irc_channel_state(c, IRC_WANTED);
+    }
 
-    return ret;
+    /* waits for half the window to be free instead of sending a line for every answer */
+    if (!TAILQ_EMPTY(&wanted_h) && joining <= join_window / 2 && now - last_join >= join_interval * 1000000UL)
+    {
+        irc_join_line();
+        last_join = now;
+    }
 }
 
-int irc_init(CTX ctx)
+/* a channel to be on, hosted modules pass it on to the core */
+void irc_join(const char *channel, const char *key)
 {
-    irc_ctx = ctx;
+    struct irc_channel *c;
 
-    TAILQ_INIT(&cb_h);
-
-    if (bot_require("server", 1) < 1)
+    if (channel[0] == '\0' || channel[strcspn(channel, " ,:\r\n")] || strlen(channel) >= sizeof(c->name) ||
+            (key && (key[strcspn(key, " ,\r\n")] || strlen(key) >= sizeof(c->key))))
     {
-        printf("error: server module required\n");
-        return -1;
+        log_lprintf(LOG_WARN, "Not joining invalid channel %s\n", channel);
+        return;
     }
 
-    /* an edge case where params have colons will break, luckily it is rarely used */
-    if (regcomp(&preg, "^(:([^ ]+) )?([^ ]+)( ([^:]+))?( (:(.+)))?$", REG_EXTENDED) != 0)
+    if (irc_out)
     {
-        printf("error compiling matching regexp\n");
-        return -1;
+        irc_printf("JOIN %s%s%s\r\n", channel, key ? " " : "", key ? key : "");
+        return;
     }
 
-    server_register_cb(irc_process);
+    c = irc_channel(channel);
 
-    return 1;
+    if (c && (c->state == IRC_JOINED || c->state == IRC_JOINING))
+    {
+        if (key && *key)
+        {
+            snprintf(c->key, sizeof(c->key), "%s", key);
+        }
+        return;
+    }
+
+    /* goes out when the core goes idle, packed with whatever else was wanted by then */
+    irc_channel_add(channel, key, IRC_WANTED);
 }
 
-void irc_free()
+/* JOIN lines from irc_printf are taken apart into managed joins */
+static int irc_queue_join(const char *buf)
 {
-    struct cb_entry *e;
-    while ( (e = TAILQ_FIRST(&cb_h)) )
+    char chans[IRC_LINE], keys[IRC_LINE];
+    char *p, *k, *last = NULL, *last_k = NULL;
+
+    keys[0] = '\0';
+    if (sscanf(buf, "%511s %511s", chans, keys) < 1 || strcmp(chans, "0") == 0)
     {
-        TAILQ_REMOVE(&cb_h, e, cb_entries);
-        free(e);
+        return 0;
     }
 
+    p = chans[0] == ':' ? chans + 1 : chans;
+    k = strtok_r(keys, ",", &last_k);
+
+    for ((p = strtok_r(p, ",", &last)); p; (p = strtok_r(NULL, ",", &last)))
+    {
+        irc_join(p, k);
+        k = k ? strtok_r(NULL, ",", &last_k) : NULL;
+    }
+
+    return 1;
+}
+
+/* every channel we were on is wanted again on a new connection */
+static void irc_channel_rejoin()
+{
+    struct irc_channel *c;
+
+    registered = 0;
+
+    TAILQ_FOREACH(c, &channel_h, channels)
+    {
+        irc_channel_state(c, IRC_WANTED);
+    }
+}
+
+static void irc_join_failed(const char *command, const char *channel, const char *trail)
+{
+    struct irc_channel *c = irc_channel(channel);
+
+    if (c && c->state == IRC_JOINING)
+    {
+        log_lprintf(LOG_WARN, "Joining %s failed: %s %s\n", c->name, command, trail ? trail : "");
+        c->error = atoi(command);
+        irc_channel_state(c, IRC_FAILED);
+        metrics_add(joins_failed, 1);
+    }
+}
+
+static void irc_join_done(const char *channel)
+{
+    struct irc_channel *c = irc_channel(channel);
+
+    if (c == NULL || c->state != IRC_JOINED)
+    {
+        irc_channel_add(channel, NULL, IRC_JOINED);
+        metrics_add(joins_ok, 1);
+    }
+}
+
+/* follows our nick and channels */
+static void irc_track(const char *prefix, const char *command, const char *params, const char *trail)
+{
+    char nick[128], arg[200], victim[200];
+    const char *p;
+
+    arg[0] = victim[0] = '\0';
+    p = params ? params : trail;
+
+    if (p)
+    {
+        sscanf(p, "%199s %199s", arg, victim);
+    }
+
+    if (strcmp(command, "001") == 0)
+    {
+        snprintf(irc_me, sizeof(irc_me), "%s", arg);
+        irc_channel_rejoin();
+        return;
+    }
+
+    /* end of MOTD or no MOTD */
+    if (strcmp(command, "376") == 0 || strcmp(command, "422") == 0)
+    {
+        registered = 1;
+        registered_on = server_connection();
+        irc_join_next();
+        return;
+    }
+
+    if (strlen(command) == 3 && strstr(join_errors, command))
+    {
+        irc_join_failed(command, victim, trail);
+        irc_join_next();
+        return;
+    }
+
+    if (prefix == NULL)
+    {
+        return;
+    }
+
+    snprintf(nick, sizeof(nick), "%s", prefix);
+    nick[strcspn(nick, "!")] = '\0';
+
+    if (strcmp(command, "KICK") == 0 && strcasecmp(victim, irc_me) == 0)
+    {
+        irc_channel_remove(arg);
+    }
+
+    if (strcasecmp(nick, irc_me) != 0)
+    {
+        return;
+    }
+
+    if (strcmp(command, "JOIN") == 0)
+    {
+        irc_join_done(arg);
+        irc_join_next();
+    }
+    else if (strcmp(command, "PART") == 0)
+    {
+        irc_channel_remove(arg);
+    }
+    else if (strcmp(command, "NICK") == 0)
+    {
+        snprintf(irc_me, sizeof(irc_me), "%s", trail ? trail : arg);
+    }
+}
+
+/* copies at most IRC_PARSED - 1 bytes */
+static const char *irc_copy(char *dst, const char *src, int len)
+{
+    irc_memcpy(dst, src, len < IRC_PARSED - 1 ? len : IRC_PARSED - 1);
+    return src + len;
+}
+
+/*
+ * [:prefix ]command[ middle...][ :trail], params are the middle params
+ * as one string, a middle param may contain colons after its first byte
+ */
+static int irc_parse(const char *line, char *prefix, char *command, char *params, char *trail)
+{
+    const char *p = line, *first = NULL, *end = NULL;
+
+    prefix[0] = params[0] = trail[0] = '\0';
+
+    if (*p == ':')
+    {
+        p = irc_copy(prefix, p + 1, strcspn(p + 1, " "));
+        while (*p == ' ')
+        {
+            p++;
+        }
+    }
+
+    p = irc_copy(command, p, strcspn(p, " "));
+
+    if (command[0] == '\0')
+    {
+        return 0;
+    }
+
+    while (*p == ' ')
+    {
+        while (*p == ' ')
+        {
+            p++;
+        }
+
+        if (*p == ':')
+        {
+            irc_copy(trail, p + 1, strlen(p + 1));
+            break;
+        }
+
+        if (*p)
+        {
+            first = first ? first : p;
+            p += strcspn(p, " ");
+            end = p;
+        }
+    }
+
+    if (first)
+    {
+        irc_copy(params, first, end - first);
+    }
+
+    return 1;
+}
+
+/* picks up TARGMAX, MODES and PREFIX from a 005 */
+static void irc_isupport(const char *params)
+{
+    char buf[IRC_LINE];
+    char *p, *t, *last = NULL, *last_t = NULL;
+
+    snprintf(buf, sizeof(buf), "%s", params);
+
+    for ((p = strtok_r(buf, " ", &last)); p; (p = strtok_r(NULL, " ", &last)))
+    {
+        if (strncmp(p, "MODES=", 6) == 0)
+        {
+            modes_max = atoi(p + 6);
+        }
+        else if (strncmp(p, "PREFIX=", 7) == 0 && (t = strchr(p, ')')))
+        {
+            snprintf(prefixes, sizeof(prefixes), "%s", t + 1);
+        }
+        else if (strncmp(p, "TARGMAX=", 8) == 0)
+        {
+            for ((t = strtok_r(p + 8, ",", &last_t)); t; (t = strtok_r(NULL, ",", &last_t)))
+            {
+                if (strncmp(t, "PRIVMSG:", 8) == 0)
+                {
+                    targmax_privmsg = atoi(t + 8);
+                }
+                else if (strncmp(t, "NOTICE:", 7) == 0)
+                {
+                    targmax_notice = atoi(t + 7);
+                }
+                else if (strncmp(t, "JOIN:", 5) == 0)
+                {
+                    targmax_join = atoi(t + 5);
+                }
+            }
+        }
+    }
+}
+
+/* the next space separated word, or all that is left after a colon */
+static char *irc_word(char **p)
+{
+    char *w;
+
+    while (**p == ' ')
+    {
+        (*p)++;
+    }
+
+    w = *p;
+
+    if (*w == ':')
+    {
+        *p += strlen(*p);
+        return w + 1;
+    }
+
+    *p += strcspn(*p, " ");
+    if (**p)
+    {
+        *(*p)++ = '\0';
+    }
+
+    return w;
+}
+
+/* status prefixes in s go to modes */
+static char *irc_modes(const char *s, int len, char **modes)
+{
+    char *m = *modes;
+
+    for (; len > 0; s++, len--)
+    {
+        if (strchr(prefixes, *s))
+        {
+            *(*modes)++ = *s;
+        }
+    }
+    *(*modes)++ = '\0';
+
+    return m;
+}
+
+/* takes a 353, 366, 352 or 315 past the generic parse, 0 if it is something else */
+static int irc_burst(const char *line)
+{
+    static char buf[IRC_PARSED];
+    static char modebuf[IRC_PARSED * 2];
+    static struct irc_member members[IRC_PARSED / 2];
+    struct irc_member *m;
+    struct member_entry *e;
+    const char *cmd = line;
+    char *p = buf, *modes = modebuf, *channel, *names, *name;
+    unsigned long start, end;
+    int n = 0, len;
+
+    if (*cmd == ':')
+    {
+        cmd += strcspn(cmd, " ");
+        while (*cmd == ' ')
+        {
+            cmd++;
+        }
+    }
+
+    if (strncmp(cmd, "353 ", 4) && strncmp(cmd, "366 ", 4) && strncmp(cmd, "352 ", 4) && strncmp(cmd, "315 ", 4))
+    {
+        return 0;
+    }
+
+    metrics_add(burst_lines, 1);
+
+    if (log_enabled(LOG_TRACE))
+    {
+        log_lprintf(LOG_TRACE, "-> %s\n", line);
+    }
+
+    if (TAILQ_EMPTY(&member_h))
+    {
+        return 1;
+    }
+
+    irc_copy(buf, cmd + 4, strlen(cmd + 4));
+    irc_word(&p);
+
+    if (cmd[1] == '5' && cmd[2] == '3')
+    {
+        /* 353 me = #channel :@nick +nick nick!user@host */
+        irc_word(&p);
+        channel = irc_word(&p);
+        names = irc_word(&p);
+
+        while (*(name = irc_word(&names)))
+        {
+            m = &members[n++];
+            len = strspn(name, prefixes);
+            m->modes = irc_modes(name, len, &modes);
+            m->nick = name + len;
+            m->user = m->host = NULL;
+
+            if ((name = strchr(m->nick, '!')))
+            {
+                *name++ = '\0';
+                m->user = name;
+
+                if ((name = strchr(name, '@')))
+                {
+                    *name++ = '\0';
+                    m->host = name;
+                }
+            }
+        }
+
+        if (n == 0)
+        {
+            /* n 0 is for the end of the list */
+            return 1;
+        }
+    }
+    else if (cmd[1] == '5')
+    {
+        /* 352 me #channel user host server nick flags :hops realname */
+        m = &members[n++];
+        channel = irc_word(&p);
+        m->user = irc_word(&p);
+        m->host = irc_word(&p);
+        irc_word(&p);
+        m->nick = irc_word(&p);
+        name = irc_word(&p);
+        m->modes = irc_modes(name, strlen(name), &modes);
+    }
+    else
+    {
+        /* 366 me #channel or 315 me mask, the list is complete */
+        channel = irc_word(&p);
+    }
+
+    TAILQ_FOREACH(e, &member_h, member_entries)
+    {
+        if (bot_disabled(e->ctx) || bot_shed(e->ctx))
+        {
+            continue;
+        }
+
+        start = watchdog_begin(e->ctx, "irc members callback", *(void **)(&e->cb));
+        bot_ctx(e->ctx);
+        e->cb(channel, members, n);
+        bot_ctx(irc_ctx);
+        end = watchdog_end(start);
+        metrics_observe(e->time, end - start);
+        trace_span("irc", e->ctx ? e->ctx->name : "core", start, end);
+    }
+
+    return 1;
+}
+
+void irc_process(const char *line)
+{
+    unsigned long start;
+    int len;
+    char *buf;
+
+    char prefix[IRC_PARSED];
+    char command[IRC_PARSED];
+    char params[IRC_PARSED];
+    char trail[IRC_PARSED];
+
+    char *pprefix = NULL;
+    char *pparams = NULL;
+    char *ptrail = NULL;
+
+    start = trace_on ? metrics_now() : 0;
+
+    len = strlen(line);
+    line_encoding = utf8_check(line, len);
+
+    if (line_encoding == ENC_INVALID)
+    {
+        if (fallback == ENC_INVALID)
+        {
+            metrics_add(invalid, 1);
+        }
+        else
+        {
+            buf = line_alloc(3 * len + 1);
+            utf8_from(fallback, line, len, buf);
+            line = buf;
+            line_encoding = fallback;
+            metrics_add(transcoded, 1);
+        }
+    }
+
+    if (irc_burst(line))
+    {
+        trace_span("irc", "burst", start, metrics_now());
+    }
+    else if (irc_parse(line, prefix, command, params, trail))
+    {
+        trace_span("irc", "parse", start, metrics_now());
+
+        if (strlen(prefix) > 0)
+        {
+            pprefix = prefix;
+        }
+
+        if (strlen(params) > 0)
+        {
+            pparams = params;
+        }
+
+        if (strlen(trail) > 0)
+        {
+            ptrail = trail;
+        }
+
+        /* log some meaningful messages */
+        if (strcmp(command, "001") == 0 || strcmp(command, "002") == 0 || strcmp(command, "003") == 0 || strcmp(command, "020") == 0 ||
+                (strcmp(command, "NOTICE") == 0 && pparams && (strcmp(pparams, "*") == 0 || strcmp(pparams, "AUTH") == 0)))
+        {
+            log_printf("%s\n", trail);
+        }
+
+        if (strcmp(command, "MODE") == 0 && pprefix && pparams && strcmp(pprefix, pparams) == 0)
+        {
+            log_printf("User mode set to %s\n", trail);
+        }
+
+        if (strcmp(command, "ERROR") == 0)
+        {
+            log_lprintf(LOG_WARN, "Error: %s\n", ptrail);
+        }
+
+        if (log_enabled(LOG_TRACE))
+        {
+            log_lprintf(LOG_TRACE, "-> %s %s %s :%s\n", pprefix, command, pparams, ptrail);
+        }
+
+        if (strcmp(command, "001") == 0)
+        {
+            /* new connection, nothing is known about the server yet */
+            targmax_privmsg = targmax_notice = 1;
+            targmax_join = 0;
+            modes_max = 3;
+            strcpy(prefixes, "@+");
+        }
+
+        if (strcmp(command, "005") == 0 && pparams)
+        {
+            irc_isupport(pparams);
+        }
+
+        irc_track(pprefix, command, pparams, ptrail);
+
+        irc_dispatch(pprefix, command, pparams, ptrail);
+    }
+}
+
+/* every mode letter has its argument, so nothing is a list query */
+static int irc_mode_args(const char *payload)
+{
+    const char *p = payload;
+    int letters = 0, args = 0;
+
+    for (; *p && *p != ' '; p++)
+    {
+        if (*p != '+' && *p != '-')
+        {
+            letters++;
+        }
+    }
+
+    for (; *p; p++)
+    {
+        if (*p == ' ' && p[1] && p[1] != ' ')
+        {
+            args++;
+        }
+    }
+
+    return letters > 0 && letters == args ? args : -1;
+}
+
+/* the sign in effect at the end of a mode string */
+static char irc_mode_sign(const char *modes)
+{
+    char sign = '+';
+
+    for (; *modes; modes++)
+    {
+        if (*modes == '+' || *modes == '-')
+        {
+            sign = *modes;
+        }
+    }
+
+    return sign;
+}
+
+/* takes a line for the queue, returns 0 if it has to go out as is */
+static int irc_queue(const char *buf)
+{
+    struct irc_queued *q;
+    const char *p, *target;
+    int type, len;
+
+    if (strncmp(buf, "PRIVMSG ", 8) == 0)
+    {
+        type = IRC_PRIVMSG;
+        target = buf + 8;
+    }
+    else if (strncmp(buf, "NOTICE ", 7) == 0)
+    {
+        type = IRC_NOTICE;
+        target = buf + 7;
+    }
+    else if (strncmp(buf, "MODE ", 5) == 0)
+    {
+        type = IRC_MODE;
+        target = buf + 5;
+    }
+    else if (strncmp(buf, "JOIN ", 5) == 0)
+    {
+        return irc_queue_join(buf + 5);
+    }
+    else
+    {
+        return 0;
+    }
+
+    len = strcspn(target, " ,\r\n");
+    p = target + len;
+
+    if (len == 0 || len >= (int)sizeof(q->target) || *p != ' ')
+    {
+        return 0;
+    }
+
+    if (type != IRC_MODE && *++p != ':')
+    {
+        return 0;
+    }
+
+    p++;
+
+    if (queued == IRC_QUEUE)
+    {
+        irc_flush();
+    }
+
+    q = &queue[queued];
+    q->type = type;
+    memcpy(q->target, target, len);
+    q->target[len] = '\0';
+    snprintf(q->payload, sizeof(q->payload), "%s", p);
+    q->payload[strcspn(q->payload, "\r\n")] = '\0';
+
+    if (type == IRC_MODE && irc_mode_args(q->payload) < 0)
+    {
+        return 0;
+    }
+
+    queued++;
+    return 1;
+}
+
+/* nothing between from and to still waiting for target */
+static int irc_queue_clear(const char *target, int from, int to)
+{
+    int k;
+
+    for (k = from + 1; k < to; k++)
+    {
+        if (queue[k].type && strcasecmp(queue[k].target, target) == 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void irc_flush()
+{
+    struct irc_queued *q, *r;
+    char buf[IRC_LINE];
+    char modes[IRC_LINE], args[IRC_LINE];
+    const char *cmd, *ra;
+    int i, j, n, max, len, nargs, rargs;
+
+    for (i = 0; i < queued; i++)
+    {
+        q = &queue[i];
+
+        if (q->type == IRC_MODE)
+        {
+            nargs = irc_mode_args(q->payload);
+            len = strcspn(q->payload, " ");
+            memcpy(modes, q->payload, len);
+            modes[len] = '\0';
+            snprintf(args, sizeof(args), "%s", q->payload + len);
+
+            for (j = i + 1; j < queued; j++)
+            {
+                r = &queue[j];
+
+                if (r->type == 0)
+                {
+                    continue;
+                }
+
+                if (r->type != IRC_MODE || strcasecmp(r->target, q->target) != 0)
+                {
+                    break;
+                }
+
+                rargs = irc_mode_args(r->payload);
+                len = strcspn(r->payload, " ");
+                ra = r->payload + len;
+
+                if ((modes_max > 0 && nargs + rargs > modes_max) ||
+                        strlen(q->target) + strlen(modes) + len + strlen(args) + strlen(ra) + 8 >= IRC_LINE)
+                {
+                    break;
+                }
+
+                /* +o and +v make +ov */
+                if (r->payload[0] == irc_mode_sign(modes))
+                {
+                    strncat(modes, r->payload + 1, len - 1);
+                }
+                else
+                {
+                    strncat(modes, r->payload, len);
+                }
+                strcat(args, ra);
+                nargs += rargs;
+                r->type = 0;
+                metrics_add(coalesced, 1);
+            }
+
+            snprintf(buf, sizeof(buf), "MODE %s %s%s\r\n", q->target, modes, args);
+            irc_send(buf);
+        }
+        else if (q->type)
+        {
+            cmd = q->type == IRC_PRIVMSG ? "PRIVMSG" : "NOTICE";
+            max = q->type == IRC_PRIVMSG ? targmax_privmsg : targmax_notice;
+            len = snprintf(buf, sizeof(buf), "%s %s", cmd, q->target);
+            n = 1;
+
+            for (j = i + 1; j < queued && (max == 0 || n < max); j++)
+            {
+                r = &queue[j];
+
+                if (r->type != q->type || strcmp(r->payload, q->payload) != 0 ||
+                        len + strlen(r->target) + strlen(q->payload) + 5 >= IRC_LINE ||
+                        !irc_queue_clear(r->target, i, j) || strcasecmp(r->target, q->target) == 0)
+                {
+                    continue;
+                }
+
+                len += sprintf(buf + len, ",%s", r->target);
+                r->type = 0;
+                n++;
+                metrics_add(coalesced, 1);
+            }
+
+            snprintf(buf + len, sizeof(buf) - len, " :%s\r\n", q->payload);
+            irc_send(buf);
+        }
+
+        q->type = 0;
+    }
+
+    queued = 0;
+}
+
+/* lines were written to the spool from off to end */
+static void irc_spool_dirty(size_t off, size_t end)
+{
+    if (spool_lo == spool_hi)
+    {
+        spool_lo = off;
+        spool_hi = end;
+    }
+
+    spool_lo = off < spool_lo ? off : spool_lo;
+    spool_hi = end > spool_hi ? end : spool_hi;
+    spool_dirty = 1;
+}
+
+/* doesn't log, log_lprintf belongs to the main thread */
+static void *irc_spool_main(void *arg)
+{
+    size_t page = sysconf(_SC_PAGESIZE), lo, hi;
+    unsigned long req;
+    int err;
+
+    pthread_mutex_lock(&spool_lock);
+
+    while (!spool_quit)
+    {
+        if (spool_done == spool_req)
+        {
+            pthread_cond_wait(&spool_cond, &spool_lock);
+            continue;
+        }
+
+        req = spool_req;
+        lo = spool_want_lo / page * page;
+        hi = spool_want_hi;
+        spool_want_lo = spool_want_hi = 0;
+        pthread_mutex_unlock(&spool_lock);
+
+        /* the lines before the header that points past them */
+        err = lo < hi && msync(spool + lo, hi - lo, MS_SYNC) != 0 ? errno : 0;
+        err = msync(spool, sizeof(struct irc_spool_hdr), MS_SYNC) != 0 ? errno : err;
+
+        pthread_mutex_lock(&spool_lock);
+        spool_done = req;
+        spool_err = err ? err : spool_err;
+        pthread_cond_broadcast(&spool_cond);
+    }
+
+    pthread_mutex_unlock(&spool_lock);
+
+    return NULL;
+}
+
+/* hands what changed to the sync thread, now waits for all of it to be on disk */
+static void irc_spool_sync(int now)
+{
+    int err;
+
+    if (!spool_running || (!now && !(spool_dirty && metrics_now() - spool_synced >= spool_sync * 1000000UL)))
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&spool_lock);
+
+    if (spool_dirty)
+    {
+        if (spool_want_lo == spool_want_hi)
+        {
+            spool_want_lo = spool_lo;
+            spool_want_hi = spool_hi;
+        }
+
+        if (spool_lo < spool_hi)
+        {
+            spool_want_lo = spool_lo < spool_want_lo ? spool_lo : spool_want_lo;
+            spool_want_hi = spool_hi > spool_want_hi ? spool_hi : spool_want_hi;
+        }
+
+        spool_req++;
+        pthread_cond_broadcast(&spool_cond);
+    }
+
+    while (now && spool_done != spool_req)
+    {
+        pthread_cond_wait(&spool_cond, &spool_lock);
+    }
+
+    err = spool_err;
+    spool_err = 0;
+    pthread_mutex_unlock(&spool_lock);
+
+    if (err)
+    {
+        log_lprintf(LOG_ERROR, "Error syncing the spool: %s\n", strerror(err));
+    }
+
+    spool_lo = spool_hi = 0;
+    spool_dirty = 0;
+    spool_synced = metrics_now();
+}
+
+/* the spool file as it was left, or a new one of spool_size */
+static int irc_spool_open(const char *path)
+{
+    struct stat st;
+    unsigned int off, len;
+
+    if ((spool_fd = open(path, O_RDWR | O_CREAT, 0600)) < 0 || fstat(spool_fd, &st) < 0)
+    {
+        log_lprintf(LOG_ERROR, "Can't open the spool %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (st.st_size >= (off_t)sizeof(struct irc_spool_hdr))
+    {
+        spool_size = st.st_size;
+    }
+    else if (ftruncate(spool_fd, spool_size) < 0)
+    {
+        log_lprintf(LOG_ERROR, "Can't size the spool %s: %s\n", path, strerror(errno));
+        close(spool_fd);
+        return -1;
+    }
+
+    if ((spool = mmap(NULL, spool_size, PROT_READ | PROT_WRITE, MAP_SHARED, spool_fd, 0)) == MAP_FAILED)
+    {
+        log_lprintf(LOG_ERROR, "Can't map the spool %s: %s\n", path, strerror(errno));
+        close(spool_fd);
+        spool = NULL;
+        return -1;
+    }
+
+    spool_hdr = (struct irc_spool_hdr *)spool;
+
+    if (memcmp(spool_hdr->magic, IRC_SPOOL_MAGIC, 4) != 0 || spool_hdr->version != IRC_SPOOL_VERSION ||
+            spool_hdr->head < sizeof(struct irc_spool_hdr) || spool_hdr->head > spool_hdr->tail || spool_hdr->tail > spool_size)
+    {
+        if (st.st_size > 0)
+        {
+            log_lprintf(LOG_WARN, "Starting the spool %s over, it's not one of ours\n", path);
+        }
+
+        memcpy(spool_hdr->magic, IRC_SPOOL_MAGIC, 4);
+        spool_hdr->version = IRC_SPOOL_VERSION;
+        spool_hdr->head = spool_hdr->tail = sizeof(struct irc_spool_hdr);
+        spool_dirty = 1;
+    }
+
+    /* a line cut short by a crash ends it */
+    for (off = spool_hdr->head; off < spool_hdr->tail; off += sizeof(len) + len)
+    {
+        memcpy(&len, spool + off, sizeof(len));
+
+        if (len == 0 || len >= IRC_LINE || off + sizeof(len) + len > spool_hdr->tail)
+        {
+            log_lprintf(LOG_WARN, "Dropped a broken line from the spool\n");
+            spool_hdr->tail = off;
+            spool_dirty = 1;
+            break;
+        }
+
+        spool_lines++;
+    }
+
+    spool_quit = 0;
+    if (pthread_create(&spool_thread, NULL, irc_spool_main, NULL) != 0)
+    {
+        log_lprintf(LOG_ERROR, "Error starting the spool sync thread\n");
+        munmap(spool, spool_size);
+        close(spool_fd);
+        spool = NULL;
+        spool_fd = -1;
+        spool_lines = 0;
+        return -1;
+    }
+    spool_running = 1;
+
+    if (spool_lines)
+    {
+        log_printf("%d lines in the spool to send\n", spool_lines);
+    }
+
+    metrics_set(spool_gauge, spool_lines);
+
+    return 0;
+}
+
+static int irc_spool_append(const char *line)
+{
+    unsigned int len = strlen(line), start = sizeof(struct irc_spool_hdr);
+
+    if (spool_hdr->tail + sizeof(len) + len > spool_size && spool_hdr->head > start)
+    {
+        /* what's left moves to the front */
+        memmove(spool + start, spool + spool_hdr->head, spool_hdr->tail - spool_hdr->head);
+        spool_hdr->tail -= spool_hdr->head - start;
+        spool_hdr->head = start;
+        irc_spool_dirty(start, spool_hdr->tail);
+    }
+
+    if (len == 0 || len >= IRC_LINE || spool_hdr->tail + sizeof(len) + len > spool_size)
+    {
+        return -1;
+    }
+
+    /* the line first, a crash before the tail moves leaves it out */
+    memcpy(spool + spool_hdr->tail, &len, sizeof(len));
+    memcpy(spool + spool_hdr->tail + sizeof(len), line, len);
+    irc_spool_dirty(spool_hdr->tail, spool_hdr->tail + sizeof(len) + len);
+    spool_hdr->tail += sizeof(len) + len;
+
+    spool_lines++;
+    metrics_add(spooled, 1);
+    metrics_set(spool_gauge, spool_lines);
+
+    return 0;
+}
+
+/* PRIVMSG, NOTICE and the like wait while we're still joining their channel */
+static int irc_spool_ready(const char *line)
+{
+    struct irc_channel *c;
+    char target[200];
+    const char *p = line + strcspn(line, " ");
+
+    p += strspn(p, " ");
+    snprintf(target, sizeof(target), "%.*s", (int)strcspn(p, " ,\r\n"), p);
+
+    c = strchr("#&!+", *target) && *target ? irc_channel(target) : NULL;
+
+    return c == NULL || (c->state != IRC_WANTED && c->state != IRC_JOINING);
+}
+
+/* sends what's in the spool, in order, for as long as the rate allows */
+static void irc_spool_send()
+{
+    char buf[IRC_LINE];
+    unsigned long now = metrics_now();
+    unsigned int len;
+
+    spool_tokens += (now - spool_refill) / 1e9 * spool_rate;
+    spool_tokens = spool_tokens > spool_burst ? spool_burst : spool_tokens;
+    spool_refill = now;
+
+    while (spool_lines && spool_tokens >= 1 && registered && registered_on == server_connection())
+    {
+        memcpy(&len, spool + spool_hdr->head, sizeof(len));
+        memcpy(buf, spool + spool_hdr->head + sizeof(len), len);
+        buf[len] = '\0';
+
+        if (!irc_spool_ready(buf) || !irc_send(buf))
+        {
+            break;
+        }
+
+        spool_hdr->head += sizeof(len) + len;
+        spool_tokens--;
+        spool_lines--;
+        spool_dirty = 1;
+
+        if (spool_lines == 0)
+        {
+            spool_hdr->head = spool_hdr->tail = sizeof(struct irc_spool_hdr);
+        }
+    }
+
+    metrics_set(spool_gauge, spool_lines);
+}
+
+void irc_idle()
+{
+    irc_flush();
+    irc_join_next();
+
+    if (spool)
+    {
+        irc_spool_send();
+        irc_spool_sync(0);
+    }
+}
+
+int irc_printf(const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+    char buf[IRC_LINE];
+    CTX caller_ctx = bot_get_ctx();
+    unsigned long start = trace_on ? metrics_now() : 0;
+
+    va_start(args, fmt);
+    ret = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    bot_ctx(irc_ctx);
+
+    /* a hosted module's output is coalesced by the core once it gets there */
+    if (irc_out || !irc_queue(buf))
+    {
+        irc_flush();
+        irc_send(buf);
+    }
+
+    trace_span("irc_printf", caller_ctx ? caller_ctx->name : "core", start, metrics_now());
+
+    bot_ctx(caller_ctx);
+
+    return ret;
+}
+
+int irc_spool(const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+    char buf[IRC_LINE];
+    CTX caller_ctx = bot_get_ctx();
+
+    va_start(args, fmt);
+    ret = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    if (spool == NULL)
+    {
+        return irc_printf("%s", buf);
+    }
+
+    bot_ctx(irc_ctx);
+
+    /* after what irc_printf queued before it */
+    irc_flush();
+
+    if (irc_spool_append(buf) < 0)
+    {
+        log_lprintf(LOG_WARN, "The spool is full, sending without it\n");
+        metrics_add(spool_dropped, 1);
+        irc_send(buf);
+    }
+
+    irc_spool_send();
+
+    bot_ctx(caller_ctx);
+
+    return ret;
+}
+
+/* "#channel[:key],..." from the config, channels_file or a handoff */
+static void irc_channels(const char *s, int state)
+{
+    char buf[IRC_LINE];
+    char *p, *key, *last = NULL;
+
+    buf[0] = '\0';
+    strncat(buf, s, sizeof(buf) - 1);
+
+    for ((p = strtok_r(buf, " ,", &last)); p; (p = strtok_r(NULL, " ,", &last)))
+    {
+        if ((key = strchr(p, ':')))
+        {
+            *key++ = '\0';
+        }
+
+        if (state == IRC_WANTED)
+        {
+            irc_join(p, key);
+        }
+        else
+        {
+            irc_channel_add(p, key, state);
+        }
+    }
+}
+
+int irc_init(CTX ctx)
+{
+    char buf[IRC_LINE];
+    const char *s;
+    FILE *fh;
+    int n;
+
+    irc_ctx = ctx;
+
+    TAILQ_INIT(&cb_h);
+    pool_init(&cb_pool, sizeof(struct cb_entry));
+    TAILQ_INIT(&member_h);
+    pool_init(&member_pool, sizeof(struct member_entry));
+    TAILQ_INIT(&channel_h);
+    TAILQ_INIT(&wanted_h);
+    TAILQ_INIT(&joining_h);
+    TAILQ_INIT(&failed_h);
+    memset(channel_hash, 0, sizeof(channel_hash));
+    pool_init(&channel_pool, sizeof(struct irc_channel));
+    joining = 0;
+
+    sent_lines = metrics_counter("corebot_irc_sent_lines_total", NULL);
+    sent_bytes = metrics_counter("corebot_irc_sent_bytes_total", NULL);
+    coalesced = metrics_counter("corebot_irc_coalesced_lines_total", NULL);
+    transcoded = metrics_counter("corebot_irc_transcoded_lines_total", NULL);
+    invalid = metrics_counter("corebot_irc_invalid_lines_total", NULL);
+    joins_ok = metrics_counter("corebot_irc_joins_total", "result=\"ok\"");
+    joins_failed = metrics_counter("corebot_irc_joins_total", "result=\"failed\"");
+    burst_lines = metrics_counter("corebot_irc_burst_lines_total", NULL);
+    spool_gauge = metrics_gauge("corebot_irc_spool_lines", NULL);
+    spooled = metrics_counter("corebot_irc_spooled_lines_total", NULL);
+    spool_dropped = metrics_counter("corebot_irc_spool_full_total", NULL);
+
+    if ((s = config_get("fallback_encoding")))
+    {
+        /* anything but an 8-bit encoding means none */
+        fallback = utf8_encoding(s);
+        fallback = fallback == ENC_LATIN1 || fallback == ENC_CP1252 ? fallback : ENC_INVALID;
+    }
+
+    if ((s = config_get("encoding")) && (n = utf8_encoding(s)) != ENC_INVALID)
+    {
+        encoding = n;
+    }
+
+    if (bot_require("server", 1) < 1)
+    {
+        printf("error: server module required\n");
+        return -1;
+    }
+
+    if ((s = config_get("join_window")) && atoi(s) > 0)
+    {
+        join_window = atoi(s);
+    }
+
+    if ((s = config_get("join_interval")))
+    {
+        join_interval = strtoul(s, NULL, 10);
+    }
+
+    if ((s = config_get("join_timeout")) && atoi(s) > 0)
+    {
+        join_timeout = atoi(s);
+    }
+
+    if ((s = config_get("join_retry")))
+    {
+        join_retry = strtoul(s, NULL, 10);
+    }
+
+    if ((s = handoff_get("nick", NULL)))
+    {
+        snprintf(irc_me, sizeof(irc_me), "%s", s);
+        registered = irc_me[0] != '\0';
+        registered_on = server_connection();
+    }
+
+    if ((s = handoff_get("channels", NULL)))
+    {
+        irc_channels(s, IRC_JOINED);
+    }
+
+    if ((s = handoff_get("joins", NULL)))
+    {
+        irc_channels(s, IRC_WANTED);
+    }
+
+    if ((s = handoff_get("isupport", NULL)))
+    {
+        sscanf(s, "%d %d %d %d %15s", &targmax_privmsg, &targmax_notice, &modes_max, &targmax_join, prefixes);
+    }
+
+    if ((s = config_get("channels")))
+    {
+        irc_channels(s, IRC_WANTED);
+    }
+
+    /* too many for one config line */
+    if ((s = config_get("channels_file")))
+    {
+        if ((fh = fopen(s, "r")) == NULL)
+        {
+            log_lprintf(LOG_ERROR, "Can't open %s: %s\n", s, strerror(errno));
+        }
+        else
+        {
+            while (fgets(buf, sizeof(buf), fh))
+            {
+                buf[strcspn(buf, "\r\n;")] = '\0';
+                irc_channels(buf, IRC_WANTED);
+            }
+
+            fclose(fh);
+        }
+    }
+
+    if ((s = config_get("spool_size")) && atol(s) > (long)sizeof(struct irc_spool_hdr) + IRC_LINE)
+    {
+        spool_size = atol(s);
+    }
+
+    if ((s = config_get("spool_sync_ms")))
+    {
+        spool_sync = strtoul(s, NULL, 10);
+    }
+
+    if ((s = config_get("spool_rate")) && atof(s) > 0)
+    {
+        spool_rate = atof(s);
+    }
+
+    if ((s = config_get("spool_burst")) && atof(s) >= 1)
+    {
+        spool_burst = spool_tokens = atof(s);
+    }
+
+    spool_refill = metrics_now();
+
+    if ((s = config_get("spool")))
+    {
+        irc_spool_open(s);
+    }
+
+    server_register_cb(irc_process);
+
+    return 1;
+}
+
+void irc_save()
+{
+    struct irc_channel *c;
+    char *buf, *p, *q;
+    int len = 1;
+    char isupport[64];
+
+    irc_flush();
+
+    handoff_set("nick", irc_me, -1);
+
+    TAILQ_FOREACH(c, &channel_h, channels)
+    {
+        len += strlen(c->name) + strlen(c->key) + 2;
+    }
+
+    /* joined ones first, then the ones still to be joined */
+    p = buf = bot_malloc(2 * len);
+    q = buf + len;
+    *p = *q = '\0';
+    TAILQ_FOREACH(c, &channel_h, channels)
+    {
+        if (c->state == IRC_JOINED)
+        {
+            p += sprintf(p, "%s%s%s ", c->name, c->key[0] ? ":" : "", c->key);
+        }
+        else
+        {
+            q += sprintf(q, "%s%s%s ", c->name, c->key[0] ? ":" : "", c->key);
+        }
+    }
+
+    handoff_set("channels", buf, -1);
+    handoff_set("joins", buf + len, -1);
+    bot_free(buf);
+
+    snprintf(isupport, sizeof(isupport), "%d %d %d %d %s", targmax_privmsg, targmax_notice, modes_max, targmax_join, prefixes);
+    handoff_set("isupport", isupport, -1);
+
+    irc_spool_sync(1);
+}
+
+void irc_free()
+{
+    irc_flush();
+
+    if (spool)
+    {
+        irc_spool_sync(1);
+
+        pthread_mutex_lock(&spool_lock);
+        spool_quit = 1;
+        pthread_cond_broadcast(&spool_cond);
+        pthread_mutex_unlock(&spool_lock);
+
+        pthread_join(spool_thread, NULL);
+        spool_running = 0;
+
+        munmap(spool, spool_size);
+        close(spool_fd);
+        spool = NULL;
+        spool_fd = -1;
+    }
+
+    TAILQ_INIT(&cb_h);
+    pool_free(&cb_pool);
+    TAILQ_INIT(&member_h);
+    pool_free(&member_pool);
+    TAILQ_INIT(&channel_h);
+    pool_free(&channel_pool);
+
     server_unregister_cb(irc_process);
-    regfree(&preg);
 }
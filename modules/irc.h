@@ -15,6 +15,45 @@
  */
 
 typedef void (*IRC_CB)(const char *, const char *, const char *, const char *);
+typedef void (*IRC_OUT)(const char *);
+
+/*
+ * NAMES (353) and WHO (352) replies skip the IRC_CB callbacks, members of
+ * channel come a reply line at a time and n is 0 once a list is complete
+ * (366 or 315). modes has the channel status prefixes like @ and +, user
+ * and host are NULL from NAMES without userhost-in-names. Hosted modules
+ * don't get these.
+ */
+struct irc_member
+{
+    const char *nick;
+    const char *user;
+    const char *host;
+    const char *modes;
+};
+
+typedef void (*IRC_MEMBERS_CB)(const char *channel, const struct irc_member *members, int n);
 void irc_register_cb(IRC_CB);
 void irc_unregister_cb(IRC_CB);
+void irc_register_members(IRC_MEMBERS_CB);
+void irc_unregister_members(IRC_MEMBERS_CB);
+void irc_unregister_ctx(CTX);
+void irc_dispatch(const char *, const char *, const char *, const char *);
+void irc_set_output(IRC_OUT);
 int irc_printf(const char *fmt, ...);
+/* like irc_printf but kept in the spool (if configured) until written to
+ * the server, after a reconnect or restart if it has to */
+int irc_spool(const char *fmt, ...);
+/* sends queued output now instead of when the core goes idle */
+void irc_flush();
+/* a channel to join (key may be NULL), kept on and rejoined after a reconnect */
+void irc_join(const char *channel, const char *key);
+/* our current nick, empty until registered */
+const char *irc_nick();
+int irc_joined(const char *channel);
+typedef void (*IRC_CHANNEL_CB)(const char *channel);
+/* calls cb with every channel we're on */
+void irc_each_joined(IRC_CHANNEL_CB cb);
+/* ENC_* the line being handled arrived in, it has been transcoded to
+ * UTF-8 unless that is ENC_INVALID (no fallback_encoding) */
+int irc_encoding();
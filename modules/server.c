@@ -43,14 +43,155 @@
 /* time */
 #include <time.h>
 
+/* fcntl */
+#include <fcntl.h>
+
+/* strcasecmp */
+#include <strings.h>
+
+/*
+ * Besides the primary connection the module can keep pool - 1 more
+ * connections to the same network under their own nicks. They only
+ * exist to send: PRIVMSG and NOTICE lines are spread over the registered
+ * connections by a hash of the target, so everything to one target keeps
+ * its order, JOIN and PART go out on all of them and everything else on
+ * the primary. Only the primary's lines reach the callbacks, the others
+ * are looked at here just enough to register and answer PINGs.
+ *
+ * With standby_host set one more connection, the standby, is kept to
+ * another server of the network under a nick of its own, in the same
+ * channels. What it hears from other users is kept for dedup_ms unless
+ * the primary already delivered it. When the primary goes (it closes,
+ * goes silent for dead_timeout or the standby sees it QUIT) the standby
+ * takes its place at once: the primary's queued lines are delivered, the
+ * callbacks see our nick change to the standby's, then get whatever the
+ * standby heard that the primary never delivered. For dedup_ms after
+ * that the new primary's lines the old one already delivered are
+ * dropped. Both sides count lines by a hash of everything after the
+ * tags, so a line said twice is delivered twice. The old primary comes
+ * back as the standby.
+ */
+
 CTX server_ctx = NULL;
 
 #define BUF_SIZE 1024
+#define SERVER_POOL 8
+
+struct server_conn
+{
+    int index;                  /* 0 is the primary */
+    int sock;
+    int connected;
+    int connecting;             /* waiting for a non-blocking connect */
+    int registered;             /* secondary got its 001 */
+    int alt;                    /* connects to standby_host */
+    time_t next_connect;
+    int backoff;                /* seconds, doubled by every failure until a 001 */
+    time_t last_recv;
+    time_t last_ping;
+    unsigned long ping_sent;    /* oldest unanswered lag probe, ns */
+    unsigned long lag;          /* ns */
+    char nick[64];              /* secondary, or what the primary is called */
+    char buf[BUF_SIZE];         /* a partial line waits here for the rest */
+    int off;
+    METRIC sent;
+    METRIC lag_gauge;
+};
+
+struct server_channel
+{
+    char name[200];
+    TAILQ_ENTRY(server_channel) channels;
+};
+
+/* the pool, then the standby */
+static struct server_conn conns[SERVER_POOL + 1];
+static int pool_size = 1;
+static int nconns = 1;
+static struct server_conn *standby = NULL;
+static int connection = 0;
+
+static int ping_interval = 15;
+static int dead_timeout = 45;
+static int connect_timeout = 10;
+static int reconnect_min = 2;
+static int reconnect_max = 300;
+
+/* joined through server_send, secondaries join them after registering */
+static TAILQ_HEAD(channel_head, server_channel) channel_h;
+static struct pool channel_pool;
+
+static METRIC recv_bytes;
+static METRIC recv_lines;
+static METRIC send_bytes;
+static METRIC send_lines;
+static METRIC reconnects;
+static METRIC failovers;
+static METRIC replayed;
+static METRIC duplicates;
 
-static int net_sock = 0;
-static int connected = 0;
-static int server_last_connect = 0;
-static int server_reconnect = 30;
+/* our lag probes, answered with the send time in the PONG */
+#define PROBE ":corebot-lag-"
+
+/*
+ * A read pass on the primary takes in all the socket has. Its lines are
+ * handled as they are read until the pass has taken inbound_budget ms,
+ * after that (and while anything is still queued) they are queued, so
+ * PING, ERROR and registration numerics further in are handled at once,
+ * ahead of the backlog. The queue is worked through a
+ * budget at a time when the core goes idle. While it is over shed_backlog
+ * lines or its oldest line has waited shed_latency ms, channel traffic is
+ * shed: modules with shed = 1 don't see it. At inbound_max lines nothing
+ * more is read until the queue gets shorter.
+ */
+#define PRIO_CRITICAL   0
+#define PRIO_NORMAL     1
+#define PRIO_LOW        2               /* channel messages, joins, parts, quits, nicks, NAMES and WHO */
+
+struct server_line
+{
+    int prio;
+    unsigned long recv_start;
+    unsigned long recv_end;
+    TAILQ_ENTRY(server_line) lines;
+    char line[BUF_SIZE];
+};
+
+static TAILQ_HEAD(line_head, server_line) line_h;
+static struct pool line_pool;
+static int queued = 0;
+
+static unsigned long inbound_budget = 50;
+static int inbound_max = 10000;
+static int shed_backlog = 1000;
+static unsigned long shed_latency = 2000;
+
+static METRIC queued_gauge;
+static METRIC deferred;
+static METRIC critical;
+static METRIC shed;
+
+/* lines from others by count per hash, for this dedup window and the last */
+struct server_seen
+{
+    unsigned int hash;          /* 0 is a free slot */
+    unsigned int count;
+};
+
+static struct server_seen *seen[2];
+static int seen_size = 16384;
+static int seen_used = 0;
+static unsigned long seen_rotated = 0;
+static unsigned long dedup = 5000;      /* ms */
+static unsigned long dedup_until = 0;   /* ns, after a failover */
+
+/* what the standby heard that the primary hasn't delivered, oldest first */
+static TAILQ_HEAD(standby_head, server_line) standby_h;
+static int standby_lines = 0;
+static int failover = 0;
+
+/* numerics that register us or say why we can't be */
+static const char *critical_numerics = "001 002 003 004 005 376 422 431 432 433 436 437 451 464 465 466 900 903 904 905 906 907 908";
 
 static TAILQ_HEAD(cb_head, cb_entry) cb_h;
 
@@ -58,9 +199,12 @@ struct cb_entry
 {
     SERVER_CB cb;
     CTX ctx;
+    METRIC time;
     TAILQ_ENTRY(cb_entry) cb_entries;
 };
 
+static struct pool cb_pool;
+
 void server_register_cb(SERVER_CB cb)
 {
     struct cb_entry *e;
@@ -74,9 +218,15 @@ void server_register_cb(SERVER_CB cb)
         }
     }
 
-    e = malloc(sizeof(struct cb_entry));
+    if ((e = pool_get(&cb_pool)) == NULL)
+    {
+        log_lprintf(LOG_ERROR, "Out of memory registering a callback\n");
+        return;
+    }
+
     e->ctx = bot_get_ctx();
     e->cb = cb;
+    e->time = bot_cb_metric("server");
     TAILQ_INSERT_TAIL(&cb_h, e, cb_entries);
 }
 
@@ -88,7 +238,7 @@ void server_unregister_cb(SERVER_CB cb)
         if (e->cb == cb)
         {
             TAILQ_REMOVE(&cb_h, e, cb_entries);
-            free(e);
+            pool_put(&cb_pool, e);
             break;
         }
     }
@@ -126,7 +276,7 @@ int server_resolv(const char *host, const char *port, struct sockaddr_storage *n
 
         if (!(s = socket(addr->ai_family, SOCK_STREAM, 0)))
         {
-            log_printf("Error creating socket for family %d", addr->ai_family);
+            log_lprintf(LOG_ERROR, "Error creating socket for family %d", addr->ai_family);
             return 0;
         }
 
@@ -143,148 +293,1342 @@ int server_resolv(const char *host, const char *port, struct sockaddr_storage *n
         return s;
     }
 
-    log_printf("Error resolving: %s\n", gai_strerror(ret));
+    log_lprintf(LOG_ERROR, "Error resolving: %s\n", gai_strerror(ret));
 
     return 0;
 }
 
-int server_init(CTX ctx)
+/* template with %d for the index, the index is appended if it has none */
+static void server_conn_nick(struct server_conn *c)
 {
-    server_ctx = ctx;
+    const char *tpl = config_get("pool_nick");
+    const char *p;
 
-    TAILQ_INIT(&cb_h);
+    if (tpl == NULL)
+    {
+        tpl = "corebot%d";
+    }
 
-    return 1;
+    if ((p = strstr(tpl, "%d")))
+    {
+        snprintf(c->nick, sizeof(c->nick), "%.*s%d%s", (int)(p - tpl), tpl, c->index, p + 2);
+    }
+    else
+    {
+        snprintf(c->nick, sizeof(c->nick), "%s%d", tpl, c->index);
+    }
 }
 
-void server_send(const char *msg)
+/* standby_nick, or the pool_nick template */
+static void server_standby_nick(struct server_conn *c)
 {
-    send(net_sock, msg, strlen(msg), 0);
+    const char *nick = config_get("standby_nick");
+
+    if (nick)
+    {
+        snprintf(c->nick, sizeof(c->nick), "%s", nick);
+    }
+    else
+    {
+        server_conn_nick(c);
+    }
 }
 
-void server_timer()
+static struct server_conn *server_conn(int sock)
 {
-    struct sockaddr_storage net_server;
-    socklen_t net_addrlen;
-    const char *host;
-    const char *port;
-    int now, ret;
+    int i;
 
-    if (!connected)
+    for (i = 0; i < nconns; i++)
     {
-        now = time(NULL);
-
-        if (server_last_connect + server_reconnect > now)
+        if ((conns[i].connected || conns[i].connecting) && conns[i].sock == sock)
         {
-            return;
+            return &conns[i];
         }
+    }
+
+    return NULL;
+}
+
+/* 1 if all of it was written */
+static int server_conn_send(struct server_conn *c, const char *msg)
+{
+    int ret, len = strlen(msg);
+    unsigned long start = trace_on ? metrics_now() : 0;
 
-        server_last_connect = now;
+    if ( (ret = send(c->sock, msg, len, 0)) > 0)
+    {
+        metrics_add(send_bytes, ret);
+        metrics_add(send_lines, 1);
+        metrics_add(c->sent, 1);
+    }
+
+    trace_span("server", "send", start, metrics_now());
+
+    return ret == len;
+}
 
-        host = config_get("host");
-        port = config_get("port");
+static struct server_channel *server_channel(const char *name)
+{
+    struct server_channel *ch;
 
-        if (host == NULL || port == NULL)
+    TAILQ_FOREACH(ch, &channel_h, channels)
+    {
+        if (strcasecmp(ch->name, name) == 0)
         {
-            log_printf("Host or port missing in config, can't connect\n");
-            return;
+            return ch;
         }
+    }
 
-        log_printf("Connecting to %s:%s...\n", host, port);
+    return NULL;
+}
+
+/* remembers what JOIN and PART lines did to the channel list */
+static void server_channels(const char *msg, int join)
+{
+    char buf[BUF_SIZE];
+    char *p, *last = NULL;
+    struct server_channel *ch;
+
+    snprintf(buf, sizeof(buf), "%s", msg + 5);
+    buf[strcspn(buf, " \r\n")] = '\0';
 
-        net_sock = server_resolv(host, port, &net_server, &net_addrlen);
+    for ((p = strtok_r(buf, ",", &last)); p; (p = strtok_r(NULL, ",", &last)))
+    {
+        ch = server_channel(p);
 
-        if (!net_sock)
+        if (join && ch == NULL)
         {
-            return;
+            if ((ch = pool_get(&channel_pool)) == NULL)
+            {
+                continue;
+            }
+
+            snprintf(ch->name, sizeof(ch->name), "%s", p);
+            TAILQ_INSERT_TAIL(&channel_h, ch, channels);
+        }
+        else if (!join && ch)
+        {
+            TAILQ_REMOVE(&channel_h, ch, channels);
+            pool_put(&channel_pool, ch);
         }
+    }
+}
 
-        bot_register_fd(net_sock);
+/* a registered secondary catches up on the channels */
+static void server_conn_join(struct server_conn *c)
+{
+    struct server_channel *ch;
+    char buf[512];
+    int len = 0;
 
-        if ( (ret = connect(net_sock, (struct sockaddr *)&net_server, net_addrlen)) == 0)
+    TAILQ_FOREACH(ch, &channel_h, channels)
+    {
+        if (len > 0 && len + strlen(ch->name) + 3 >= sizeof(buf))
         {
-            connected = 1;
-            log_printf("Connected.\n");
+            strcpy(buf + len, "\r\n");
+            server_conn_send(c, buf);
+            len = 0;
         }
-        else
+
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%s", len ? "," : "JOIN ", ch->name);
+    }
+
+    if (len > 0)
+    {
+        strcpy(buf + len, "\r\n");
+        server_conn_send(c, buf);
+    }
+}
+
+/* what follows the prefix */
+static const char *server_command(const char *line)
+{
+    if (*line == ':')
+    {
+        line += strcspn(line, " ");
+        line += strspn(line, " ");
+    }
+
+    return line;
+}
+
+static int server_priority(const char *line)
+{
+    const char *command = server_command(line);
+    char num[4];
+    int len = strcspn(command, " ");
+
+    if (len == 3 && command[0] >= '0' && command[0] <= '9')
+    {
+        memcpy(num, command, 3);
+        num[3] = '\0';
+
+        if (strstr(critical_numerics, num))
         {
-            log_printf("Error: %s\n", strerror(errno));
-            close(net_sock);
-            net_sock = 0;
+            return PRIO_CRITICAL;
         }
+
+        return strcmp(num, "353") == 0 || strcmp(num, "366") == 0 || strcmp(num, "352") == 0 || strcmp(num, "315") == 0 ?
+            PRIO_LOW : PRIO_NORMAL;
+    }
+
+    if ((len == 4 && (strncmp(command, "PING", 4) == 0 || strncmp(command, "KILL", 4) == 0)) ||
+            (len == 5 && strncmp(command, "ERROR", 5) == 0) || (len == 3 && strncmp(command, "CAP", 3) == 0) ||
+            (len == 12 && strncmp(command, "AUTHENTICATE", 12) == 0))
+    {
+        return PRIO_CRITICAL;
+    }
+
+    if ((len == 7 && strncmp(command, "PRIVMSG", 7) == 0) || (len == 6 && strncmp(command, "NOTICE", 6) == 0))
+    {
+        /* to a channel rather than to us */
+        command += len + strspn(command + len, " ");
+        return strchr("#&!+", *command) && *command ? PRIO_LOW : PRIO_NORMAL;
+    }
+
+    if (len == 4 && (strncmp(command, "JOIN", 4) == 0 || strncmp(command, "PART", 4) == 0 ||
+                strncmp(command, "QUIT", 4) == 0 || strncmp(command, "NICK", 4) == 0))
+    {
+        return PRIO_LOW;
     }
+
+    return PRIO_NORMAL;
 }
 
-void server_read(int read)
+static void server_dispatch(const char *line, unsigned long recv_start, unsigned long recv_end)
 {
-    static char buf[BUF_SIZE];
-    static int off = 0;
-    int len;
     struct cb_entry *e;
-    char *line;
-    char *ptr;
-    char *last;
+    unsigned long start, end;
 
-    memset(buf+off, 0, BUF_SIZE - off);
+    /* the line trace starts when its bytes were asked for */
+    trace_begin(line, recv_start);
+    trace_span("server", "recv", recv_start, recv_end);
+    trace_span("server", "queued", recv_end, metrics_now());
 
-    if ( (len = recv(read, buf+off, BUF_SIZE - off, 0)) > 0)
+    TAILQ_FOREACH(e, &cb_h, cb_entries)
     {
-        len += off;
+        if (bot_disabled(e->ctx) || bot_shed(e->ctx))
+        {
+            continue;
+        }
 
-        line = buf;
-        ptr = buf;
-        last = buf;
+        start = watchdog_begin(e->ctx, "server callback", *(void **)(&e->cb));
+        bot_ctx(e->ctx);
+        e->cb(line);
+        bot_ctx(server_ctx);
+        end = watchdog_end(start);
+        metrics_observe(e->time, end - start);
+        trace_span("server", e->ctx ? e->ctx->name : "core", start, end);
+    }
 
-        while ( (ptr = strstr(ptr, "\r\n")) )
-        {
-            *ptr++ = '\0';
-            *ptr++ = '\0';
+    trace_end();
 
-            TAILQ_FOREACH(e, &cb_h, cb_entries)
-            {
-                bot_ctx(e->ctx);
-                e->cb(line);
-                bot_ctx(server_ctx);
-            }
+    /* whatever the callbacks took for this line is gone now */
+    arena_reset(&line_arena);
+}
+
+static void server_queue(const char *line, int prio, unsigned long recv_start, unsigned long recv_end)
+{
+    struct server_line *l = pool_get(&line_pool);
+
+    /* it can't wait then */
+    if (l == NULL)
+    {
+        server_dispatch(line, recv_start, recv_end);
+        return;
+    }
 
-            line = ptr;
-            last = ptr;
+    l->prio = prio;
+    l->recv_start = recv_start;
+    l->recv_end = recv_end;
+    snprintf(l->line, sizeof(l->line), "%s", line);
+
+    TAILQ_INSERT_TAIL(&line_h, l, lines);
+    queued++;
+    metrics_add(deferred, 1);
+}
+
+/* works through queued lines for up to budget ns, 0 for all of them */
+static void server_drain(unsigned long budget)
+{
+    struct server_line *l;
+    unsigned long begin = metrics_now(), now = begin;
+
+    while ((l = TAILQ_FIRST(&line_h)) && (budget == 0 || now - begin < budget))
+    {
+        TAILQ_REMOVE(&line_h, l, lines);
+        queued--;
+
+        bot_shedding = l->prio == PRIO_LOW && (queued >= shed_backlog || now - l->recv_end > shed_latency * 1000000UL);
+        if (bot_shedding)
+        {
+            metrics_add(shed, 1);
         }
 
-        off = len - (last - buf);
-        if (off > BUF_SIZE - 1)
+        server_dispatch(l->line, l->recv_start, l->recv_end);
+        bot_shedding = 0;
+
+        pool_put(&line_pool, l);
+        now = metrics_now();
+    }
+
+    metrics_set(queued_gauge, queued);
+
+    if (queued)
+    {
+        bot_wakeup();
+    }
+}
+
+/* a new connection doesn't get what the old one left */
+static void server_queue_clear()
+{
+    struct server_line *l;
+
+    while ((l = TAILQ_FIRST(&line_h)))
+    {
+        TAILQ_REMOVE(&line_h, l, lines);
+        pool_put(&line_pool, l);
+    }
+
+    queued = 0;
+    metrics_set(queued_gauge, 0);
+}
+
+/* lines from other users, the same on every server, without the tags */
+static const char *server_relayed(const char *line)
+{
+    if (*line == '@')
+    {
+        line += strcspn(line, " ");
+        line += strspn(line, " ");
+    }
+
+    return *line == ':' && memchr(line, '!', strcspn(line, " ")) ? line : NULL;
+}
+
+static unsigned int server_hash(const char *line)
+{
+    unsigned int h = 2166136261U;
+
+    for (; *line; line++)
+    {
+        h ^= (unsigned char)*line;
+        h *= 16777619U;
+    }
+
+    return h ? h : 1;
+}
+
+/* a new window every dedup ms or when this one fills up, the last is forgotten */
+static void server_seen_rotate(unsigned long now)
+{
+    struct server_seen *t;
+
+    if (now - seen_rotated < dedup * 1000000UL && seen_used < seen_size / 4 * 3)
+    {
+        return;
+    }
+
+    t = seen[1];
+    seen[1] = seen[0];
+    seen[0] = t;
+    memset(seen[0], 0, seen_size * sizeof(struct server_seen));
+
+    if (now - seen_rotated >= 2 * dedup * 1000000UL)
+    {
+        memset(seen[1], 0, seen_size * sizeof(struct server_seen));
+    }
+
+    seen_used = 0;
+    seen_rotated = now;
+}
+
+static struct server_seen *server_seen_slot(struct server_seen *t, unsigned int hash)
+{
+    unsigned int i = hash & (seen_size - 1);
+
+    while (t[i].hash && t[i].hash != hash)
+    {
+        i = (i + 1) & (seen_size - 1);
+    }
+
+    return &t[i];
+}
+
+static void server_seen_add(unsigned int hash)
+{
+    struct server_seen *e;
+
+    server_seen_rotate(metrics_now());
+    e = server_seen_slot(seen[0], hash);
+
+    if (e->hash == 0)
+    {
+        e->hash = hash;
+        seen_used++;
+    }
+
+    e->count++;
+}
+
+/* 1 if the primary delivered the line, it's counted off */
+static int server_seen_take(unsigned int hash)
+{
+    struct server_seen *e;
+    int i;
+
+    server_seen_rotate(metrics_now());
+
+    for (i = 1; i >= 0; i--)
+    {
+        e = server_seen_slot(seen[i], hash);
+
+        if (e->count)
         {
-            /* discard invalid buffers */
-            off = 0;
+            e->count--;
+            return 1;
         }
-        else if (off > 0)
+    }
+
+    return 0;
+}
+
+/* on the primary, 1 if the one before it already delivered the line */
+static int server_dedup(const char *line)
+{
+    const char *relayed = server_relayed(line);
+
+    if (relayed == NULL)
+    {
+        return 0;
+    }
+
+    if (dedup_until && metrics_now() < dedup_until)
+    {
+        if (server_seen_take(server_hash(relayed)))
         {
-            memcpy(buf, last, off);
+            metrics_add(duplicates, 1);
+            return 1;
         }
+
+        return 0;
     }
-    else
+
+    dedup_until = 0;
+
+    if (standby->registered)
     {
-        log_printf("Disconnected.\n");
-        close(net_sock);
-        bot_unregister_fd();
-        net_sock = 0;
-        connected = 0;
-        server_last_connect = time(NULL);
+        server_seen_add(server_hash(relayed));
     }
+
+    return 0;
 }
 
-void server_free()
+static void server_standby_trim(unsigned long now)
 {
-    struct cb_entry *e;
-    while ( (e = TAILQ_FIRST(&cb_h)) )
+    struct server_line *l;
+
+    while ((l = TAILQ_FIRST(&standby_h)) && (standby_lines >= inbound_max || now - l->recv_end > dedup * 1000000UL))
+    {
+        TAILQ_REMOVE(&standby_h, l, lines);
+        pool_put(&line_pool, l);
+        standby_lines--;
+    }
+}
+
+/* kept unless the primary delivered it already, watching for the primary to quit */
+static void server_standby_line(const char *line, unsigned long recv_start, unsigned long recv_end)
+{
+    const char *relayed = server_relayed(line);
+    struct server_line *l;
+    int len;
+
+    if (relayed == NULL)
+    {
+        return;
+    }
+
+    len = strcspn(relayed + 1, "!");
+
+    if (strncmp(server_command(relayed), "QUIT", 4) == 0 && conns[0].connected && len == (int)strlen(conns[0].nick) &&
+            strncasecmp(relayed + 1, conns[0].nick, len) == 0)
+    {
+        failover = 1;
+        return;
+    }
+
+    if (server_seen_take(server_hash(relayed)))
+    {
+        return;
+    }
+
+    server_standby_trim(recv_end);
+
+    if ((l = pool_get(&line_pool)) == NULL)
+    {
+        return;
+    }
+
+    l->prio = PRIO_NORMAL;
+    l->recv_start = recv_start;
+    l->recv_end = recv_end;
+    snprintf(l->line, sizeof(l->line), "%s", line);
+
+    TAILQ_INSERT_TAIL(&standby_h, l, lines);
+    standby_lines++;
+}
+
+/* what the primary is called, the standby watches for it to quit */
+static void server_conn_track(struct server_conn *c, const char *line)
+{
+    const char *command = server_command(line);
+    int len = strlen(c->nick);
+
+    if (strncmp(command, "001 ", 4) == 0)
+    {
+        snprintf(c->nick, sizeof(c->nick), "%.*s", (int)strcspn(command + 4, " "), command + 4);
+    }
+    else if (strncmp(command, "NICK ", 5) == 0 && *line == ':' && strncasecmp(line + 1, c->nick, len) == 0 && line[len + 1] == '!')
     {
-        TAILQ_REMOVE(&cb_h, e, cb_entries);
-        free(e);
+        command += 5 + (command[5] == ':');
+        snprintf(c->nick, sizeof(c->nick), "%.*s", (int)strcspn(command, " "), command);
     }
+}
+
+/*
+ * The standby takes the primary's place, which is left in the standby's
+ * to be closed and connected again as the standby.
+ */
+static void server_promote()
+{
+    struct server_conn tmp;
+    struct server_line *l;
+    METRIC sent = conns[0].sent, lag = conns[0].lag_gauge;
+    char line[BUF_SIZE];
+    unsigned long now;
+
+    /* what the primary got comes first */
+    server_drain(0);
+
+    tmp = conns[0];
+    conns[0] = *standby;
+    *standby = tmp;
+
+    standby->sent = conns[0].sent;
+    standby->lag_gauge = conns[0].lag_gauge;
+    standby->index = pool_size;
+    conns[0].sent = sent;
+    conns[0].lag_gauge = lag;
+    conns[0].index = 0;
+    conns[0].registered = 0;
+
+    log_lprintf(LOG_WARN, "Failing over to %s as %s.\n", config_get(conns[0].alt ? "standby_host" : "host"), conns[0].nick);
+    metrics_add(failovers, 1);
+
+    now = metrics_now();
+
+    /* everyone knows us by the standby's nick now */
+    if (*standby->nick && strcasecmp(standby->nick, conns[0].nick))
+    {
+        snprintf(line, sizeof(line), ":%s NICK :%s", standby->nick, conns[0].nick);
+        server_dispatch(line, now, now);
+    }
+
+    server_standby_nick(standby);
+
+    /* the standby heard these first, unless the primary caught up since */
+    while ((l = TAILQ_FIRST(&standby_h)))
+    {
+        TAILQ_REMOVE(&standby_h, l, lines);
+        standby_lines--;
+
+        if (now - l->recv_end <= dedup * 1000000UL && !server_seen_take(server_hash(server_relayed(l->line))))
+        {
+            server_dispatch(l->line, l->recv_start, l->recv_end);
+            metrics_add(replayed, 1);
+        }
+
+        pool_put(&line_pool, l);
+    }
+
+    dedup_until = metrics_now() + dedup * 1000000UL;
+}
+
+/* 1 if the line answers one of our lag probes */
+static int server_conn_pong(struct server_conn *c, const char *command)
+{
+    const char *probe;
+
+    if (strncmp(command, "PONG ", 5) || (probe = strstr(command, PROBE)) == NULL)
+    {
+        return 0;
+    }
+
+    c->lag = metrics_now() - strtoul(probe + strlen(PROBE), NULL, 10);
+    c->ping_sent = 0;
+    metrics_set(c->lag_gauge, c->lag / 1e9);
+
+    return 1;
+}
+
+/* the little a secondary needs to stay registered */
+static void server_conn_line(struct server_conn *c, const char *line)
+{
+    char buf[128];
+    const char *command = server_command(line);
+
+    if (server_conn_pong(c, command))
+    {
+        return;
+    }
+
+    if (strncmp(command, "PING ", 5) == 0)
+    {
+        snprintf(buf, sizeof(buf), "PONG %s\r\n", command + 5);
+        server_conn_send(c, buf);
+    }
+    else if (strncmp(command, "001 ", 4) == 0)
+    {
+        c->registered = 1;
+        c->backoff = 0;
+        log_printf("Connection %d registered as %s.\n", c->index, c->nick);
+        server_conn_join(c);
+    }
+    else if (strncmp(command, "433 ", 4) == 0 && !c->registered && strlen(c->nick) + 1 < sizeof(c->nick))
+    {
+        strcat(c->nick, "_");
+        snprintf(buf, sizeof(buf), "NICK %s\r\n", c->nick);
+        server_conn_send(c, buf);
+    }
+    else if (strncmp(command, "ERROR ", 6) == 0)
+    {
+        log_lprintf(LOG_WARN, "Connection %d: %s\n", c->index, command);
+    }
+}
+
+/* the next attempt is after a random time between half and all of the backoff */
+static void server_conn_close(struct server_conn *c)
+{
+    /* only once registered, the callbacks need to know who we were */
+    if (c->index == 0 && c->connected && *c->nick && standby && standby->registered)
+    {
+        server_promote();
+        c = standby;
+    }
+    else if (c->index == 0)
+    {
+        *c->nick = '\0';
+    }
+
+    if (c->sock)
+    {
+        bot_unregister_fd(c->sock);
+        close(c->sock);
+    }
+
+    c->sock = 0;
+    c->connected = 0;
+    c->connecting = 0;
+    c->registered = 0;
+    c->off = 0;
+    c->ping_sent = 0;
+
+    if (c->index == 0)
+    {
+        server_queue_clear();
+    }
+
+    c->backoff = c->backoff ? c->backoff * 2 : reconnect_min;
+    c->backoff = c->backoff > reconnect_max ? reconnect_max : c->backoff;
+    c->next_connect = time(NULL) + c->backoff / 2 + rand() % (c->backoff - c->backoff / 2 + 1);
+
+    metrics_set(c->lag_gauge, 0);
+}
+
+static void server_conn_up(struct server_conn *c)
+{
+    char buf[256];
+
+    /* blocking again, output goes out whole like it always did */
+    fcntl(c->sock, F_SETFL, fcntl(c->sock, F_GETFL) & ~O_NONBLOCK);
+    bot_want_write(c->sock, 0);
+
+    c->connected = 1;
+    c->connecting = 0;
+    c->off = 0;
+    c->last_recv = time(NULL);
+    c->last_ping = c->last_recv;
+
+    if (c->index == 0)
+    {
+        connection++;
+        log_printf("Connected.\n");
+    }
+    else
+    {
+        log_printf("Connection %d connected.\n", c->index);
+        snprintf(buf, sizeof(buf), "NICK %s\r\nUSER %s * * :%s\r\n", c->nick, c->nick, c->nick);
+        server_conn_send(c, buf);
+    }
+}
+
+/* a non-blocking connect finished one way or the other */
+static void server_conn_check(struct server_conn *c)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+    {
+        log_lprintf(LOG_ERROR, "Error: %s\n", strerror(err ? err : errno));
+        server_conn_close(c);
+        return;
+    }
+
+    server_conn_up(c);
+}
+
+int server_init(CTX ctx)
+{
+    char key[32], labels[32];
+    const char *saved;
+    struct server_conn *c;
+    int fd, i;
+
+    server_ctx = ctx;
+
+    TAILQ_INIT(&cb_h);
+    pool_init(&cb_pool, sizeof(struct cb_entry));
+    TAILQ_INIT(&channel_h);
+    pool_init(&channel_pool, sizeof(struct server_channel));
+    TAILQ_INIT(&line_h);
+    TAILQ_INIT(&standby_h);
+    pool_init(&line_pool, sizeof(struct server_line));
+    queued = 0;
+
+    recv_bytes = metrics_counter("corebot_server_received_bytes_total", NULL);
+    recv_lines = metrics_counter("corebot_server_received_lines_total", NULL);
+    send_bytes = metrics_counter("corebot_server_sent_bytes_total", NULL);
+    send_lines = metrics_counter("corebot_server_sent_lines_total", NULL);
+    reconnects = metrics_counter("corebot_server_connects_total", NULL);
+    failovers = metrics_counter("corebot_server_failovers_total", NULL);
+    replayed = metrics_counter("corebot_server_standby_replayed_lines_total", NULL);
+    duplicates = metrics_counter("corebot_server_duplicate_lines_total", NULL);
+    queued_gauge = metrics_gauge("corebot_server_inbound_queued_lines", NULL);
+    deferred = metrics_counter("corebot_server_deferred_lines_total", NULL);
+    critical = metrics_counter("corebot_server_critical_lines_total", NULL);
+    shed = metrics_counter("corebot_server_shed_lines_total", NULL);
+
+    if ((saved = config_get("inbound_budget_ms")) && atoi(saved) > 0)
+    {
+        inbound_budget = atoi(saved);
+    }
+
+    if ((saved = config_get("inbound_max")) && atoi(saved) > 0)
+    {
+        inbound_max = atoi(saved);
+    }
+
+    if ((saved = config_get("shed_backlog")) && atoi(saved) > 0)
+    {
+        shed_backlog = atoi(saved);
+    }
+
+    if ((saved = config_get("shed_latency_ms")) && atoi(saved) > 0)
+    {
+        shed_latency = atoi(saved);
+    }
+
+    if ((saved = config_get("ping_interval")))
+    {
+        ping_interval = atoi(saved);
+    }
+
+    if ((saved = config_get("dead_timeout")))
+    {
+        dead_timeout = atoi(saved);
+    }
+
+    if ((saved = config_get("connect_timeout")) && atoi(saved) > 0)
+    {
+        connect_timeout = atoi(saved);
+    }
+
+    if ((saved = config_get("reconnect_min")) && atoi(saved) > 0)
+    {
+        reconnect_min = atoi(saved);
+    }
+
+    if ((saved = config_get("reconnect_max")) && atoi(saved) >= reconnect_min)
+    {
+        reconnect_max = atoi(saved);
+    }
+
+    srand(time(NULL) ^ getpid());
+
+    if ((saved = config_get("pool")) && atoi(saved) > 1)
+    {
+        pool_size = atoi(saved) < SERVER_POOL ? atoi(saved) : SERVER_POOL;
+    }
+
+    nconns = pool_size;
+
+    if (config_get("standby_host"))
+    {
+        standby = &conns[nconns++];
+
+        if ((saved = config_get("dedup_ms")) && atoi(saved) > 0)
+        {
+            dedup = atoi(saved);
+        }
+
+        /* a power of two */
+        if ((saved = config_get("dedup_size")) && atoi(saved) > 0)
+        {
+            for (seen_size = 64; seen_size < atoi(saved); seen_size *= 2);
+        }
+
+        seen[0] = bot_calloc(seen_size, sizeof(struct server_seen));
+        seen[1] = bot_calloc(seen_size, sizeof(struct server_seen));
+    }
+
+    for (i = 0; i < nconns; i++)
+    {
+        c = &conns[i];
+        memset(c, 0, sizeof(struct server_conn));
+        c->index = i;
+        c->alt = c == standby;
+
+        snprintf(labels, sizeof(labels), "conn=\"%d\"", i);
+        c->sent = metrics_counter("corebot_server_conn_sent_lines_total", labels);
+        c->lag_gauge = metrics_gauge("corebot_server_lag_seconds", labels);
+
+        if (c == standby)
+        {
+            server_standby_nick(c);
+        }
+        else if (i > 0)
+        {
+            server_conn_nick(c);
+        }
+
+        /* still connected from before an upgrade, the primary keeps the old keys */
+        snprintf(key, sizeof(key), i ? "sock%d" : "sock", i);
+        if ((fd = handoff_get_fd(key)) < 0)
+        {
+            continue;
+        }
+
+        c->sock = fd;
+        c->connected = 1;
+        c->last_recv = time(NULL);
+        c->last_ping = c->last_recv;
+        connection += i == 0;
+
+        snprintf(key, sizeof(key), i ? "buf%d" : "buf", i);
+        if ((saved = handoff_get(key, &c->off)) == NULL || c->off >= BUF_SIZE)
+        {
+            c->off = 0;
+        }
+        memcpy(c->buf, saved, c->off);
+
+        snprintf(key, sizeof(key), i ? "nick%d" : "nick", i);
+        if ((saved = handoff_get(key, NULL)))
+        {
+            snprintf(c->nick, sizeof(c->nick), "%s", saved);
+            c->registered = i > 0;
+        }
+
+        /* the primary may be where the standby used to be */
+        if (i == 0 && standby && handoff_get("alt", NULL))
+        {
+            c->alt = 1;
+            standby->alt = 0;
+        }
+
+        bot_register_fd(c->sock);
+        log_printf("Resumed connection %d.\n", i);
+    }
+
+    if ((saved = handoff_get("channels", NULL)))
+    {
+        server_channels(saved, 1);
+    }
+
+    return 1;
+}
+
+void server_save()
+{
+    struct server_channel *ch;
+    char key[32];
+    char *buf, *p;
+    int i, len = 6;
+
+    /* the next process starts with an empty queue */
+    server_drain(0);
+
+    for (i = 0; i < nconns; i++)
+    {
+        if (conns[i].connected)
+        {
+            snprintf(key, sizeof(key), i ? "sock%d" : "sock", i);
+            handoff_fd(key, conns[i].sock);
+            snprintf(key, sizeof(key), i ? "buf%d" : "buf", i);
+            handoff_set(key, conns[i].buf, conns[i].off);
+
+            if ((i == 0 && *conns[i].nick) || conns[i].registered)
+            {
+                snprintf(key, sizeof(key), i ? "nick%d" : "nick", i);
+                handoff_set(key, conns[i].nick, -1);
+            }
+        }
+    }
+
+    if (conns[0].alt)
+    {
+        handoff_set("alt", "1", -1);
+    }
+
+    /* saved as the JOIN line that would join them all */
+    TAILQ_FOREACH(ch, &channel_h, channels)
+    {
+        len += strlen(ch->name) + 1;
+    }
+
+    p = buf = bot_malloc(len);
+    p += sprintf(p, "JOIN ");
+    TAILQ_FOREACH(ch, &channel_h, channels)
+    {
+        p += sprintf(p, "%s%s", p[-1] == ' ' ? "" : ",", ch->name);
+    }
+
+    handoff_set("channels", buf, -1);
+    bot_free(buf);
+}
+
+/* where lines to a target go, the same place for as long as it's up */
+static struct server_conn *server_target(const char *target, int len)
+{
+    unsigned int h = 2166136261U;
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)(target[i] >= 'A' && target[i] <= 'Z' ? target[i] + 32 : target[i]);
+        h *= 16777619U;
+    }
+
+    return conns[h % pool_size].registered ? &conns[h % pool_size] : &conns[0];
+}
+
+/*
+ * A line to several targets is split up by connection so that each
+ * target still sees everything from one connection, in order.
+ */
+static int server_send_targets(const char *msg, int cmdlen)
+{
+    char line[BUF_SIZE];
+    const char *targets = msg + cmdlen, *rest, *t;
+    int i, len, tlen, ok = 1;
+
+    rest = targets + strcspn(targets, " ");
+
+    for (i = 0; i < pool_size; i++)
+    {
+        len = 0;
+
+        for (t = targets; t < rest; t += tlen + 1)
+        {
+            tlen = strcspn(t, ", ");
+
+            if (server_target(t, tlen) == &conns[i] && len + tlen + cmdlen + 1 < BUF_SIZE)
+            {
+                if (len == 0)
+                {
+                    memcpy(line, msg, cmdlen);
+                    len = cmdlen;
+                }
+                else
+                {
+                    line[len++] = ',';
+                }
+
+                memcpy(line + len, t, tlen);
+                len += tlen;
+            }
+
+            if (t[tlen] != ',')
+            {
+                break;
+            }
+        }
+
+        if (len > 0)
+        {
+            snprintf(line + len, BUF_SIZE - len, "%s", rest);
+            ok &= conns[i].connected && server_conn_send(&conns[i], line);
+        }
+    }
+
+    return ok;
+}
+
+int server_send(const char *msg)
+{
+    const char *target;
+    int i;
+
+    if (nconns > 1 && (strncmp(msg, "JOIN ", 5) == 0 || strncmp(msg, "PART ", 5) == 0))
+    {
+        server_channels(msg, msg[0] == 'J');
+
+        for (i = 1; i < nconns; i++)
+        {
+            if (conns[i].registered)
+            {
+                server_conn_send(&conns[i], msg);
+            }
+        }
+    }
+    else if (pool_size > 1 && (strncmp(msg, "PRIVMSG ", 8) == 0 || strncmp(msg, "NOTICE ", 7) == 0))
+    {
+        target = msg + strcspn(msg, " ") + 1;
+
+        if (target[strcspn(target, ", ")] == ',')
+        {
+            return server_send_targets(msg, target - msg);
+        }
+
+        return server_target(target, strcspn(target, " "))->connected && server_conn_send(server_target(target, strcspn(target, " ")), msg);
+    }
+
+    return conns[0].connected && server_conn_send(&conns[0], msg);
+}
+
+static void server_connect(struct server_conn *c)
+{
+    struct sockaddr_storage net_server;
+    socklen_t net_addrlen;
+    const char *host;
+    const char *port;
+
+    host = config_get(c->alt ? "standby_host" : "host");
+    port = c->alt && config_get("standby_port") ? config_get("standby_port") : config_get("port");
+
+    if (host == NULL || port == NULL)
+    {
+        log_lprintf(LOG_ERROR, "Host or port missing in config, can't connect\n");
+        c->next_connect = time(NULL) + reconnect_max;
+        return;
+    }
+
+    if (c->index == 0)
+    {
+        log_printf("Connecting to %s:%s...\n", host, port);
+    }
+    else
+    {
+        log_printf("Connecting %d to %s:%s as %s...\n", c->index, host, port, c->nick);
+    }
+
+    metrics_add(reconnects, 1);
+
+    c->sock = server_resolv(host, port, &net_server, &net_addrlen);
+
+    if (!c->sock)
+    {
+        server_conn_close(c);
+        return;
+    }
+
+    /* the loop goes on while it connects, a dead host can take minutes to give up */
+    fcntl(c->sock, F_SETFL, fcntl(c->sock, F_GETFL) | O_NONBLOCK);
+    c->connecting = 1;
+    c->last_recv = time(NULL);
+    bot_register_fd(c->sock);
+
+    if (connect(c->sock, (struct sockaddr *)&net_server, net_addrlen) == 0)
+    {
+        server_conn_up(c);
+    }
+    else if (errno == EINPROGRESS)
+    {
+        bot_want_write(c->sock, 1);
+    }
+    else
+    {
+        log_lprintf(LOG_ERROR, "Error: %s\n", strerror(errno));
+        server_conn_close(c);
+    }
+}
+
+void server_timer()
+{
+    char buf[64];
+    struct server_conn *c;
+    time_t now = time(NULL);
+    int i;
+
+    for (i = 0; i < nconns; i++)
+    {
+        c = &conns[i];
+
+        if (c->connecting && c->last_recv + connect_timeout <= now)
+        {
+            log_lprintf(LOG_ERROR, "Error: %s\n", strerror(ETIMEDOUT));
+            server_conn_close(c);
+        }
+        else if (c->connected && dead_timeout > 0 && c->last_recv + dead_timeout <= now)
+        {
+            log_lprintf(LOG_WARN, "Nothing from the server in %d seconds, reconnecting.\n", (int)(now - c->last_recv));
+            server_conn_close(c);
+        }
+        else if (c->connected && ping_interval > 0 && c->last_ping + ping_interval <= now)
+        {
+            /* every probe carries its send time, the oldest unanswered one counts as lag */
+            snprintf(buf, sizeof(buf), "PING " PROBE "%lu\r\n", metrics_now());
+            server_conn_send(c, buf);
+            c->last_ping = now;
+
+            if (c->ping_sent == 0)
+            {
+                c->ping_sent = metrics_now();
+            }
+        }
+
+        if (!c->connected && !c->connecting && c->next_connect <= now)
+        {
+            server_connect(c);
+        }
+    }
+}
+
+double server_lag()
+{
+    struct server_conn *c = &conns[0];
+    unsigned long lag = c->lag;
+
+    if (!c->connected)
+    {
+        return -1;
+    }
+
+    if (c->ping_sent && metrics_now() - c->ping_sent > lag)
+    {
+        lag = metrics_now() - c->ping_sent;
+    }
+
+    return lag / 1e9;
+}
+
+int server_connection()
+{
+    return connection;
+}
+
+void server_write(int sock)
+{
+    struct server_conn *c = server_conn(sock);
+
+    if (c && c->connecting)
+    {
+        server_conn_check(c);
+    }
+}
+
+void server_read(int read)
+{
+    int len;
+    struct server_conn *c;
+    char *buf;
+    char *line;
+    char *ptr;
+    char *last;
+    int prio, room, more;
+    unsigned long recv_start, recv_end;
+
+    /* a descriptor that isn't ours is read as the primary */
+    if ((c = server_conn(read)) == NULL)
+    {
+        c = &conns[0];
+    }
+    else if (c->connecting)
+    {
+        server_conn_check(c);
+        return;
+    }
+
+    if (c->index == 0 && queued >= inbound_max)
+    {
+        /* it stays readable, the idle hook gets to the queue */
+        return;
+    }
+
+    recv_start = metrics_now();
+
+    /* the primary reads on until the socket is empty */
+    do
+    {
+        buf = c->buf;
+        room = BUF_SIZE - c->off;
+        memset(buf + c->off, 0, room);
+
+        if ( (len = recv(read, buf + c->off, room, c->index == 0 ? MSG_DONTWAIT : 0)) > 0)
+        {
+            /* a short read emptied the socket, no need to ask again */
+            more = len == room;
+            recv_end = metrics_now();
+            metrics_add(recv_bytes, len);
+            c->last_recv = time(NULL);
+            len += c->off;
+
+            line = buf;
+            ptr = buf;
+            last = buf;
+
+            while ( (ptr = strstr(ptr, "\r\n")) )
+            {
+                *ptr++ = '\0';
+                *ptr++ = '\0';
+
+                metrics_add(recv_lines, 1);
+
+                if (c->index > 0 || server_conn_pong(c, server_command(line)))
+                {
+                    if (c == standby)
+                    {
+                        server_standby_line(line, recv_start, recv_end);
+                    }
+
+                    if (c->index > 0)
+                    {
+                        server_conn_line(c, line);
+                    }
+
+                    line = ptr;
+                    last = ptr;
+                    continue;
+                }
+
+                if (c->backoff && strncmp(server_command(line), "001 ", 4) == 0)
+                {
+                    c->backoff = 0;
+                }
+
+                if (standby)
+                {
+                    server_conn_track(c, line);
+
+                    if (server_dedup(line))
+                    {
+                        line = ptr;
+                        last = ptr;
+                        continue;
+                    }
+                }
+
+                /* only lines that might wait get classified */
+                if (queued == 0 && metrics_now() - recv_start < inbound_budget * 1000000UL)
+                {
+                    server_dispatch(line, recv_start, recv_end);
+                }
+                else if ((prio = server_priority(line)) == PRIO_CRITICAL)
+                {
+                    if (queued)
+                    {
+                        /* ahead of the backlog */
+                        metrics_add(critical, 1);
+                    }
+
+                    server_dispatch(line, recv_start, recv_end);
+                }
+                else
+                {
+                    server_queue(line, prio, recv_start, recv_end);
+                }
+
+                line = ptr;
+                last = ptr;
+            }
+
+            c->off = len - (last - buf);
+            if (c->off > BUF_SIZE - 1)
+            {
+                /* discard invalid buffers */
+                c->off = 0;
+            }
+            else if (c->off > 0)
+            {
+                memcpy(buf, last, c->off);
+            }
+        }
+        else if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        else
+        {
+            if (c->index == 0)
+            {
+                log_printf("Disconnected.\n");
+            }
+            else
+            {
+                log_printf("Connection %d disconnected.\n", c->index);
+            }
+
+            server_conn_close(c);
+            break;
+        }
+    }
+    while (c->index == 0 && more && queued < inbound_max);
+
+    if (failover)
+    {
+        failover = 0;
+        log_lprintf(LOG_WARN, "The standby saw %s quit.\n", conns[0].nick);
+        server_conn_close(&conns[0]);
+    }
+
+    metrics_set(queued_gauge, queued);
+}
+
+void server_idle()
+{
+    if (queued)
+    {
+        server_drain(inbound_budget * 1000000UL);
+    }
+}
+
+void server_free()
+{
+    int i;
+
+    TAILQ_INIT(&cb_h);
+    pool_free(&cb_pool);
+    TAILQ_INIT(&channel_h);
+    pool_free(&channel_pool);
+
+    /* no failing over on the way out */
+    for (i = nconns - 1; i >= 0; i--)
+    {
+        if (conns[i].connected)
+        {
+            server_conn_close(&conns[i]);
+        }
+    }
+
+    TAILQ_INIT(&line_h);
+    TAILQ_INIT(&standby_h);
+    pool_free(&line_pool);
 
-    if (net_sock)
+    if (standby)
     {
-        bot_unregister_fd();
-        close(net_sock);
+        bot_free(seen[0]);
+        bot_free(seen[1]);
+        standby = NULL;
     }
 }
@@ -17,4 +17,9 @@
 typedef void (*SERVER_CB)(const char *);
 void server_register_cb(SERVER_CB);
 void server_unregister_cb(SERVER_CB);
-void server_send(const char *);
+/* 1 once the whole line is written, 0 if it wasn't (or not connected) */
+int server_send(const char *);
+/* round trip to the server in seconds, -1 when not connected */
+double server_lag();
+/* counts connections, a new value means a new connection to register */
+int server_connection();
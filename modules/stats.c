@@ -0,0 +1,741 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Channel statistics.
+ *
+ * Time is cut into buckets of bucket seconds and every channel keeps the
+ * last buckets of them in a ring, so memory is fixed at max_channels
+ * times buckets times one bucket. A bucket counts lines and words, keeps
+ * the top talkers in a Space-Saving summary of STATS_TOP counters and the
+ * nicks that spoke or joined in a HyperLogLog of STATS_HLL registers.
+ * A message costs a lookup in the channel table, a scan of the counters
+ * (nicks compared by hash first) and one register update.
+ *
+ * Queries merge the buckets they cover: registers by their maximum,
+ * counters by adding up what each bucket has for the nicks any of them
+ * kept. A counter can be ahead of what its nick said by its error, so
+ * talkers are ranked by their count less the error, the lines they are
+ * known to have said at least.
+ *
+ * Everything is written to file every save_interval seconds and when
+ * unloaded, leaving out the buckets nothing happened in.
+ */
+
+#include "../bot.h"
+#include "irc.h"
+#include "cmd.h"
+
+#include <stddef.h>
+#include <errno.h>
+#include <math.h>
+#include <strings.h>
+#include <time.h>
+
+#define STATS_MAGIC     "CBST"
+#define STATS_VERSION   1
+#define STATS_TOP       32
+#define STATS_NICK      32
+#define STATS_HLL_BITS  10
+#define STATS_HLL       (1 << STATS_HLL_BITS)
+#define STATS_NAME      64
+
+struct stats_talker
+{
+    unsigned int hash;
+    unsigned int count;
+    unsigned int error;         /* what the counter had when the nick took it over */
+    char nick[STATS_NICK];
+};
+
+struct stats_bucket
+{
+    unsigned int start;         /* 0 for a bucket nothing happened in */
+    unsigned int lines;
+    unsigned int words;
+    unsigned int talkers;
+    struct stats_talker top[STATS_TOP];
+    unsigned char hll[STATS_HLL];
+};
+
+struct stats_channel
+{
+    char name[STATS_NAME];
+    struct stats_bucket *buckets;
+};
+
+struct stats_hdr
+{
+    char magic[4];
+    unsigned int version;
+    unsigned int bucket;
+    unsigned int buckets;
+    unsigned int channels;
+    unsigned int top;
+    unsigned int hll;
+};
+
+CTX stats_ctx = NULL;
+
+static struct stats_channel *channels = NULL;
+static int nchannels = 0;
+static int *index_h = NULL;             /* channel + 1 by name hash, power of two */
+static int index_size = 0;
+static struct stats_bucket *bucket_mem = NULL;
+
+static int max_channels = 64;
+static int buckets = 24;
+static int bucket_len = 3600;
+static int top_shown = 5;
+static char file[256] = "stats.dat";
+static int save_interval = 300;
+static time_t next_save = 0;
+static int dirty = 0;
+static int have_cmd = 0;
+static int full_logged = 0;
+
+static METRIC channels_gauge;
+static METRIC counted;
+static METRIC dropped;
+
+/* case folded, mixed well enough for the register index to take the top bits */
+static unsigned int stats_hash(const char *s, int len)
+{
+    unsigned int h = 2166136261U;
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)(s[i] >= 'A' && s[i] <= 'Z' ? s[i] + 32 : s[i]);
+        h *= 16777619U;
+    }
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static struct stats_channel *stats_channel(const char *name, int create)
+{
+    unsigned int i = stats_hash(name, strlen(name)) & (index_size - 1);
+    struct stats_channel *ch;
+
+    while (index_h[i])
+    {
+        if (strcasecmp(channels[index_h[i] - 1].name, name) == 0)
+        {
+            return &channels[index_h[i] - 1];
+        }
+
+        i = (i + 1) & (index_size - 1);
+    }
+
+    if (!create || strlen(name) >= STATS_NAME)
+    {
+        return NULL;
+    }
+
+    if (nchannels == max_channels)
+    {
+        if (!full_logged)
+        {
+            log_lprintf(LOG_WARN, "Not counting %s, max_channels (%d) reached\n", name, max_channels);
+            full_logged = 1;
+        }
+
+        metrics_add(dropped, 1);
+        return NULL;
+    }
+
+    ch = &channels[nchannels];
+    snprintf(ch->name, sizeof(ch->name), "%s", name);
+    ch->buckets = bucket_mem + (size_t)nchannels * buckets;
+    index_h[i] = ++nchannels;
+    metrics_set(channels_gauge, nchannels);
+
+    return ch;
+}
+
+/* the bucket now falls into, emptied if it still holds an older one */
+static struct stats_bucket *stats_bucket(struct stats_channel *ch, time_t now)
+{
+    unsigned int start = now - now % bucket_len;
+    struct stats_bucket *b = &ch->buckets[(now / bucket_len) % buckets];
+
+    if (b->start != start)
+    {
+        memset(b, 0, sizeof(*b));
+        b->start = start;
+    }
+
+    return b;
+}
+
+static void stats_hll_add(unsigned char *hll, unsigned int h)
+{
+    unsigned int rest = h << STATS_HLL_BITS;
+    unsigned char rank = 1;
+
+    while (rank <= 32 - STATS_HLL_BITS && !(rest & 0x80000000U))
+    {
+        rest <<= 1;
+        rank++;
+    }
+
+    if (rank > hll[h >> (32 - STATS_HLL_BITS)])
+    {
+        hll[h >> (32 - STATS_HLL_BITS)] = rank;
+    }
+}
+
+static double stats_hll_estimate(const unsigned char *hll)
+{
+    double m = STATS_HLL, sum = 0, e;
+    int i, zeros = 0;
+
+    for (i = 0; i < STATS_HLL; i++)
+    {
+        sum += 1.0 / (1UL << hll[i]);
+        zeros += hll[i] == 0;
+    }
+
+    e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+    /* small counts are better told by the empty registers */
+    if (e <= 2.5 * m && zeros)
+    {
+        e = m * log(m / zeros);
+    }
+
+    return e;
+}
+
+/* Space-Saving: a nick that isn't counted takes over the smallest counter */
+static void stats_talk(struct stats_bucket *b, const char *nick, int len, unsigned int hash)
+{
+    struct stats_talker *t, *min = NULL;
+    unsigned int i;
+
+    for (i = 0; i < b->talkers; i++)
+    {
+        t = &b->top[i];
+
+        if (t->hash == hash && strncasecmp(t->nick, nick, len) == 0 && t->nick[len] == '\0')
+        {
+            t->count++;
+            return;
+        }
+
+        if (min == NULL || t->count < min->count)
+        {
+            min = t;
+        }
+    }
+
+    if (b->talkers < STATS_TOP)
+    {
+        t = &b->top[b->talkers++];
+        t->count = 0;
+    }
+    else
+    {
+        t = min;
+    }
+
+    t->hash = hash;
+    t->error = t->count;
+    t->count++;
+    snprintf(t->nick, sizeof(t->nick), "%.*s", len, nick);
+}
+
+void stats_irc(const char *prefix, const char *command, const char *params, const char *trail)
+{
+    struct stats_channel *ch;
+    struct stats_bucket *b;
+    const char *channel, *p;
+    unsigned int hash;
+    int len, msg;
+
+    if (prefix == NULL)
+    {
+        return;
+    }
+
+    if ((msg = strcmp(command, "PRIVMSG") == 0))
+    {
+        channel = params;
+    }
+    else if (strcmp(command, "JOIN") == 0)
+    {
+        channel = params ? params : trail;
+    }
+    else
+    {
+        return;
+    }
+
+    if (channel == NULL || strchr("#&+!", channel[0]) == NULL || strchr(channel, ' ') || (ch = stats_channel(channel, 1)) == NULL)
+    {
+        return;
+    }
+
+    len = strcspn(prefix, "!");
+    hash = stats_hash(prefix, len);
+    b = stats_bucket(ch, time(NULL));
+    stats_hll_add(b->hll, hash);
+
+    if (msg)
+    {
+        b->lines++;
+
+        for (p = trail ? trail : ""; *p; )
+        {
+            p += strspn(p, " ");
+            b->words += *p != '\0';
+            p += strcspn(p, " ");
+        }
+
+        stats_talk(b, prefix, len < STATS_NICK ? len : STATS_NICK - 1, hash);
+        metrics_add(counted, 1);
+    }
+
+    dirty = 1;
+}
+
+/* the buckets of the last hours, all of them for 0 */
+static int stats_covered(struct stats_bucket *b, int hours, time_t now)
+{
+    unsigned int span = hours > 0 ? (unsigned int)hours * 3600 : (unsigned int)buckets * bucket_len;
+
+    if (span > (unsigned int)buckets * bucket_len)
+    {
+        span = buckets * bucket_len;
+    }
+
+    return b->start && b->start + bucket_len > now - span && b->start <= now;
+}
+
+/* where a reply goes and what it's about, NULL if not in a channel */
+static struct stats_channel *stats_query(const char *nick, const char *target, int argc, char **argv, int *hours, char *span, int len)
+{
+    struct stats_channel *ch;
+
+    if (strchr("#&+!", *target) == NULL)
+    {
+        irc_printf("NOTICE %s :Ask in a channel.\r\n", nick);
+        return NULL;
+    }
+
+    *hours = argc > 0 ? atoi(argv[0]) : 0;
+
+    if (*hours > 0 && *hours < (buckets * bucket_len + 3599) / 3600)
+    {
+        snprintf(span, len, "last %dh", *hours);
+    }
+    else
+    {
+        *hours = 0;
+        snprintf(span, len, "last %dh", buckets * bucket_len / 3600 ? buckets * bucket_len / 3600 : 1);
+    }
+
+    if ((ch = stats_channel(target, 0)) == NULL)
+    {
+        irc_printf("PRIVMSG %s :Nothing counted in %s yet.\r\n", target, target);
+    }
+
+    return ch;
+}
+
+static int stats_talker_cmp(const void *a, const void *b)
+{
+    const struct stats_talker *x = a, *y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+/* !top [hours] */
+static void stats_top(const char *nick, const char *target, int argc, char **argv)
+{
+    struct stats_channel *ch;
+    struct stats_talker *all, *t;
+    char span[32], buf[400];
+    time_t now = time(NULL);
+    int hours, i, j, k, n = 0, len = 0;
+
+    if ((ch = stats_query(nick, target, argc, argv, &hours, span, sizeof(span))) == NULL)
+    {
+        return;
+    }
+
+    all = bot_calloc(buckets * STATS_TOP, sizeof(struct stats_talker));
+
+    /* every nick some bucket kept, with what the others have for it */
+    for (i = 0; i < buckets; i++)
+    {
+        if (!stats_covered(&ch->buckets[i], hours, now))
+        {
+            continue;
+        }
+
+        for (j = 0; j < (int)ch->buckets[i].talkers; j++)
+        {
+            t = &ch->buckets[i].top[j];
+
+            for (k = 0; k < n && (all[k].hash != t->hash || strcasecmp(all[k].nick, t->nick)); k++);
+
+            if (k == n)
+            {
+                all[n] = *t;
+                all[n++].count = 0;
+            }
+
+            all[k].count += t->count - t->error;
+        }
+    }
+
+    qsort(all, n, sizeof(struct stats_talker), stats_talker_cmp);
+
+    for (i = 0; i < n && i < top_shown; i++)
+    {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%s %u", i ? ", " : "", all[i].nick, all[i].count);
+
+        if (len >= (int)sizeof(buf))
+        {
+            break;
+        }
+    }
+
+    bot_free(all);
+
+    if (n == 0)
+    {
+        irc_printf("PRIVMSG %s :Nobody talked in %s (%s).\r\n", target, ch->name, span);
+    }
+    else
+    {
+        irc_printf("PRIVMSG %s :Top talkers in %s (%s): %s\r\n", target, ch->name, span, buf);
+    }
+}
+
+/* !uniques [hours] */
+static void stats_uniques(const char *nick, const char *target, int argc, char **argv)
+{
+    struct stats_channel *ch;
+    unsigned char hll[STATS_HLL];
+    char span[32];
+    time_t now = time(NULL);
+    int hours, i, j;
+
+    if ((ch = stats_query(nick, target, argc, argv, &hours, span, sizeof(span))) == NULL)
+    {
+        return;
+    }
+
+    memset(hll, 0, sizeof(hll));
+
+    for (i = 0; i < buckets; i++)
+    {
+        if (stats_covered(&ch->buckets[i], hours, now))
+        {
+            for (j = 0; j < STATS_HLL; j++)
+            {
+                hll[j] = ch->buckets[i].hll[j] > hll[j] ? ch->buckets[i].hll[j] : hll[j];
+            }
+        }
+    }
+
+    irc_printf("PRIVMSG %s :About %.0f different nicks in %s (%s).\r\n", target, stats_hll_estimate(hll), ch->name, span);
+}
+
+/* !activity [hours] */
+static void stats_activity(const char *nick, const char *target, int argc, char **argv)
+{
+    struct stats_channel *ch;
+    struct stats_bucket *b;
+    char span[32], buf[400];
+    unsigned long lines = 0, words = 0, period = time(NULL) / bucket_len;
+    int hours, shown, i, len = 0;
+
+    if ((ch = stats_query(nick, target, argc, argv, &hours, span, sizeof(span))) == NULL)
+    {
+        return;
+    }
+
+    shown = hours ? (hours * 3600 + bucket_len - 1) / bucket_len : buckets;
+
+    /* oldest first, a bucket holding an older period counts as empty */
+    for (i = shown - 1; i >= 0; i--)
+    {
+        b = &ch->buckets[(period - i) % buckets];
+
+        if (b->start != (period - i) * bucket_len)
+        {
+            b = NULL;
+        }
+
+        lines += b ? b->lines : 0;
+        words += b ? b->words : 0;
+
+        if (len < (int)sizeof(buf))
+        {
+            len += snprintf(buf + len, sizeof(buf) - len, " %u", b ? b->lines : 0);
+        }
+    }
+
+    irc_printf("PRIVMSG %s :Lines in %s per %d min (%s):%s, %lu lines, %lu words\r\n", target, ch->name, bucket_len / 60,
+            span, buf, lines, words);
+}
+
+static void stats_write()
+{
+    struct stats_hdr hdr;
+    struct stats_bucket *b;
+    char tmp[512];
+    unsigned int used;
+    FILE *fh;
+    int i, j;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+
+    if ((fh = fopen(tmp, "w")) == NULL)
+    {
+        log_lprintf(LOG_ERROR, "Error creating %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, STATS_MAGIC, 4);
+    hdr.version = STATS_VERSION;
+    hdr.bucket = bucket_len;
+    hdr.buckets = buckets;
+    hdr.channels = nchannels;
+    hdr.top = STATS_TOP;
+    hdr.hll = STATS_HLL;
+    fwrite(&hdr, sizeof(hdr), 1, fh);
+
+    /* name, how many buckets follow, then each as its slot, counts, talkers and registers */
+    for (i = 0; i < nchannels; i++)
+    {
+        for (j = 0, used = 0; j < buckets; j++)
+        {
+            used += channels[i].buckets[j].start != 0;
+        }
+
+        fwrite(channels[i].name, STATS_NAME, 1, fh);
+        fwrite(&used, sizeof(used), 1, fh);
+
+        for (j = 0; j < buckets; j++)
+        {
+            b = &channels[i].buckets[j];
+
+            if (b->start)
+            {
+                used = j;
+                fwrite(&used, sizeof(used), 1, fh);
+                fwrite(b, offsetof(struct stats_bucket, top), 1, fh);
+                fwrite(b->top, sizeof(struct stats_talker), b->talkers, fh);
+                fwrite(b->hll, STATS_HLL, 1, fh);
+            }
+        }
+    }
+
+    if (fflush(fh) != 0 || ferror(fh))
+    {
+        log_lprintf(LOG_ERROR, "Error writing %s: %s\n", tmp, strerror(errno));
+        fclose(fh);
+        remove(tmp);
+        return;
+    }
+
+    fclose(fh);
+    rename(tmp, file);
+    dirty = 0;
+}
+
+static void stats_read()
+{
+    struct stats_hdr hdr;
+    struct stats_channel *ch;
+    struct stats_bucket b;
+    char name[STATS_NAME];
+    unsigned int used, slot;
+    FILE *fh;
+    int i;
+
+    if ((fh = fopen(file, "r")) == NULL)
+    {
+        return;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, fh) != 1 || memcmp(hdr.magic, STATS_MAGIC, 4) != 0 || hdr.version != STATS_VERSION ||
+            hdr.top != STATS_TOP || hdr.hll != STATS_HLL)
+    {
+        log_lprintf(LOG_WARN, "Ignoring %s, not a stats file of this version\n", file);
+        fclose(fh);
+        return;
+    }
+
+    /* counts for other buckets don't fit */
+    if (hdr.bucket != (unsigned int)bucket_len || hdr.buckets != (unsigned int)buckets)
+    {
+        log_lprintf(LOG_WARN, "Ignoring %s, saved with other buckets\n", file);
+        fclose(fh);
+        return;
+    }
+
+    while (hdr.channels-- && fread(name, STATS_NAME, 1, fh) == 1 && fread(&used, sizeof(used), 1, fh) == 1)
+    {
+        name[STATS_NAME - 1] = '\0';
+        ch = stats_channel(name, 1);
+
+        for (i = 0; i < (int)used; i++)
+        {
+            memset(&b, 0, sizeof(b));
+
+            if (fread(&slot, sizeof(slot), 1, fh) != 1 || fread(&b, offsetof(struct stats_bucket, top), 1, fh) != 1 ||
+                    b.talkers > STATS_TOP || fread(b.top, sizeof(struct stats_talker), b.talkers, fh) != b.talkers ||
+                    fread(b.hll, STATS_HLL, 1, fh) != 1 || slot >= (unsigned int)buckets)
+            {
+                log_lprintf(LOG_WARN, "%s is cut short\n", file);
+                fclose(fh);
+                return;
+            }
+
+            if (ch)
+            {
+                ch->buckets[slot] = b;
+            }
+        }
+    }
+
+    fclose(fh);
+}
+
+int stats_init(CTX ctx)
+{
+    const char *s;
+
+    stats_ctx = ctx;
+
+    if (bot_require("irc", 1) < 1)
+    {
+        log_printf("irc module required\n");
+        return -1;
+    }
+
+    if ((s = config_get("max_channels")) && atoi(s) > 0)
+    {
+        max_channels = atoi(s);
+    }
+
+    if ((s = config_get("buckets")) && atoi(s) > 0)
+    {
+        buckets = atoi(s);
+    }
+
+    if ((s = config_get("bucket")) && atoi(s) >= 60)
+    {
+        bucket_len = atoi(s);
+    }
+
+    if ((s = config_get("top")) && atoi(s) > 0)
+    {
+        top_shown = atoi(s);
+    }
+
+    if ((s = config_get("file")))
+    {
+        snprintf(file, sizeof(file), "%s", s);
+    }
+
+    if ((s = config_get("save_interval")) && atoi(s) > 0)
+    {
+        save_interval = atoi(s);
+    }
+
+    for (index_size = 16; index_size < max_channels * 2; index_size *= 2);
+
+    channels = bot_calloc(max_channels, sizeof(struct stats_channel));
+    index_h = bot_calloc(index_size, sizeof(int));
+    bucket_mem = bot_calloc((size_t)max_channels * buckets, sizeof(struct stats_bucket));
+
+    channels_gauge = metrics_gauge("corebot_stats_channels", NULL);
+    counted = metrics_counter("corebot_stats_lines_total", NULL);
+    dropped = metrics_counter("corebot_stats_dropped_lines_total", NULL);
+
+    stats_read();
+    next_save = time(NULL) + save_interval;
+
+    irc_register_cb(stats_irc);
+
+    if (bot_require("cmd", 1) >= 1)
+    {
+        cmd_register("top", "[hours]", stats_top);
+        cmd_register("uniques", "[hours]", stats_uniques);
+        cmd_register("activity", "[hours]", stats_activity);
+        have_cmd = 1;
+    }
+
+    return 1;
+}
+
+void stats_timer()
+{
+    time_t now = time(NULL);
+
+    if (now >= next_save)
+    {
+        next_save = now + save_interval;
+
+        if (dirty)
+        {
+            stats_write();
+        }
+    }
+}
+
+/* an upgrade finds it all in the file */
+void stats_save()
+{
+    if (dirty)
+    {
+        stats_write();
+    }
+}
+
+void stats_free()
+{
+    irc_unregister_cb(stats_irc);
+
+    if (have_cmd)
+    {
+        cmd_unregister_cb(stats_top);
+        cmd_unregister_cb(stats_uniques);
+        cmd_unregister_cb(stats_activity);
+    }
+
+    if (dirty)
+    {
+        stats_write();
+    }
+
+    bot_free(channels);
+    bot_free(index_h);
+    bot_free(bucket_mem);
+}
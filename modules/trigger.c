@@ -0,0 +1,570 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * PRIVMSG trigger engine.
+ *
+ * All literal patterns are compiled into one Aho-Corasick automaton with a
+ * full transition table over a compressed alphabet (only bytes that occur
+ * in some pattern get their own column), so every message is scanned once
+ * no matter how many patterns are registered. Matching is done on the
+ * lowercased text, case sensitive patterns are verified on a hit.
+ *
+ * A regex pattern contributes the longest literal every match must
+ * contain to the same automaton and regexec() only runs on messages where
+ * that literal was found. Regexes without such a literal are run on every
+ * message.
+ *
+ * Changes only mark the automaton dirty, it is rebuilt once before the
+ * next message is matched.
+ */
+
+#include "../bot.h"
+#include "irc.h"
+#include "trigger.h"
+
+#include <ctype.h>
+#include <regex.h>
+
+#define TRIGGER_MATCHES 64
+
+struct trigger
+{
+    int id;
+    int flags;
+    int removed;
+    int len;                    /* of literal */
+    char *pattern;
+    char *literal;              /* lowercased, NULL for a regex without one */
+    regex_t re;
+    TRIGGER_CB cb;
+    CTX ctx;
+    unsigned long seen;         /* last message it was a regex candidate for */
+    struct trigger *next_out;   /* next trigger ending in the same state */
+    TAILQ_ENTRY(trigger) triggers;
+};
+
+struct trigger_match
+{
+    struct trigger *t;
+    int offset;
+    int len;
+};
+
+CTX trigger_ctx = NULL;
+
+static TAILQ_HEAD(_trigger_head, trigger) trigger_h;
+static int next_id = 1;
+static int dirty = 0;
+static unsigned long generation = 0;
+
+/* automaton */
+static unsigned char map[256];          /* byte -> column */
+static int columns = 0;
+static int states = 0;
+static int *delta = NULL;               /* states * columns */
+static int *dict = NULL;                /* closest state on the fail chain with output */
+static struct trigger **out = NULL;     /* triggers ending in a state */
+static struct trigger **always = NULL;  /* regexes without a literal */
+static int nalways = 0;
+
+static METRIC matches;
+static METRIC rebuilds;
+
+/* longest literal run every match of an extended regex has to contain */
+static char *trigger_required(const char *re)
+{
+    char best[256], run[256];
+    int blen = 0, rlen = 0, depth = 0, was;
+    const char *p = re;
+    char c;
+
+    while (*p)
+    {
+        c = *p;
+        was = depth;
+
+        if (c == '[')
+        {
+            p++;
+            if (*p == '^')
+            {
+                p++;
+            }
+            if (*p == ']')
+            {
+                p++;
+            }
+            while (*p && *p != ']')
+            {
+                p++;
+            }
+            if (*p)
+            {
+                p++;
+            }
+            c = '\0';
+        }
+        else if (c == '\\' && p[1] && !isalnum((unsigned char)p[1]))
+        {
+            c = p[1];
+            p += 2;
+        }
+        else if (c == '\\')
+        {
+            p += p[1] ? 2 : 1;
+            c = '\0';
+        }
+        else if (c == '(' || c == ')')
+        {
+            depth += c == '(' ? 1 : -1;
+            p++;
+            c = '\0';
+        }
+        else if (was > 0)
+        {
+            p++;
+            continue;
+        }
+        else if (c == '|')
+        {
+            return NULL;
+        }
+        else if (c == '*' || c == '?' || c == '{')
+        {
+            /* the previous atom is optional */
+            if (rlen > 0)
+            {
+                rlen--;
+            }
+            if (c == '{')
+            {
+                while (*p && *p != '}')
+                {
+                    p++;
+                }
+            }
+            if (*p)
+            {
+                p++;
+            }
+            c = '\0';
+        }
+        else if (c == '+' || c == '.' || c == '^' || c == '$')
+        {
+            p++;
+            c = '\0';
+        }
+        else
+        {
+            p++;
+        }
+
+        /* groups may be optional or alternated, entering one ends the run */
+        if (was > 0 && depth > 0)
+        {
+            continue;
+        }
+
+        if (c != '\0' && rlen < (int)sizeof(run) - 1)
+        {
+            run[rlen++] = tolower((unsigned char)c);
+            continue;
+        }
+
+        if (rlen > blen)
+        {
+            memcpy(best, run, rlen);
+            blen = rlen;
+        }
+
+        rlen = 0;
+    }
+
+    if (rlen > blen)
+    {
+        memcpy(best, run, rlen);
+        blen = rlen;
+    }
+
+    if (blen == 0)
+    {
+        return NULL;
+    }
+
+    best[blen] = '\0';
+    return bot_strdup(best);
+}
+
+static void trigger_destroy(struct trigger *t)
+{
+    if (t->flags & TRIGGER_REGEX)
+    {
+        regfree(&t->re);
+    }
+
+    bot_free(t->pattern);
+    bot_free(t->literal);
+    bot_free(t);
+}
+
+static void trigger_build()
+{
+    struct trigger *t, *next;
+    int total = 1, i, c, s, u, f, head, tail;
+    int *fail, *queue;
+    unsigned char *p;
+
+    dirty = 0;
+    nalways = 0;
+    memset(map, 0, sizeof(map));
+    columns = 1;
+
+    for (t = TAILQ_FIRST(&trigger_h); t; t = next)
+    {
+        next = TAILQ_NEXT(t, triggers);
+
+        if (t->removed)
+        {
+            TAILQ_REMOVE(&trigger_h, t, triggers);
+            trigger_destroy(t);
+            continue;
+        }
+
+        t->next_out = NULL;
+
+        if (t->literal == NULL)
+        {
+            nalways++;
+            continue;
+        }
+
+        total += t->len;
+
+        for (p = (unsigned char *)t->literal; *p; p++)
+        {
+            if (map[*p] == 0)
+            {
+                map[*p] = columns++;
+            }
+        }
+    }
+
+    /* both cases of a letter share a column, matching lowercases for free */
+    for (c = 'A'; c <= 'Z'; c++)
+    {
+        map[c] = map[tolower(c)];
+    }
+
+    bot_free(delta);
+    bot_free(dict);
+    bot_free(out);
+    bot_free(always);
+
+    delta = bot_malloc(total * columns * sizeof(int));
+    dict = bot_calloc(total, sizeof(int));
+    out = bot_calloc(total, sizeof(struct trigger *));
+    always = bot_malloc((nalways + 1) * sizeof(struct trigger *));
+    fail = bot_calloc(total, sizeof(int));
+    queue = bot_malloc(total * sizeof(int));
+
+    for (i = 0; i < total * columns; i++)
+    {
+        delta[i] = -1;
+    }
+
+    /* trie */
+    states = 1;
+    nalways = 0;
+    TAILQ_FOREACH(t, &trigger_h, triggers)
+    {
+        if (t->literal == NULL)
+        {
+            always[nalways++] = t;
+            continue;
+        }
+
+        s = 0;
+        for (p = (unsigned char *)t->literal; *p; p++)
+        {
+            if (delta[s * columns + map[*p]] < 0)
+            {
+                delta[s * columns + map[*p]] = states++;
+            }
+            s = delta[s * columns + map[*p]];
+        }
+
+        t->next_out = out[s];
+        out[s] = t;
+    }
+
+    /* breadth first: fail links, dictionary links and the missing transitions */
+    head = tail = 0;
+    for (c = 0; c < columns; c++)
+    {
+        if ((u = delta[c]) < 0)
+        {
+            delta[c] = 0;
+        }
+        else
+        {
+            fail[u] = 0;
+            queue[tail++] = u;
+        }
+    }
+
+    while (head < tail)
+    {
+        s = queue[head++];
+
+        for (c = 0; c < columns; c++)
+        {
+            u = delta[s * columns + c];
+            f = delta[fail[s] * columns + c];
+
+            if (u < 0)
+            {
+                delta[s * columns + c] = f;
+                continue;
+            }
+
+            fail[u] = f;
+            dict[u] = out[f] ? f : dict[f];
+            queue[tail++] = u;
+        }
+    }
+
+    bot_free(fail);
+    bot_free(queue);
+
+    metrics_add(rebuilds, 1);
+
+    if (log_enabled(LOG_DEBUG))
+    {
+        log_lprintf(LOG_DEBUG, "Automaton rebuilt: %d states, %d columns, %d unfiltered regexes\n", states, columns, nalways);
+    }
+}
+
+int trigger_register(const char *pattern, int flags, TRIGGER_CB cb)
+{
+    struct trigger *t;
+    char *p;
+
+    if (pattern == NULL || pattern[0] == '\0')
+    {
+        return -1;
+    }
+
+    t = bot_calloc(sizeof(struct trigger), 1);
+    t->flags = flags;
+    t->cb = cb;
+    t->ctx = bot_get_ctx();
+    t->pattern = bot_strdup(pattern);
+
+    if (flags & TRIGGER_REGEX)
+    {
+        if (regcomp(&t->re, pattern, REG_EXTENDED | ((flags & TRIGGER_NOCASE) ? REG_ICASE : 0)) != 0)
+        {
+            bot_free(t->pattern);
+            bot_free(t);
+            return -1;
+        }
+
+        t->literal = trigger_required(pattern);
+    }
+    else
+    {
+        t->literal = bot_strdup(pattern);
+        for (p = t->literal; *p; p++)
+        {
+            *p = tolower((unsigned char)*p);
+        }
+    }
+
+    t->len = t->literal ? strlen(t->literal) : 0;
+    t->id = next_id++;
+
+    TAILQ_INSERT_TAIL(&trigger_h, t, triggers);
+    dirty = 1;
+
+    return t->id;
+}
+
+void trigger_unregister(int id)
+{
+    struct trigger *t;
+
+    TAILQ_FOREACH(t, &trigger_h, triggers)
+    {
+        if (t->id == id)
+        {
+            t->removed = 1;
+            dirty = 1;
+            break;
+        }
+    }
+}
+
+void trigger_unregister_cb(TRIGGER_CB cb)
+{
+    struct trigger *t;
+
+    TAILQ_FOREACH(t, &trigger_h, triggers)
+    {
+        if (t->cb == cb)
+        {
+            t->removed = 1;
+            dirty = 1;
+        }
+    }
+}
+
+void trigger_irc(const char *prefix, const char *command, const char *params, const char *trail)
+{
+    struct trigger_match m[TRIGGER_MATCHES];
+    struct trigger *candidates[TRIGGER_MATCHES];
+    struct trigger *t;
+    const unsigned char *p;
+    regmatch_t rm;
+    int n = 0, nc = 0, s = 0, i, o, start;
+    unsigned long began;
+
+    if (trail == NULL || strcmp(command, "PRIVMSG") != 0)
+    {
+        return;
+    }
+
+    if (dirty)
+    {
+        trigger_build();
+    }
+
+    if (states <= 1 && nalways == 0)
+    {
+        return;
+    }
+
+    generation++;
+
+    for (p = (const unsigned char *)trail, i = 0; *p; p++, i++)
+    {
+        s = delta[s * columns + map[*p]];
+
+        for (o = out[s] ? s : dict[s]; o; o = dict[o])
+        {
+            for (t = out[o]; t; t = t->next_out)
+            {
+                if (t->flags & TRIGGER_REGEX)
+                {
+                    if (t->seen != generation && nc < TRIGGER_MATCHES)
+                    {
+                        t->seen = generation;
+                        candidates[nc++] = t;
+                    }
+                    continue;
+                }
+
+                start = i - t->len + 1;
+
+                if (!(t->flags & TRIGGER_NOCASE) && memcmp(trail + start, t->pattern, t->len) != 0)
+                {
+                    continue;
+                }
+
+                if (n < TRIGGER_MATCHES)
+                {
+                    m[n].t = t;
+                    m[n].offset = start;
+                    m[n].len = t->len;
+                    n++;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < nalways && nc < TRIGGER_MATCHES; i++)
+    {
+        candidates[nc++] = always[i];
+    }
+
+    for (i = 0; i < nc && n < TRIGGER_MATCHES; i++)
+    {
+        if (regexec(&candidates[i]->re, trail, 1, &rm, 0) == 0)
+        {
+            m[n].t = candidates[i];
+            m[n].offset = rm.rm_so;
+            m[n].len = rm.rm_eo - rm.rm_so;
+            n++;
+        }
+    }
+
+    metrics_add(matches, n);
+
+    /* callbacks may change triggers, that only marks them */
+    for (i = 0; i < n; i++)
+    {
+        if (!m[i].t->removed && !bot_disabled(m[i].t->ctx) && !bot_shed(m[i].t->ctx))
+        {
+            began = watchdog_begin(m[i].t->ctx, "trigger", *(void **)(&m[i].t->cb));
+            bot_ctx(m[i].t->ctx);
+            m[i].t->cb(prefix, params, trail, m[i].offset, m[i].len);
+            bot_ctx(trigger_ctx);
+            watchdog_end(began);
+        }
+    }
+}
+
+int trigger_init(CTX ctx)
+{
+    trigger_ctx = ctx;
+
+    TAILQ_INIT(&trigger_h);
+
+    if (bot_require("irc", 1) < 1)
+    {
+        log_printf("irc module required\n");
+        return -1;
+    }
+
+    matches = metrics_counter("corebot_trigger_matches_total", NULL);
+    rebuilds = metrics_counter("corebot_trigger_rebuilds_total", NULL);
+
+    trigger_build();
+    irc_register_cb(trigger_irc);
+
+    return 1;
+}
+
+void trigger_free()
+{
+    struct trigger *t;
+
+    irc_unregister_cb(trigger_irc);
+
+    while ( (t = TAILQ_FIRST(&trigger_h)) )
+    {
+        TAILQ_REMOVE(&trigger_h, t, triggers);
+        trigger_destroy(t);
+    }
+
+    bot_free(delta);
+    bot_free(dict);
+    bot_free(out);
+    bot_free(always);
+    delta = dict = NULL;
+    out = always = NULL;
+    states = 0;
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define TRIGGER_NOCASE  1       /* ascii case insensitive */
+#define TRIGGER_REGEX   2       /* pattern is a POSIX extended regex */
+
+/* prefix, target, trail, offset and length of the match in trail */
+typedef void (*TRIGGER_CB)(const char *, const char *, const char *, int, int);
+
+/* returns an id for trigger_unregister() or -1 if the pattern is invalid */
+int trigger_register(const char *pattern, int flags, TRIGGER_CB cb);
+void trigger_unregister(int id);
+void trigger_unregister_cb(TRIGGER_CB cb);
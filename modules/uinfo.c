@@ -16,8 +16,10 @@
 
 #include "../bot.h"
 #include "irc.h"
+#include "server.h"
 
 int uinfo_registered = 0;
+static int uinfo_connection = 0;
 
 void uinfo_irc(const char *prefix, const char *command, const char *params, const char *trail)
 {
@@ -26,6 +28,13 @@ void uinfo_irc(const char *prefix, const char *command, const char *params, cons
     const char *username;
     const char *realname;
 
+    /* reconnected, everything starts over */
+    if (uinfo_connection != server_connection())
+    {
+        uinfo_connection = server_connection();
+        uinfo_registered = 0;
+    }
+
     if (!uinfo_registered && (strcmp(params, "*") == 0 || strcmp(params, "AUTH") == 0))
     {
         uinfo_registered = 1;
@@ -36,7 +45,7 @@ void uinfo_irc(const char *prefix, const char *command, const char *params, cons
 
         if (nick == NULL || username == NULL || realname == NULL)
         {
-            log_printf("nick, username or realname not defined in config, can't login\n");
+            log_lprintf(LOG_ERROR, "nick, username or realname not defined in config, can't login\n");
             return;
         }
 
@@ -57,20 +66,36 @@ void uinfo_irc(const char *prefix, const char *command, const char *params, cons
         else
         {
             log_printf("%s\n", trail);
-            log_printf("We are out of nicknames, can't register.\n");
+            log_lprintf(LOG_ERROR, "We are out of nicknames, can't register.\n");
         }
     }
 }
 
 int uinfo_init(CTX ctx)
 {
+    const char *s;
+
     if (bot_require("irc", 1) < 1)
     {
         log_printf("irc module required\n");
         return -1;
     }
 
+    if ((s = handoff_get("registered", NULL)))
+    {
+        uinfo_registered = atoi(s);
+        uinfo_connection = server_connection();
+    }
+
     irc_register_cb(uinfo_irc);
 
     return 1;
 }
+
+void uinfo_save()
+{
+    char buf[16];
+
+    snprintf(buf, sizeof(buf), "%d", uinfo_registered);
+    handoff_set("registered", buf, -1);
+}
@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "bot.h"
+#include "trace.h"
+
+#include <unistd.h>
+
+#define TRACE_SPANS     256
+#define TRACE_LINE      128
+
+struct trace_event
+{
+    const char *cat;
+    const char *name;
+    unsigned long start;
+    unsigned long end;
+};
+
+int trace_on = 0;
+
+static FILE *trace_fh = NULL;
+static char trace_path[256];
+static unsigned long trace_sample = 0;  /* record every nth line */
+static unsigned long trace_slow = 0;    /* record lines slower than this (ns) */
+static unsigned long trace_lines = 0;
+static unsigned long trace_id = 0;
+static int trace_sampled;
+
+static char trace_line[TRACE_LINE];
+static unsigned long trace_start;
+static struct trace_event trace_events[TRACE_SPANS];
+static int trace_count;
+
+/*
+ * Opens the trace to go on with what an earlier run or the process before
+ * an upgrade wrote: the closing bracket is taken off and the array
+ * continues. Anything that isn't a trace is started over.
+ */
+static FILE *trace_open(const char *file)
+{
+    char tail[2];
+    FILE *fh;
+    long size;
+
+    if ((fh = fopen(file, "a+")) == NULL)
+    {
+        return NULL;
+    }
+
+    fseek(fh, 0, SEEK_END);
+    size = ftell(fh);
+
+    if (size > 0 && (fseek(fh, 0, SEEK_SET) != 0 || fgetc(fh) != '['))
+    {
+        fclose(fh);
+
+        if ((fh = fopen(file, "w")) == NULL)
+        {
+            return NULL;
+        }
+
+        size = 0;
+    }
+
+    if (size >= 2 && fseek(fh, -2, SEEK_END) == 0 && fread(tail, 1, 2, fh) == 2 && memcmp(tail, "]\n", 2) == 0)
+    {
+        if (ftruncate(fileno(fh), size - 2) < 0)
+        {
+            fclose(fh);
+            return NULL;
+        }
+    }
+
+    fseek(fh, 0, SEEK_END);
+    fprintf(fh, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"corebot\"}}\n",
+            size > 0 ? "," : "[\n", (int)getpid());
+    fflush(fh);
+
+    return fh;
+}
+
+void trace_init()
+{
+    const char *file;
+    const char *s;
+
+    file = config_get("trace_file");
+
+    s = config_get("trace_sample");
+    trace_sample = s ? strtoul(s, NULL, 10) : 0;
+
+    s = config_get("trace_slow_us");
+    trace_slow = s ? strtoul(s, NULL, 10) * 1000 : 0;
+
+    if (file == NULL || (trace_sample == 0 && trace_slow == 0))
+    {
+        trace_free();
+        return;
+    }
+
+    /* a SIGHUP only changing what's sampled keeps writing where it was */
+    if (trace_fh == NULL || strcmp(file, trace_path) != 0)
+    {
+        trace_free();
+
+        if ((trace_fh = trace_open(file)) == NULL)
+        {
+            log_lprintf(LOG_ERROR, "trace: error opening %s\n", file);
+            return;
+        }
+
+        snprintf(trace_path, sizeof(trace_path), "%s", file);
+    }
+
+    log_printf("Tracing to %s (sample 1/%lu, slow %luus)\n", file, trace_sample, trace_slow / 1000);
+}
+
+void trace_begin(const char *line, unsigned long start)
+{
+    if (trace_fh == NULL)
+    {
+        return;
+    }
+
+    trace_lines++;
+    trace_sampled = trace_sample && trace_lines % trace_sample == 0;
+
+    /* with a slow threshold every line is recorded and most are dropped */
+    if (!trace_sampled && !trace_slow)
+    {
+        return;
+    }
+
+    snprintf(trace_line, TRACE_LINE, "%s", line);
+    trace_start = start;
+    trace_count = 0;
+    trace_on = 1;
+}
+
+void trace_add(const char *cat, const char *name, unsigned long start, unsigned long end)
+{
+    if (trace_count < TRACE_SPANS)
+    {
+        trace_events[trace_count].cat = cat;
+        trace_events[trace_count].name = name;
+        trace_events[trace_count].start = start;
+        trace_events[trace_count].end = end;
+        trace_count++;
+    }
+}
+
+static void trace_escape(FILE *fh, const char *s)
+{
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+        {
+            fputc('\\', fh);
+            fputc(*s, fh);
+        }
+        else if ((unsigned char)*s < 0x20)
+        {
+            fprintf(fh, "\\u%04x", (unsigned char)*s);
+        }
+        else
+        {
+            fputc(*s, fh);
+        }
+    }
+}
+
+static void trace_write(const char *cat, const char *name, unsigned long start, unsigned long end, const char *line)
+{
+    fprintf(trace_fh, ",{\"name\":\"");
+    trace_escape(trace_fh, name);
+    fprintf(trace_fh, "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":1,\"args\":{\"line\":%lu",
+            cat, start / 1000.0, (end - start) / 1000.0, (int)getpid(), trace_id);
+
+    if (line)
+    {
+        fprintf(trace_fh, ",\"text\":\"");
+        trace_escape(trace_fh, line);
+        fprintf(trace_fh, "\"");
+    }
+
+    fprintf(trace_fh, "}}\n");
+}
+
+void trace_end()
+{
+    unsigned long end;
+    int i;
+
+    if (!trace_on)
+    {
+        return;
+    }
+
+    trace_on = 0;
+    end = metrics_now();
+
+    if (!trace_sampled && end - trace_start < trace_slow)
+    {
+        return;
+    }
+
+    trace_id++;
+    trace_write("line", "line", trace_start, end, trace_line);
+
+    for (i = 0; i < trace_count; i++)
+    {
+        trace_write(trace_events[i].cat, trace_events[i].name, trace_events[i].start, trace_events[i].end, NULL);
+    }
+
+    fflush(trace_fh);
+}
+
+void trace_free()
+{
+    trace_on = 0;
+
+    if (trace_fh)
+    {
+        fprintf(trace_fh, "]\n");
+        fclose(trace_fh);
+        trace_fh = NULL;
+    }
+}
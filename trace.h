@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Per-line tracing in the Chrome trace event format (chrome://tracing,
+ * Perfetto). The server module starts a trace for each received line,
+ * dispatchers record spans while it is active and the whole line is
+ * written out if it was sampled or turned out slow.
+ */
+
+extern int trace_on;            /* the current line is being recorded */
+
+void trace_init();
+void trace_begin(const char *line, unsigned long start);
+void trace_add(const char *cat, const char *name, unsigned long start, unsigned long end);
+void trace_end();
+void trace_free();
+
+/* end is only evaluated when the line is traced */
+#define trace_span(cat, name, start, end) \
+    do { if (trace_on) trace_add(cat, name, start, end); } while (0)
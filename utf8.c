@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "bot.h"
+
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* CP1252 0x80 - 0x9F, the five unassigned bytes map to themselves */
+static const unsigned short cp1252[32] =
+{
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178
+};
+
+static const char *names[] = { "ascii", "utf8", "latin1", "cp1252" };
+
+/* first byte at or after p that is not ASCII, end if there is none */
+static const unsigned char *utf8_ascii(const unsigned char *p, const unsigned char *end)
+{
+#ifdef __SSE2__
+    int mask;
+
+    while (end - p >= 16)
+    {
+        if ((mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p))))
+        {
+            /* the lowest set bit is the first byte with its high bit set */
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+#else
+    unsigned long w;
+    const unsigned long high = ~0UL / 255 * 128;
+
+    while (end - p >= (int)sizeof(w))
+    {
+        memcpy(&w, p, sizeof(w));
+
+        if (w & high)
+        {
+            break;
+        }
+
+        p += sizeof(w);
+    }
+#endif
+
+    while (p < end && *p < 0x80)
+    {
+        p++;
+    }
+
+    return p;
+}
+
+/* length of the valid multibyte sequence at p, 0 if there is none */
+static int utf8_seq(const unsigned char *p, const unsigned char *end)
+{
+    unsigned char lo = 0x80, hi = 0xBF;
+    int n, i;
+
+    if (*p >= 0xC2 && *p <= 0xDF)
+    {
+        n = 2;
+    }
+    else if (*p >= 0xE0 && *p <= 0xEF)
+    {
+        n = 3;
+
+        /* no overlong forms or surrogates */
+        if (*p == 0xE0)
+        {
+            lo = 0xA0;
+        }
+        else if (*p == 0xED)
+        {
+            hi = 0x9F;
+        }
+    }
+    else if (*p >= 0xF0 && *p <= 0xF4)
+    {
+        n = 4;
+
+        /* no overlong forms or anything past U+10FFFF */
+        if (*p == 0xF0)
+        {
+            lo = 0x90;
+        }
+        else if (*p == 0xF4)
+        {
+            hi = 0x8F;
+        }
+    }
+    else
+    {
+        return 0;
+    }
+
+    if (end - p < n || p[1] < lo || p[1] > hi)
+    {
+        return 0;
+    }
+
+    for (i = 2; i < n; i++)
+    {
+        if (p[i] < 0x80 || p[i] > 0xBF)
+        {
+            return 0;
+        }
+    }
+
+    return n;
+}
+
+int utf8_check(const char *s, int len)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    const unsigned char *end = p + len;
+    int ret = ENC_ASCII;
+    int n;
+
+    while ((p = utf8_ascii(p, end)) < end)
+    {
+        if ((n = utf8_seq(p, end)) == 0)
+        {
+            return ENC_INVALID;
+        }
+
+        ret = ENC_UTF8;
+        p += n;
+    }
+
+    return ret;
+}
+
+int utf8_encoding(const char *name)
+{
+    int i;
+
+    for (i = ENC_ASCII; i <= ENC_CP1252; i++)
+    {
+        if (strcasecmp(name, names[i]) == 0)
+        {
+            return i;
+        }
+    }
+
+    /* the usual spellings */
+    if (strcasecmp(name, "utf-8") == 0)
+    {
+        return ENC_UTF8;
+    }
+
+    if (strcasecmp(name, "iso-8859-1") == 0 || strcasecmp(name, "latin-1") == 0)
+    {
+        return ENC_LATIN1;
+    }
+
+    if (strcasecmp(name, "windows-1252") == 0)
+    {
+        return ENC_CP1252;
+    }
+
+    return ENC_INVALID;
+}
+
+const char *utf8_name(int enc)
+{
+    return enc >= ENC_ASCII && enc <= ENC_CP1252 ? names[enc] : "invalid";
+}
+
+int utf8_from(int enc, const char *s, int len, char *out)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    const unsigned char *end = p + len;
+    unsigned char *o = (unsigned char *)out;
+    unsigned int c;
+
+    while (p < end)
+    {
+        c = *p++;
+
+        if (c < 0x80)
+        {
+            *o++ = c;
+            continue;
+        }
+
+        if (enc == ENC_CP1252 && c < 0xA0)
+        {
+            c = cp1252[c - 0x80];
+        }
+
+        if (c < 0x800)
+        {
+            *o++ = 0xC0 | (c >> 6);
+        }
+        else
+        {
+            *o++ = 0xE0 | (c >> 12);
+            *o++ = 0x80 | ((c >> 6) & 0x3F);
+        }
+
+        *o++ = 0x80 | (c & 0x3F);
+    }
+
+    *o = '\0';
+
+    return o - (unsigned char *)out;
+}
+
+int utf8_to(int enc, const char *s, int len, char *out)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    const unsigned char *end = p + len;
+    unsigned char *o = (unsigned char *)out;
+    unsigned long c;
+    int n, i;
+
+    while (p < end)
+    {
+        if (*p < 0x80 || (n = utf8_seq(p, end)) == 0)
+        {
+            /* ASCII and stray bytes go out as they are */
+            *o++ = *p++;
+            continue;
+        }
+
+        c = *p & (0x7F >> n);
+
+        for (i = 1; i < n; i++)
+        {
+            c = (c << 6) | (p[i] & 0x3F);
+        }
+
+        p += n;
+
+        if (enc == ENC_CP1252 && c < 0xA0)
+        {
+            /* C1 controls only exist as the unassigned bytes */
+            c = cp1252[c - 0x80] == c ? c : '?';
+        }
+        else if (enc == ENC_CP1252 && c > 0xFF)
+        {
+            for (i = 0; i < 32 && cp1252[i] != c; i++);
+            c = i < 32 ? (unsigned long)(0x80 + i) : '?';
+        }
+        else if (enc != ENC_LATIN1 && enc != ENC_CP1252)
+        {
+            /* ASCII */
+            c = '?';
+        }
+        else if (c > 0xFF)
+        {
+            c = '?';
+        }
+
+        *o++ = c;
+    }
+
+    *o = '\0';
+
+    return o - (unsigned char *)out;
+}
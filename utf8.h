@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * UTF-8 validation and conversion from and to the legacy 8-bit encodings
+ * still common on IRC.
+ *
+ * Validation skips runs of ASCII a vector (or a word) at a time and only
+ * looks at multibyte sequences byte by byte, so the usual all-ASCII line
+ * costs little more than its length in loads. Overlong forms, surrogates
+ * and code points past U+10FFFF are invalid as per RFC 3629.
+ */
+
+#define ENC_INVALID     -1
+#define ENC_ASCII       0
+#define ENC_UTF8        1
+#define ENC_LATIN1      2
+#define ENC_CP1252      3
+
+/* ENC_ASCII, ENC_UTF8 or ENC_INVALID */
+int utf8_check(const char *s, int len);
+/* ENC_* of an encoding name like "cp1252", ENC_INVALID if unknown */
+int utf8_encoding(const char *name);
+const char *utf8_name(int enc);
+
+/* out must hold 3 * len + 1 bytes, returns the length written */
+int utf8_from(int enc, const char *s, int len, char *out);
+/* out must hold len + 1 bytes, what enc can't encode becomes '?' */
+int utf8_to(int enc, const char *s, int len, char *out);
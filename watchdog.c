@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "bot.h"
+#include "watchdog.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <execinfo.h>
+
+#define WATCHDOG_DEPTH  16
+#define WATCHDOG_FRAMES 64
+#define WATCHDOG_NAME   32
+
+struct watchdog_call
+{
+    CTX mod;
+    const char *what;
+    void *fn;
+    unsigned long start;
+    int reported;               /* this or a call inside it was logged */
+    char name[WATCHDOG_NAME];   /* copies for the watchdog thread, mod may be unloaded under it */
+    char label[WATCHDOG_NAME];
+};
+
+static struct watchdog_call calls[WATCHDOG_DEPTH];
+static volatile int depth = 0;
+static volatile unsigned long outer_start = 0;     /* 0 when idle */
+static volatile unsigned long outer_seq = 0;
+
+static unsigned long budget = 0;                    /* ns, 0 when off */
+static volatile unsigned long limit = 0;
+static int disable_after = 0;
+
+static pthread_t main_thread;
+static pthread_t watchdog_thread;
+static pid_t running_pid = 0;               /* the process whose thread it is */
+
+/* "module.so(function+0x0) [0x...]" from backtrace_symbols, or "?" */
+static void watchdog_name(void *fn, char *buf, int size)
+{
+    char **sym;
+    char *p;
+
+    snprintf(buf, size, "?");
+
+    if (fn && (sym = backtrace_symbols(&fn, 1)))
+    {
+        if ((p = strchr(sym[0], '(')) && p[1] != '+' && p[1] != ')')
+        {
+            snprintf(buf, size, "%.*s", (int)strcspn(p + 1, "+)"), p + 1);
+        }
+
+        free(sym);
+    }
+}
+
+static void watchdog_report(struct watchdog_call *c, unsigned long took)
+{
+    char labels[128], name[128];
+    CTX ctx = bot_get_ctx();
+
+    watchdog_name(c->fn, name, sizeof(name));
+
+    bot_ctx(NULL);
+    log_lprintf(LOG_WARN, "Stall: %s %s %s took %.1f ms (budget %.1f ms)\n", c->mod ? c->mod->name : "core", c->what, name, took / 1e6, budget / 1e6);
+
+    snprintf(labels, sizeof(labels), "module=\"%s\"", c->mod ? c->mod->name : "core");
+    metrics_add(metrics_counter("corebot_stalls_total", labels), 1);
+
+    if (c->mod && disable_after > 0 && ++c->mod->stalls >= disable_after && !c->mod->disabled)
+    {
+        c->mod->disabled = 1;
+        log_lprintf(LOG_ERROR, "Disabled %s after %d stalls, send SIGHUP to enable it again\n", c->mod->name, c->mod->stalls);
+    }
+
+    bot_ctx(ctx);
+}
+
+static void watchdog_copy(char *dst, const char *src)
+{
+    int i;
+
+    for (i = 0; src[i] && i < WATCHDOG_NAME - 1; i++)
+    {
+        dst[i] = src[i];
+    }
+
+    dst[i] = '\0';
+}
+
+unsigned long watchdog_begin(struct bot_module *mod, const char *what, void *fn)
+{
+    unsigned long now = metrics_now();
+    struct watchdog_call *c;
+
+    if (budget == 0)
+    {
+        return now;
+    }
+
+    if (depth < WATCHDOG_DEPTH)
+    {
+        c = &calls[depth];
+        c->mod = mod;
+        c->what = what;
+        c->fn = fn;
+        c->start = now;
+        c->reported = 0;
+        watchdog_copy(c->name, mod ? mod->name : "core");
+        watchdog_copy(c->label, what);
+    }
+
+    if (depth++ == 0)
+    {
+        outer_seq++;
+        outer_start = now;
+    }
+
+    return now;
+}
+
+unsigned long watchdog_end(unsigned long start)
+{
+    unsigned long now = metrics_now();
+    struct watchdog_call *c;
+
+    if (budget == 0 || depth == 0)
+    {
+        return now;
+    }
+
+    if (--depth == 0)
+    {
+        outer_start = 0;
+    }
+
+    if (depth >= WATCHDOG_DEPTH)
+    {
+        return now;
+    }
+
+    c = &calls[depth];
+
+    if (now - start > budget && !c->reported)
+    {
+        watchdog_report(c, now - start);
+        c->reported = 1;
+    }
+
+    /* whoever called it was only as slow as this */
+    if (c->reported && depth > 0)
+    {
+        calls[depth - 1].reported = 1;
+    }
+
+    return now;
+}
+
+static void watchdog_signal(int sig)
+{
+    void *frames[WATCHDOG_FRAMES];
+    int n = backtrace(frames, WATCHDOG_FRAMES);
+
+    backtrace_symbols_fd(frames, n, STDOUT_FILENO);
+}
+
+/*
+ * Runs beside the main thread, so it only reads one copy of depth and the
+ * names copied into calls[] (possibly torn, never out of bounds) and
+ * writes straight to stdout: log_lprintf() looks at the main thread's
+ * context and uses localtime().
+ */
+static void *watchdog_run(void *arg)
+{
+    struct timespec ts;
+    unsigned long start, seq, dumped = 0;
+    struct watchdog_call *c;
+    char name[WATCHDOG_NAME], label[WATCHDOG_NAME], when[64], buf[256];
+    struct tm tm;
+    time_t now;
+    int d, len;
+
+    for (;;)
+    {
+        /* a few looks per limit, at least one every 100 ms */
+        ts.tv_sec = 0;
+        ts.tv_nsec = limit && limit / 4 < 100000000UL ? limit / 4 : 100000000UL;
+        nanosleep(&ts, NULL);
+
+        seq = outer_seq;
+        start = outer_start;
+
+        if (limit == 0 || start == 0 || seq == dumped || metrics_now() - start < limit)
+        {
+            continue;
+        }
+
+        /* it returned after all */
+        if ((d = depth) <= 0)
+        {
+            continue;
+        }
+
+        dumped = seq;
+        c = &calls[(d > WATCHDOG_DEPTH ? WATCHDOG_DEPTH : d) - 1];
+        memcpy(name, c->name, sizeof(name));
+        memcpy(label, c->label, sizeof(label));
+        name[sizeof(name) - 1] = label[sizeof(label) - 1] = '\0';
+
+        now = time(NULL);
+        when[0] = '\0';
+        if (localtime_r(&now, &tm))
+        {
+            strftime(when, sizeof(when), "%c ", &tm);
+        }
+
+        len = snprintf(buf, sizeof(buf), "%sStalled for %.1f ms in %s %s, backtrace follows\n", when,
+            (metrics_now() - start) / 1e6, name, label);
+
+        if (write(STDOUT_FILENO, buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1) < 0)
+        {
+            continue;
+        }
+
+        pthread_kill(main_thread, SIGURG);
+    }
+
+    return NULL;
+}
+
+void watchdog_init()
+{
+    void *frames[1];
+    const char *s;
+    CTX mod;
+
+    budget = (s = config_get("stall_budget_ms")) ? strtoul(s, NULL, 10) * 1000000UL : 100000000UL;
+    limit = (s = config_get("stall_limit_ms")) ? strtoul(s, NULL, 10) * 1000000UL : 1000000000UL;
+    disable_after = (s = config_get("stall_disable")) ? atoi(s) : 0;
+
+    /* a new chance for everyone */
+    TAILQ_FOREACH(mod, &modules_head, bot_modules)
+    {
+        if (mod->disabled)
+        {
+            log_printf("Enabled %s again\n", mod->name);
+        }
+
+        mod->disabled = 0;
+        mod->stalls = 0;
+    }
+
+    /* a forked child isn't inside the calls its parent was in */
+    if (running_pid != getpid())
+    {
+        depth = 0;
+        outer_start = 0;
+    }
+
+    if (budget == 0 || limit == 0 || running_pid == getpid())
+    {
+        return;
+    }
+
+    /* backtrace() loads what it needs on first use, not in a handler */
+    backtrace(frames, 1);
+
+    main_thread = pthread_self();
+    signal(SIGURG, watchdog_signal);
+
+    /* a forked child has no watchdog until it starts its own */
+    if (pthread_create(&watchdog_thread, NULL, watchdog_run, NULL) == 0)
+    {
+        pthread_detach(watchdog_thread);
+        running_pid = getpid();
+    }
+}
+
+void watchdog_free()
+{
+    budget = 0;
+    limit = 0;
+}
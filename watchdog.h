@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2011 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Stall detection. Everything runs on the one thread, so every hook and
+ * callback the core and the dispatchers call is bracketed with
+ * watchdog_begin() and watchdog_end(). A call over the budget is logged
+ * with its module and callback (the innermost one, not the dispatchers
+ * around it) and a module that does it stall_disable times is disabled:
+ * its hooks and callbacks are skipped until the next SIGHUP.
+ *
+ * A watchdog thread looks at the outermost call in progress and when it
+ * has run over the hard limit, signals the main thread to log a
+ * backtrace of wherever it is stuck.
+ */
+
+struct bot_module;
+
+void watchdog_init();
+void watchdog_free();
+
+/* both return the current time in ns like metrics_now() */
+unsigned long watchdog_begin(struct bot_module *mod, const char *what, void *fn);
+unsigned long watchdog_end(unsigned long start);
+
+/* the callback's owner has been disabled for stalling */
+#define bot_disabled(ctx) ((ctx) && (ctx)->disabled)